@@ -0,0 +1,537 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "age.h"
+#include "bench.h"
+#include "storage.h"
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+#include "bitmap.h"
+#include "magazine.h"
+#include "util.h"
+
+#define AGE_DIRS     16
+#define AGE_MAX_IO   (1 << 20)
+#define AGE_HIST     32 // free run buckets, by power of two
+
+typedef struct age_file {
+    int id;
+    int64_t size;
+} age_file;
+
+typedef struct age {
+    int64_t image_bytes;
+    int     flags;       // for storage_new
+    long    ops;         // churn operations
+    int     max_files;   // live files the churn keeps at most
+    int     fill;        // percent of the data area the churn stays under
+    int     probe_files; // files the throughput probe writes
+    int64_t probe_bytes; // size of each
+    int64_t io;          // probe I/O size
+    uint64_t seed;
+
+    age_file* files;     // live churn files
+    int     nfiles;
+    int     next_id;
+    int64_t live_pages;
+    long    done[4];     // creates, appends, truncates, deletes
+    long    enospc;
+    char*   buf;
+} age;
+
+// xorshift64, so runs are repeatable
+static uint64_t
+age_rand(age* aa)
+{
+    aa->seed ^= aa->seed << 13;
+    aa->seed ^= aa->seed >> 7;
+    aa->seed ^= aa->seed << 17;
+    return aa->seed;
+}
+
+// in [2^lo_bits, 2^(hi_bits + 1)), log-uniform so small sizes dominate
+// the way they do on real disks
+static int64_t
+age_size(age* aa, int lo_bits, int hi_bits)
+{
+    int bits = lo_bits + age_rand(aa) % (hi_bits - lo_bits + 1);
+    return (1 << bits) + age_rand(aa) % (1 << bits);
+}
+
+static void
+age_path(char* buf, size_t size, int id)
+{
+    snprintf(buf, size, "/age/d%d/f%d", id % AGE_DIRS, id);
+}
+
+static int
+data_pages()
+{
+    superblock* sb = get_super();
+    return sb->page_count - sb->data_start;
+}
+
+// after a failed write the file may have grown part way; ask again
+static void
+age_resync(age* aa, age_file* ff)
+{
+    char path[64];
+    struct stat st;
+    age_path(path, sizeof(path), ff->id);
+    aa->live_pages -= bytes_to_pages(ff->size);
+    ff->size = (storage_stat(path, &st) == 0) ? st.st_size : 0;
+    aa->live_pages += bytes_to_pages(ff->size);
+}
+
+static int
+age_write(age* aa, age_file* ff, int64_t bytes)
+{
+    char path[64];
+    age_path(path, sizeof(path), ff->id);
+    for (int64_t done = 0; done < bytes; ) {
+        int64_t nn = min(bytes - done, AGE_MAX_IO);
+        int rv = storage_write(path, aa->buf, nn, ff->size);
+        if (rv < 0) {
+            age_resync(aa, ff);
+            return rv;
+        }
+        aa->live_pages += bytes_to_pages(ff->size + nn) - bytes_to_pages(ff->size);
+        ff->size += nn;
+        done += nn;
+    }
+    return 0;
+}
+
+static void
+age_delete(age* aa, int ii)
+{
+    char path[64];
+    age_path(path, sizeof(path), aa->files[ii].id);
+    int rv = storage_unlink(path);
+    assert(rv == 0);
+    aa->live_pages -= bytes_to_pages(aa->files[ii].size);
+    aa->files[ii] = aa->files[--aa->nfiles];
+    aa->done[3] += 1;
+}
+
+static void
+age_step(age* aa)
+{
+    char path[64];
+    int over = aa->live_pages * 100 >= (int64_t) data_pages() * aa->fill;
+    int pick = age_rand(aa) % 100;
+
+    // under the fill line: 30% create, 40% append, 10% truncate, 20%
+    // delete; over it, only truncate and delete
+    if (aa->nfiles == 0 || (!over && pick < 30 && aa->nfiles < aa->max_files)) {
+        age_file* ff = &(aa->files[aa->nfiles++]);
+        ff->id = aa->next_id++;
+        ff->size = 0;
+        age_path(path, sizeof(path), ff->id);
+        int rv = storage_mknod(path, 0100644, 0);
+        assert(rv == 0);
+        aa->done[0] += 1;
+        if (age_write(aa, ff, age_size(aa, 9, 19)) == -ENOSPC) {
+            aa->enospc += 1;
+        }
+        return;
+    }
+
+    int ii = age_rand(aa) % aa->nfiles;
+    age_file* ff = &(aa->files[ii]);
+    if (!over && pick < 70) {
+        aa->done[1] += 1;
+        if (age_write(aa, ff, age_size(aa, 12, 17)) == -ENOSPC) {
+            aa->enospc += 1;
+            age_delete(aa, ii);
+        }
+    }
+    else if ((over ? pick < 40 : pick < 80) && ff->size > 0) {
+        int64_t size = age_rand(aa) % ff->size;
+        age_path(path, sizeof(path), ff->id);
+        int rv = storage_truncate(path, size);
+        assert(rv == 0);
+        aa->live_pages -= bytes_to_pages(ff->size) - bytes_to_pages(size);
+        ff->size = size;
+        aa->done[2] += 1;
+    }
+    else {
+        age_delete(aa, ii);
+    }
+}
+
+static void
+age_churn(age* aa)
+{
+    char path[64];
+    storage_mknod("/age", 040755, 1);
+    for (int dd = 0; dd < AGE_DIRS; ++dd) {
+        snprintf(path, sizeof(path), "/age/d%d", dd);
+        storage_mknod(path, 040755, 1);
+    }
+
+    int64_t t0 = bench_now_ns();
+    for (long ii = 0; ii < aa->ops; ++ii) {
+        age_step(aa);
+    }
+    double secs = (bench_now_ns() - t0) / 1e9;
+
+    printf(" \"aging\": {\"ops\": %ld, \"seconds\": %.3f, \"ops_per_sec\": %.1f,"
+           " \"creates\": %ld, \"appends\": %ld, \"truncates\": %ld, \"deletes\": %ld,"
+           " \"enospc\": %ld, \"live_files\": %d, \"live_pages\": %ld},\n",
+           aa->ops, secs, secs > 0 ? aa->ops / secs : 0.0,
+           aa->done[0], aa->done[1], aa->done[2], aa->done[3],
+           aa->enospc, aa->nfiles, (long) aa->live_pages);
+}
+
+// extents per live file, and the lengths of the free runs in the data
+// area; higher extents_per_file and free_scatter mean a more
+// fragmented image (both are 1 and 0 on a fresh one)
+static void
+age_report(age* aa)
+{
+    long extents = 0;
+    int nonempty = 0;
+    int max_ext = 0;
+    int multi = 0;
+    char path[64];
+    for (int ii = 0; ii < aa->nfiles; ++ii) {
+        if (aa->files[ii].size == 0) {
+            continue;
+        }
+        age_path(path, sizeof(path), aa->files[ii].id);
+        int count = inode_extents(get_inode(tree_lookup(path)));
+        extents += count;
+        nonempty += 1;
+        max_ext = max(max_ext, count);
+        multi += (count > 1);
+    }
+
+    // pages parked in magazines read as used; put them back first
+    thread_cache_drain_all();
+    superblock* sb = get_super();
+    void* bm = get_pbitmap();
+    long hist[AGE_HIST] = {0};
+    long runs = 0;
+    long free_pages = 0;
+    int largest = 0;
+    for (int pp = sb->data_start; pp < sb->page_count; ) {
+        int start = bitmap_next_zero(bm, pp, sb->page_count);
+        if (start < 0) {
+            break;
+        }
+        int end = bitmap_next_one(bm, start, sb->page_count);
+        if (end < 0) {
+            end = sb->page_count;
+        }
+        int len = end - start;
+        hist[31 - __builtin_clz(len)] += 1;
+        runs += 1;
+        free_pages += len;
+        largest = max(largest, len);
+        pp = end;
+    }
+
+    printf(" \"fragmentation\": {\"files\": %d, \"extents\": %ld, \"extents_per_file\": %.3f,"
+           " \"max_extents\": %d, \"multi_extent_pct\": %.1f,\n",
+           nonempty, extents, nonempty ? (double) extents / nonempty : 0.0,
+           max_ext, nonempty ? 100.0 * multi / nonempty : 0.0);
+    printf("     \"free_pages\": %ld, \"free_runs\": %ld, \"largest_free_run\": %d,"
+           " \"mean_free_run\": %.1f, \"free_scatter\": %.3f,\n     \"free_run_hist\": {",
+           free_pages, runs, largest, runs ? (double) free_pages / runs : 0.0,
+           free_pages ? 1.0 - (double) largest / free_pages : 0.0);
+    int first = 1;
+    for (int bb = 0; bb < AGE_HIST; ++bb) {
+        if (hist[bb] == 0) {
+            continue;
+        }
+        if (bb == 0) {
+            printf("\"1\": %ld", hist[bb]);
+        }
+        else {
+            printf("%s\"%d-%d\": %ld", first ? "" : ", ", 1 << bb, (2 << bb) - 1, hist[bb]);
+        }
+        first = 0;
+    }
+    printf("}},\n");
+}
+
+// the image is a sparse file, so the first store to each page faults
+// in fresh memory; take that hit up front on both images, or the fresh
+// one looks slower than it is
+static void
+age_prefault()
+{
+    if (!pages_mapped()) {
+        return;
+    }
+    superblock* sb = get_super();
+    for (int pp = sb->data_start; pp < sb->page_count; ++pp) {
+        volatile char* page = pages_get_page(pp);
+        page[0] = page[0];
+    }
+}
+
+typedef struct probe_result {
+    double write_mb_s;   // each NAN when its phase didn't finish
+    double read_mb_s;
+    double create_s;
+    double extents;
+} probe_result;
+
+// "key": val, or "key": null for a metric whose phase failed, so a
+// short run never passes for a fast one
+static void
+json_num(const char* key, double val, int prec)
+{
+    if (isnan(val)) {
+        printf("\"%s\": null", key);
+    }
+    else {
+        printf("\"%s\": %.*f", key, prec, val);
+    }
+}
+
+static double
+rate(double amount, double secs)
+{
+    return secs > 0 ? amount / secs : 0.0;
+}
+
+// the same fixed workload on either image: large sequential files
+// written and read back through handles, then a burst of small files;
+// everything it makes is removed again. Rates come from the bytes and
+// files each phase actually got through; once one fails, it and the
+// phases after it report null
+static int
+age_probe(age* aa, const char* name, probe_result* pr)
+{
+    lat_log lat;
+    memset(&lat, 0, sizeof(lat));
+    char path[64];
+    age_prefault();
+    int64_t count = aa->probe_bytes / aa->io;
+    open_file** ofs = calloc(aa->probe_files, sizeof(open_file*));
+    int rv = 0;
+
+    storage_mknod("/probe", 040755, 1);
+    int64_t written = 0;
+    int64_t t0 = bench_now_ns();
+    for (int ff = 0; ff < aa->probe_files && rv >= 0; ++ff) {
+        snprintf(path, sizeof(path), "/probe/p%d", ff);
+        if ((rv = storage_mknod(path, 0100644, 0)) < 0 ||
+            (rv = storage_open(path, 0, &(ofs[ff]))) < 0) {
+            break;
+        }
+        for (int64_t ii = 0; ii < count && rv >= 0; ++ii) {
+            int64_t t1 = bench_now_ns();
+            rv = storage_write_fh(ofs[ff], aa->buf, aa->io, ii * aa->io);
+            lat_add(&lat, bench_now_ns() - t1);
+            written += (rv > 0) ? rv : 0;
+        }
+    }
+    double secs = (bench_now_ns() - t0) / 1e9;
+    pr->write_mb_s = (rv < 0) ? NAN : rate(written, secs) / (1 << 20);
+    double write_p99 = (rv < 0) ? NAN : lat_pct(&lat, 99);
+
+    long extents = 0;
+    for (int ff = 0; ff < aa->probe_files; ++ff) {
+        if (ofs[ff]) {
+            extents += inode_extents(get_inode(ofs[ff]->inum));
+        }
+    }
+    pr->extents = (rv < 0) ? NAN : (double) extents / aa->probe_files;
+
+    int64_t got = 0;
+    lat.count = 0;
+    t0 = bench_now_ns();
+    for (int ff = 0; ff < aa->probe_files && rv >= 0; ++ff) {
+        for (int64_t ii = 0; ii < count && rv >= 0; ++ii) {
+            int64_t t1 = bench_now_ns();
+            rv = storage_read_fh(ofs[ff], aa->buf, aa->io, ii * aa->io);
+            lat_add(&lat, bench_now_ns() - t1);
+            got += (rv > 0) ? rv : 0;
+        }
+    }
+    secs = (bench_now_ns() - t0) / 1e9;
+    pr->read_mb_s = (rv < 0) ? NAN : rate(got, secs) / (1 << 20);
+    double read_p99 = (rv < 0) ? NAN : lat_pct(&lat, 99);
+
+    int smalls = 1000;
+    int created = 0;
+    lat.count = 0;
+    t0 = bench_now_ns();
+    for (int ii = 0; ii < smalls && rv >= 0; ++ii) {
+        int64_t t1 = bench_now_ns();
+        snprintf(path, sizeof(path), "/probe/s%d", ii);
+        if ((rv = storage_mknod(path, 0100644, 0)) >= 0) {
+            rv = storage_write(path, aa->buf, 4096, 0);
+        }
+        lat_add(&lat, bench_now_ns() - t1);
+        created += (rv >= 0);
+    }
+    secs = (bench_now_ns() - t0) / 1e9;
+    pr->create_s = (rv < 0) ? NAN : rate(created, secs);
+    double create_p99 = (rv < 0) ? NAN : lat_pct(&lat, 99);
+
+    printf(" \"%s\": {", name);
+    json_num("write_mb_per_sec", pr->write_mb_s, 1);
+    printf(", ");
+    json_num("write_p99_ns", write_p99, 0);
+    printf(", ");
+    json_num("read_mb_per_sec", pr->read_mb_s, 1);
+    printf(", ");
+    json_num("read_p99_ns", read_p99, 0);
+    printf(",\n     ");
+    json_num("creates_per_sec", pr->create_s, 1);
+    printf(", ");
+    json_num("create_p99_ns", create_p99, 0);
+    printf(", ");
+    json_num("extents_per_file", pr->extents, 2);
+    printf(", \"error\": %d},\n", rv < 0 ? rv : 0);
+
+    for (int ii = 0; ii < smalls; ++ii) {
+        snprintf(path, sizeof(path), "/probe/s%d", ii);
+        storage_unlink(path);
+    }
+    for (int ff = 0; ff < aa->probe_files; ++ff) {
+        if (ofs[ff]) {
+            storage_release(ofs[ff]);
+        }
+        snprintf(path, sizeof(path), "/probe/p%d", ff);
+        storage_unlink(path);
+    }
+    storage_unlink("/probe");
+    free(ofs);
+    lat_free(&lat);
+    return rv < 0 ? rv : 0;
+}
+
+// null when either side is
+static double
+ratio(double aged, double fresh)
+{
+    if (isnan(aged) || isnan(fresh)) {
+        return NAN;
+    }
+    return fresh > 0 ? aged / fresh : 0.0;
+}
+
+static int
+age_usage()
+{
+    fprintf(stderr, "age image [key=value...]\n");
+    fprintf(stderr, "  size=256M map=extent|indirect ops=50000 files=2000 fill=60"
+                    " probe_files=4 probe=16M io=64K seed=N\n");
+    return 1;
+}
+
+int
+age_main(const char* img, int argc, char* argv[])
+{
+    age aa;
+    memset(&aa, 0, sizeof(aa));
+    aa.image_bytes = 256 << 20;
+    aa.ops = 50000;
+    aa.max_files = 2000;
+    aa.fill = 60;
+    aa.probe_files = 4;
+    aa.probe_bytes = 16 << 20;
+    aa.io = 64 << 10;
+    aa.seed = 88172645463325252ULL;
+
+    for (int ii = 0; ii < argc; ++ii) {
+        char* eq = strchr(argv[ii], '=');
+        if (!eq) {
+            return age_usage();
+        }
+
+        const char* val = eq + 1;
+        int rv = 0;
+        if (strncmp(argv[ii], "size=", 5) == 0) {
+            rv = ((aa.image_bytes = parse_size(val)) < NUFS_PAGE_SIZE) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "map=", 4) == 0) {
+            aa.flags = streq(val, "indirect") ? NUFS_BLOCKMAP : 0;
+            rv = (aa.flags || streq(val, "extent")) ? 0 : -1;
+        }
+        else if (strncmp(argv[ii], "ops=", 4) == 0) {
+            rv = ((aa.ops = atol(val)) < 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "files=", 6) == 0) {
+            rv = ((aa.max_files = atoi(val)) <= 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "fill=", 5) == 0) {
+            aa.fill = atoi(val);
+            rv = (aa.fill > 0 && aa.fill < 100) ? 0 : -1;
+        }
+        else if (strncmp(argv[ii], "probe_files=", 12) == 0) {
+            rv = ((aa.probe_files = atoi(val)) <= 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "probe=", 6) == 0) {
+            rv = ((aa.probe_bytes = parse_size(val)) <= 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "io=", 3) == 0) {
+            aa.io = parse_size(val);
+            rv = (aa.io > 0 && aa.io <= AGE_MAX_IO) ? 0 : -1;
+        }
+        else if (strncmp(argv[ii], "seed=", 5) == 0) {
+            aa.seed = strtoull(val, 0, 10) | 1;
+        }
+        else {
+            rv = -1;
+        }
+        if (rv < 0) {
+            return age_usage();
+        }
+    }
+
+    aa.files = calloc(aa.max_files, sizeof(age_file));
+    aa.buf = malloc(AGE_MAX_IO);
+    memset(aa.buf, 0x5a, AGE_MAX_IO);
+    probe_result fresh;
+    probe_result aged;
+
+    // the last run's aged image is kept; start over
+    unlink(img);
+    if (storage_new(img, aa.image_bytes, 0, aa.flags) < 0) {
+        return 1;
+    }
+    printf("{\"image\": {\"bytes\": %ld, \"map\": \"%s\", \"page_count\": %d, \"inode_count\": %d},\n",
+           (long) aa.image_bytes, aa.flags ? "indirect" : "extent",
+           get_super()->page_count, get_super()->inode_count);
+    int rv = age_probe(&aa, "fresh", &fresh);
+    storage_free();
+
+    // same geometry, from scratch, for the churn
+    unlink(img);
+    if (storage_new(img, aa.image_bytes, 0, aa.flags) < 0) {
+        return 1;
+    }
+    age_churn(&aa);
+    age_report(&aa);
+    if (age_probe(&aa, "aged", &aged) < 0) {
+        rv = -1;
+    }
+    printf(" \"aged_vs_fresh\": {");
+    json_num("write", ratio(aged.write_mb_s, fresh.write_mb_s), 3);
+    printf(", ");
+    json_num("read", ratio(aged.read_mb_s, fresh.read_mb_s), 3);
+    printf(", ");
+    json_num("create", ratio(aged.create_s, fresh.create_s), 3);
+    printf("}}\n");
+    storage_free();
+
+    if (rv < 0) {
+        fprintf(stderr, "age: a probe failed (see its \"error\"); try a bigger size= or lower fill=\n");
+    }
+    free(aa.files);
+    free(aa.buf);
+    return rv < 0 ? 1 : 0;
+}
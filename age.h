@@ -0,0 +1,11 @@
+#ifndef AGE_H
+#define AGE_H
+
+// "nufstool age image [key=value...]": measures a fresh image, then
+// ages it with a long create / append / truncate / delete churn straight
+// through storage_*, reports how fragmented files and free space ended
+// up, and measures it again. The aged image is left behind in image.
+
+int age_main(const char* img, int argc, char* argv[]);
+
+#endif
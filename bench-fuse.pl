@@ -0,0 +1,298 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Getopt::Long;
+use POSIX ();
+use Time::HiRes qw(time);
+use Cwd qw(abs_path);
+
+# End-to-end benchmark through the kernel: mounts a fresh image with a
+# multithreaded nufsmount, runs each workload from several processes at
+# once against mnt/, unmounts, and compares the numbers with a saved
+# baseline. Exits 1 if any metric is worse than the baseline by more
+# than the threshold.
+#
+#   perl bench-fuse.pl [--workers N] [--threshold PCT] [--size SIZE]
+#                      [--baseline FILE] [--save] [--stream-mb MB]
+#                      [--small-files N] [--backend NAME] [--cache SIZE]
+#
+# --backend and --cache go to nufsmount; a baseline saved under one
+# backend and a run under another compare the two side by side.
+
+my $workers     = 4;
+my $threshold   = 20;   # percent
+my $size        = "1G";
+my $baseline    = "bench-fuse.baseline";
+my $save        = 0;
+my $stream_mb   = 32;   # per worker
+my $small_files = 500;  # per worker
+my $stat_rounds = 5;
+my $mixed_ops   = 5000; # per worker
+my $backend     = "mmap";
+my $cache       = "64M";
+
+GetOptions(
+    "workers=i"     => \$workers,
+    "threshold=f"   => \$threshold,
+    "size=s"        => \$size,
+    "baseline=s"    => \$baseline,
+    "save"          => \$save,
+    "stream-mb=i"   => \$stream_mb,
+    "small-files=i" => \$small_files,
+    "backend=s"     => \$backend,
+    "cache=s"       => \$cache,
+) or die "usage: $0 [--workers N] [--threshold PCT] [--size SIZE]\n"
+     . "       [--baseline FILE] [--save] [--stream-mb MB] [--small-files N]\n"
+     . "       [--backend mmap|pread|uring] [--cache SIZE]\n";
+
+my $image = "bench-fuse.nufs";
+my $mounted = 0;
+my $mount_pid = 0;
+my $parent = $$;
+
+sub is_mounted {
+    my $mnt = abs_path("mnt");
+    open my $fh, "<", "/proc/mounts" or return 0;
+    while (<$fh>) {
+        my @fields = split;
+        return 1 if $fields[1] eq $mnt;
+    }
+    return 0;
+}
+
+# The image is formatted at --size by nufstool and then mounted, so
+# nufsmount has to open an existing image rather than format its own.
+# If it exits instead of mounting, say so now rather than after the
+# wait runs out.
+sub mount {
+    system("rm -f $image");
+    system("./nufstool new $image $size > /dev/null") == 0
+        or die "can't create $image\n";
+    system("mkdir -p mnt");
+    my $pid = $mount_pid = fork();
+    defined($pid) or die "fork: $!\n";
+    if ($pid == 0) {
+        open STDOUT, ">", "bench-fuse.log" or POSIX::_exit(1);
+        open STDERR, ">&", \*STDOUT or POSIX::_exit(1);
+        exec("./nufsmount", "--backend=$backend", "--cache=$cache", "-f", "mnt", $image)
+            or POSIX::_exit(127);
+    }
+    for (1..200) {
+        last if is_mounted();
+        if (waitpid($pid, POSIX::WNOHANG()) == $pid) {
+            die "nufsmount exited (status " . ($? >> 8) . ") without mounting $image;"
+              . " it has to open existing images. See bench-fuse.log\n";
+        }
+        Time::HiRes::sleep(0.05);
+    }
+    is_mounted() or die "nufsmount didn't come up; see bench-fuse.log\n";
+    $mounted = 1;
+}
+
+sub unmount {
+    system("fusermount -u mnt") if $mounted;
+    waitpid($mount_pid, 0) if $mount_pid;
+    $mounted = 0;
+    $mount_pid = 0;
+    system("rm -f $image");
+}
+
+END {
+    unmount() if $mounted && $$ == $parent;
+}
+
+# Runs $code->($id, $lat) in $workers child processes at once; each
+# logs one latency per operation (in us) to $lat. Returns the wall
+# time and all the latencies, sorted.
+sub in_parallel {
+    my ($name, $code) = @_;
+    my @pids;
+    my $t0 = time;
+    for my $id (0..$workers - 1) {
+        my $pid = fork();
+        defined($pid) or die "fork: $!\n";
+        if ($pid == 0) {
+            open my $lat, ">", "bench-fuse.lat.$id" or POSIX::_exit(1);
+            my $ok = eval { $code->($id, $lat); 1 };
+            close $lat;
+            POSIX::_exit($ok ? 0 : 1);
+        }
+        push @pids, $pid;
+    }
+
+    my $failed = 0;
+    for my $pid (@pids) {
+        waitpid($pid, 0);
+        $failed ||= $?;
+    }
+    my $secs = time - $t0;
+
+    my @lat;
+    for my $id (0..$workers - 1) {
+        open my $fh, "<", "bench-fuse.lat.$id" or next;
+        push @lat, map { 0 + $_ } <$fh>;
+        close $fh;
+        unlink "bench-fuse.lat.$id";
+    }
+    die "$name: a worker failed\n" if $failed;
+    return ($secs, [sort { $a <=> $b } @lat]);
+}
+
+sub timed {
+    my ($lat, $code) = @_;
+    my $t0 = time;
+    $code->();
+    printf $lat "%.1f\n", (time - $t0) * 1e6;
+}
+
+sub pct {
+    my ($lat, $pp) = @_;
+    return 0 unless @$lat;
+    return $lat->[int($pp / 100 * $#$lat + 0.5)];
+}
+
+my %result;
+my $MB = 1 << 20;
+my $block = "x" x $MB;
+
+mount();
+
+# streaming write, then a streaming copy of what was written
+my ($secs, $lat) = in_parallel("stream_write", sub {
+    my ($id, $lat) = @_;
+    open my $fh, ">", "mnt/stream$id" or die;
+    for (1..$stream_mb) {
+        timed($lat, sub { syswrite($fh, $block) == $MB or die });
+    }
+    close $fh;
+});
+$result{stream_write_mb_s} = $workers * $stream_mb / $secs;
+$result{stream_write_p99_us} = pct($lat, 99);
+
+($secs, $lat) = in_parallel("stream_copy", sub {
+    my ($id, $lat) = @_;
+    open my $in, "<", "mnt/stream$id" or die;
+    open my $out, ">", "mnt/copy$id" or die;
+    my $buf;
+    for (1..$stream_mb) {
+        timed($lat, sub {
+            sysread($in, $buf, $MB) == $MB or die;
+            syswrite($out, $buf) == $MB or die;
+        });
+    }
+    close $in;
+    close $out;
+});
+$result{stream_copy_mb_s} = $workers * $stream_mb / $secs;
+$result{stream_copy_p99_us} = pct($lat, 99);
+
+# lots of small files in a shallow tree, like unpacking a tarball
+($secs, $lat) = in_parallel("untar", sub {
+    my ($id, $lat) = @_;
+    mkdir "mnt/tree$id";
+    for my $dd (0..9) {
+        mkdir "mnt/tree$id/d$dd";
+    }
+    for my $ii (0..$small_files - 1) {
+        my $data = "y" x (1024 * (1 + $ii % 8));
+        timed($lat, sub {
+            open my $fh, ">", "mnt/tree$id/d" . ($ii % 10) . "/f$ii" or die;
+            syswrite($fh, $data);
+            close $fh;
+        });
+    }
+});
+$result{untar_files_s} = $workers * $small_files / $secs;
+$result{untar_p99_us} = pct($lat, 99);
+
+# every worker stats every small file, a few times over
+($secs, $lat) = in_parallel("stat", sub {
+    my ($id, $lat) = @_;
+    for (1..$stat_rounds) {
+        for my $ww (0..$workers - 1) {
+            for my $ii (0..$small_files - 1) {
+                my $path = "mnt/tree$ww/d" . ($ii % 10) . "/f$ii";
+                timed($lat, sub { stat($path) or die });
+            }
+        }
+    }
+});
+$result{stat_ops_s} = scalar(@$lat) / $secs;
+$result{stat_p99_us} = pct($lat, 99);
+
+# random 4k reads and writes, 70/30, on each worker's stream file
+($secs, $lat) = in_parallel("mixed", sub {
+    my ($id, $lat) = @_;
+    srand($id + 1);
+    open my $fh, "+<", "mnt/stream$id" or die;
+    my $page = "z" x 4096;
+    my $buf;
+    my $pages = $stream_mb * 256;
+    for (1..$mixed_ops) {
+        my $at = int(rand($pages)) * 4096;
+        if (rand() < 0.7) {
+            timed($lat, sub { sysseek($fh, $at, 0); sysread($fh, $buf, 4096) == 4096 or die });
+        }
+        else {
+            timed($lat, sub { sysseek($fh, $at, 0); syswrite($fh, $page) == 4096 or die });
+        }
+    }
+    close $fh;
+});
+$result{mixed_ops_s} = $workers * $mixed_ops / $secs;
+$result{mixed_p99_us} = pct($lat, 99);
+
+unmount();
+
+# latencies (_us) are better lower, everything else higher
+sub worse_by {
+    my ($name, $now, $then) = @_;
+    return 0 if $then == 0;
+    my $change = ($now - $then) / $then * 100;
+    return ($name =~ /_us$/) ? $change : -$change;
+}
+
+my %base;
+if (open my $fh, "<", $baseline) {
+    while (<$fh>) {
+        next if /^\s*(#|$)/;
+        my ($name, $value) = split;
+        $base{$name} = $value;
+    }
+    close $fh;
+}
+
+my $regressed = 0;
+# gain is the change relative to the baseline, positive when better
+printf "%-22s %12s %12s %9s\n", "metric", "now", "baseline", "gain";
+for my $name (sort keys %result) {
+    my $now = $result{$name};
+    if (exists $base{$name}) {
+        my $worse = worse_by($name, $now, $base{$name});
+        my $flag = "";
+        if ($worse > $threshold) {
+            $flag = "  REGRESSED";
+            $regressed = 1;
+        }
+        printf "%-22s %12.1f %12.1f %+8.1f%%%s\n", $name, $now, $base{$name}, -$worse, $flag;
+    }
+    else {
+        printf "%-22s %12.1f %12s\n", $name, $now, "-";
+    }
+}
+
+if ($save) {
+    open my $fh, ">", $baseline or die "can't write $baseline\n";
+    say $fh "# bench-fuse.pl --workers $workers --size $size --backend $backend";
+    for my $name (sort keys %result) {
+        printf $fh "%s %.1f\n", $name, $result{$name};
+    }
+    close $fh;
+    say "saved baseline to $baseline";
+}
+elsif (!%base) {
+    say "no baseline in $baseline yet; make bench-fuse-save records one";
+}
+
+exit($regressed ? 1 : 0);
@@ -0,0 +1,524 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <bsd/string.h>
+
+#include "bench.h"
+#include "storage.h"
+#include "pages.h"
+#include "inode.h"
+#include "directory.h"
+#include "stats.h"
+#include "util.h"
+
+#define BENCH_MAX_IOS 8
+
+typedef struct bench {
+    int64_t image_bytes;
+    int     flags;       // for storage_new
+    int64_t file_bytes;  // file the read / write workloads use
+    int64_t ios[BENCH_MAX_IOS];
+    int     nios;
+    int     files;       // create / unlink storm size
+    int     depth;       // lookup path depth
+    int     dirsize;     // entries in the scanned directory
+    uint64_t seed;
+
+    // the workload being measured
+    lat_log lat;
+    int64_t start_ns;
+    stats_snapshot before;
+    int     printed;     // workloads emitted so far, for the commas
+} bench;
+
+int64_t
+bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+lat_add(lat_log* ll, uint64_t ns)
+{
+    if (ll->count == ll->cap) {
+        ll->cap = ll->cap ? ll->cap * 2 : 4096;
+        ll->ns = realloc(ll->ns, ll->cap * sizeof(uint64_t));
+        assert(ll->ns);
+    }
+    ll->ns[ll->count++] = ns;
+}
+
+static int
+cmp_u64(const void* aa, const void* bb)
+{
+    uint64_t xx = *(const uint64_t*) aa;
+    uint64_t yy = *(const uint64_t*) bb;
+    return (xx > yy) - (xx < yy);
+}
+
+uint64_t
+lat_pct(lat_log* ll, double pct)
+{
+    if (ll->count == 0) {
+        return 0;
+    }
+    qsort(ll->ns, ll->count, sizeof(uint64_t), cmp_u64);
+    size_t ii = (size_t)(pct / 100.0 * (ll->count - 1) + 0.5);
+    return ll->ns[ii];
+}
+
+void
+lat_free(lat_log* ll)
+{
+    free(ll->ns);
+    memset(ll, 0, sizeof(lat_log));
+}
+
+// xorshift64, so runs are repeatable
+static uint64_t
+bench_rand(bench* bb)
+{
+    bb->seed ^= bb->seed << 13;
+    bb->seed ^= bb->seed >> 7;
+    bb->seed ^= bb->seed << 17;
+    return bb->seed;
+}
+
+static void
+bench_begin(bench* bb)
+{
+    bb->lat.count = 0;
+    stats_snapshot_take(&(bb->before));
+    bb->start_ns = bench_now_ns();
+}
+
+// one JSON object per workload; io and bytes are 0 for metadata ones,
+// extents is -1 when there's no single file to count them on
+static void
+bench_end(bench* bb, const char* name, int64_t io, int64_t bytes, int extents)
+{
+    double secs = (bench_now_ns() - bb->start_ns) / 1e9;
+    stats_snapshot after;
+    stats_snapshot_take(&after);
+    uint64_t* c0 = bb->before.counters;
+    uint64_t* c1 = after.counters;
+    size_t ops = bb->lat.count;
+
+    printf("%s\n    {\"name\": \"%s\", \"io\": %ld, \"ops\": %zu, \"seconds\": %.6f,"
+           " \"ops_per_sec\": %.1f, \"mb_per_sec\": %.1f,\n",
+           bb->printed ? "," : "", name, (long) io, ops, secs,
+           secs > 0 ? ops / secs : 0.0, secs > 0 ? bytes / secs / (1 << 20) : 0.0);
+    printf("     \"lat_ns\": {\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, \"max\": %lu},\n",
+           (unsigned long) lat_pct(&(bb->lat), 50), (unsigned long) lat_pct(&(bb->lat), 90),
+           (unsigned long) lat_pct(&(bb->lat), 99), (unsigned long) lat_pct(&(bb->lat), 99.9),
+           (unsigned long) lat_pct(&(bb->lat), 100));
+    printf("     \"alloc\": {\"pages_alloced\": %lu, \"pages_freed\": %lu, \"inodes_alloced\": %lu,"
+           " \"inodes_freed\": %lu, \"bitmap_scans\": %lu, \"bitmap_words\": %lu, \"extents\": %d},\n",
+           (unsigned long)(c1[STAT_PAGES_ALLOCED] - c0[STAT_PAGES_ALLOCED]),
+           (unsigned long)(c1[STAT_PAGES_FREED] - c0[STAT_PAGES_FREED]),
+           (unsigned long)(c1[STAT_INODES_ALLOCED] - c0[STAT_INODES_ALLOCED]),
+           (unsigned long)(c1[STAT_INODES_FREED] - c0[STAT_INODES_FREED]),
+           (unsigned long)(c1[STAT_BITMAP_SCANS] - c0[STAT_BITMAP_SCANS]),
+           (unsigned long)(c1[STAT_BITMAP_WORDS] - c0[STAT_BITMAP_WORDS]), extents);
+    printf("     \"lookups\": {\"total\": %lu, \"dcache_hits\": %lu},\n",
+           (unsigned long)(c1[STAT_LOOKUPS] - c0[STAT_LOOKUPS]),
+           (unsigned long)(c1[STAT_DCACHE_HITS] - c0[STAT_DCACHE_HITS]));
+    printf("     \"cache\": {\"misses\": %lu, \"pages_read\": %lu, \"pages_written\": %lu}}",
+           (unsigned long)(c1[STAT_CACHE_MISSES] - c0[STAT_CACHE_MISSES]),
+           (unsigned long)(c1[STAT_PAGES_READ] - c0[STAT_PAGES_READ]),
+           (unsigned long)(c1[STAT_PAGES_WRITTEN] - c0[STAT_PAGES_WRITTEN]));
+    bb->printed += 1;
+}
+
+// a workload an error cut short: its name and the error, and none of
+// the numbers, which would only make it look fast
+static void
+bench_fail(bench* bb, const char* name, int rv)
+{
+    printf("%s\n    {\"name\": \"%s\", \"error\": %d}", bb->printed ? "," : "", name, rv);
+    bb->printed += 1;
+}
+
+#define TIMED(bb, expr)                                \
+    do {                                               \
+        int64_t t0_ = bench_now_ns();                  \
+        expr;                                          \
+        lat_add(&((bb)->lat), bench_now_ns() - t0_);   \
+    } while (0)
+
+static int
+file_extents(const char* path)
+{
+    int inum = tree_lookup(path);
+    return (inum < 0) ? -1 : inode_extents(get_inode(inum));
+}
+
+static void
+io_name(char* buf, size_t size, const char* kind, int64_t io)
+{
+    if (io >= (1 << 20) && io % (1 << 20) == 0) {
+        snprintf(buf, size, "%s_%ldM", kind, (long)(io >> 20));
+    }
+    else if (io >= 1024 && io % 1024 == 0) {
+        snprintf(buf, size, "%s_%ldK", kind, (long)(io >> 10));
+    }
+    else {
+        snprintf(buf, size, "%s_%ld", kind, (long) io);
+    }
+}
+
+static const char* io_kinds[] = { "seq_write", "seq_read", "rand_write", "rand_read" };
+
+// 0 when a storage call moved want bytes (or want is 0 and it
+// succeeded), else its error; a short transfer counts as -EIO
+static int
+bench_check(int rv, int64_t want)
+{
+    if (rv < 0) {
+        return rv;
+    }
+    return (want && rv != want) ? -EIO : 0;
+}
+
+// sequential and random read and write through an open handle, the
+// way nufsmount drives them; want flags the four in workload_names order
+static int
+bench_io(bench* bb, int64_t io, const int* want)
+{
+    char path[64];
+    char name[64];
+    snprintf(path, sizeof(path), "/io_%ld", (long) io);
+    open_file* of = 0;
+    int rv = storage_mknod(path, 0100644, 0);
+    if (rv >= 0) {
+        rv = storage_open(path, 0, &of);
+    }
+    if (rv < 0) {
+        io_name(name, sizeof(name), io_kinds[0], io);
+        bench_fail(bb, name, rv);
+    }
+
+    char* buf = malloc(io);
+    memset(buf, 0x5a, io);
+    int64_t count = bb->file_bytes / io;
+
+    // the sequential write always runs: the file has to exist for the
+    // reads either way
+    for (int kk = 0; kk < 4 && rv >= 0; ++kk) {
+        if (kk > 0 && !want[kk]) {
+            continue;
+        }
+        bench_begin(bb);
+        for (int64_t ii = 0; ii < count && rv >= 0; ++ii) {
+            int64_t at = (kk < 2) ? ii * io : (int64_t)(bench_rand(bb) % count) * io;
+            if (kk % 2 == 0) {
+                TIMED(bb, rv = storage_write_fh(of, buf, io, at));
+            }
+            else {
+                TIMED(bb, rv = storage_read_fh(of, buf, io, at));
+            }
+            rv = bench_check(rv, io);
+        }
+        io_name(name, sizeof(name), io_kinds[kk], io);
+        if (rv < 0) {
+            bench_fail(bb, name, rv);
+        }
+        else if (want[kk]) {
+            bench_end(bb, name, io, count * io, file_extents(path));
+        }
+    }
+
+    free(buf);
+    if (of) {
+        storage_release(of);
+    }
+    int urv = storage_unlink(path);
+    return (rv < 0) ? rv : urv;
+}
+
+// create, then unlink, files small enough to fit one page
+static int
+bench_storm(bench* bb, int create, int unlink)
+{
+    char path[64];
+    char data[100];
+    memset(data, 'x', sizeof(data));
+    int rv = storage_mknod("/storm", 040755, 1);
+
+    bench_begin(bb);
+    for (int ii = 0; ii < bb->files && rv >= 0; ++ii) {
+        snprintf(path, sizeof(path), "/storm/f%d", ii);
+        TIMED(bb, rv = storage_mknod(path, 0100644, 0);
+                  if (rv >= 0) { rv = storage_write(path, data, sizeof(data), 0); });
+        rv = bench_check(rv, sizeof(data));
+    }
+    if (rv < 0) {
+        bench_fail(bb, "create", rv);
+    }
+    else if (create) {
+        bench_end(bb, "create", 0, (int64_t) bb->files * sizeof(data), -1);
+    }
+
+    if (rv >= 0) {
+        bench_begin(bb);
+        for (int ii = 0; ii < bb->files && rv >= 0; ++ii) {
+            snprintf(path, sizeof(path), "/storm/f%d", ii);
+            TIMED(bb, rv = storage_unlink(path));
+        }
+        if (rv < 0) {
+            bench_fail(bb, "unlink", rv);
+        }
+        else if (unlink) {
+            bench_end(bb, "unlink", 0, 0, -1);
+        }
+    }
+
+    // whatever a failure left behind
+    for (int ii = 0; rv < 0 && ii < bb->files; ++ii) {
+        snprintf(path, sizeof(path), "/storm/f%d", ii);
+        storage_unlink(path);
+    }
+    storage_unlink("/storm");
+    return rv;
+}
+
+// stat of a file depth directories down
+static int
+bench_lookup(bench* bb)
+{
+    char* path = calloc(1, 8 * (bb->depth + 2));
+    int rv = 0;
+    int made = 0;
+    for (int ii = 0; ii < bb->depth && rv >= 0; ++ii) {
+        sprintf(path + strlen(path), "/d%d", ii);
+        rv = storage_mknod(path, 040755, 1);
+        made += (rv >= 0);
+    }
+    if (rv >= 0) {
+        strcat(path, "/leaf");
+        rv = storage_mknod(path, 0100644, 0);
+        made += (rv >= 0);
+    }
+
+    struct stat st;
+    int reps = bb->files * 10;
+    bench_begin(bb);
+    for (int ii = 0; ii < reps && rv >= 0; ++ii) {
+        TIMED(bb, rv = storage_stat(path, &st));
+    }
+    if (rv < 0) {
+        bench_fail(bb, "lookup", rv);
+    }
+    else {
+        bench_end(bb, "lookup", 0, 0, -1);
+    }
+
+    // path ends in the last component made, or in the one that failed
+    if (made <= bb->depth) {
+        *strrchr(path, '/') = 0;
+    }
+    for (int ii = made; ii > 0; --ii) {
+        storage_unlink(path);
+        *strrchr(path, '/') = 0;
+    }
+    free(path);
+    return rv;
+}
+
+// readdir plus a stat of every entry, as ls -l does
+static int
+bench_scan(bench* bb)
+{
+    char path[64];
+    int rv = storage_mknod("/scan", 040755, 1);
+    int made = 0;
+    for (int ii = 0; ii < bb->dirsize && rv >= 0; ++ii) {
+        snprintf(path, sizeof(path), "/scan/entry_%d", ii);
+        rv = storage_mknod(path, 0100644, 0);
+        made += (rv >= 0);
+    }
+
+    struct stat st;
+    bench_begin(bb);
+    for (int rep = 0; rep < 3 && rv >= 0; ++rep) {
+        int64_t t0 = bench_now_ns();
+        slist* names = storage_list("/scan");
+        lat_add(&(bb->lat), bench_now_ns() - t0);
+        int listed = 0;
+        for (slist* xs = names; xs && rv >= 0; xs = xs->next) {
+            snprintf(path, sizeof(path), "/scan/%s", xs->data);
+            TIMED(bb, rv = storage_stat(path, &st));
+            listed += 1;
+        }
+        s_free(names);
+        if (rv >= 0 && listed != bb->dirsize) {
+            rv = -EIO;
+        }
+    }
+    if (rv < 0) {
+        bench_fail(bb, "scan", rv);
+    }
+    else {
+        bench_end(bb, "scan", 0, 0, -1);
+    }
+
+    for (int ii = 0; ii < made; ++ii) {
+        snprintf(path, sizeof(path), "/scan/entry_%d", ii);
+        storage_unlink(path);
+    }
+    storage_unlink("/scan");
+    return rv;
+}
+
+static const char* workload_names[] = {
+    "seq_write", "seq_read", "rand_write", "rand_read",
+    "create", "unlink", "lookup", "scan", 0
+};
+
+static int
+parse_ios(bench* bb, const char* text)
+{
+    char copy[128];
+    strlcpy(copy, text, sizeof(copy));
+    bb->nios = 0;
+    for (char* tok = strtok(copy, ","); tok; tok = strtok(0, ",")) {
+        int64_t io = parse_size(tok);
+        if (io <= 0 || bb->nios == BENCH_MAX_IOS) {
+            return -1;
+        }
+        bb->ios[bb->nios++] = io;
+    }
+    return bb->nios ? 0 : -1;
+}
+
+static int
+bench_usage()
+{
+    fprintf(stderr, "bench image [workload...] [key=value...]\n");
+    fprintf(stderr, "  workloads: seq_write seq_read rand_write rand_read"
+                    " create unlink lookup scan (default all)\n");
+    fprintf(stderr, "  size=512M map=extent|indirect file=64M io=4K,64K,1M"
+                    " files=10000 depth=32 dirsize=20000 seed=N\n");
+    fprintf(stderr, "  backend=mmap|pread|uring cache=64M\n");
+    return 1;
+}
+
+int
+bench_main(const char* img, int argc, char* argv[])
+{
+    bench bb;
+    memset(&bb, 0, sizeof(bb));
+    bb.image_bytes = 512 << 20;
+    bb.file_bytes = 64 << 20;
+    bb.files = 10000;
+    bb.depth = 32;
+    bb.dirsize = 20000;
+    bb.seed = 88172645463325252ULL;
+    parse_ios(&bb, "4K,64K,1M");
+
+    int want[8] = {0};
+    int any = 0;
+    for (int ii = 0; ii < argc; ++ii) {
+        char* eq = strchr(argv[ii], '=');
+        if (!eq) {
+            int found = 0;
+            for (int ww = 0; workload_names[ww]; ++ww) {
+                if (streq(argv[ii], workload_names[ww])) {
+                    want[ww] = found = any = 1;
+                }
+            }
+            if (!found) {
+                return bench_usage();
+            }
+            continue;
+        }
+
+        const char* val = eq + 1;
+        int rv = 0;
+        if (strncmp(argv[ii], "size=", 5) == 0) {
+            rv = ((bb.image_bytes = parse_size(val)) < NUFS_PAGE_SIZE) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "map=", 4) == 0) {
+            bb.flags = streq(val, "indirect") ? NUFS_BLOCKMAP : 0;
+            rv = (bb.flags || streq(val, "extent")) ? 0 : -1;
+        }
+        else if (strncmp(argv[ii], "file=", 5) == 0) {
+            rv = ((bb.file_bytes = parse_size(val)) <= 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "io=", 3) == 0) {
+            rv = parse_ios(&bb, val);
+        }
+        else if (strncmp(argv[ii], "files=", 6) == 0) {
+            rv = ((bb.files = atoi(val)) <= 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "depth=", 6) == 0) {
+            rv = ((bb.depth = atoi(val)) <= 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "dirsize=", 8) == 0) {
+            rv = ((bb.dirsize = atoi(val)) <= 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "seed=", 5) == 0) {
+            bb.seed = strtoull(val, 0, 10) | 1;
+        }
+        else if (strncmp(argv[ii], "backend=", 8) == 0) {
+            rv = ((pages_backend = pages_parse_backend(val)) < 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "cache=", 6) == 0) {
+            rv = ((pages_cache_bytes = parse_size(val)) <= 0) ? -1 : 0;
+        }
+        else {
+            rv = -1;
+        }
+        if (rv < 0) {
+            return bench_usage();
+        }
+    }
+    if (!any) {
+        for (int ww = 0; workload_names[ww]; ++ww) {
+            want[ww] = 1;
+        }
+    }
+
+    if (storage_new(img, bb.image_bytes, 0, bb.flags) < 0) {
+        return 1;
+    }
+
+    printf("{\"image\": {\"bytes\": %ld, \"map\": \"%s\", \"page_count\": %d, \"inode_count\": %d,"
+           " \"backend\": \"%s\", \"cache_bytes\": %ld},\n",
+           (long) bb.image_bytes, bb.flags ? "indirect" : "extent",
+           get_super()->page_count, get_super()->inode_count,
+           pages_backend_name(), pages_mapped() ? 0L : (long) pages_cache_bytes);
+    printf(" \"workloads\": [");
+
+    int failed = 0;
+    for (int ii = 0; (want[0] || want[1] || want[2] || want[3]) && ii < bb.nios; ++ii) {
+        int rv = bench_io(&bb, bb.ios[ii], want);
+        if (rv < 0) {
+            fprintf(stderr, "bench: io %ld failed: %d\n", (long) bb.ios[ii], rv);
+            failed = 1;
+        }
+    }
+    if ((want[4] || want[5]) && bench_storm(&bb, want[4], want[5]) < 0) {
+        failed = 1;
+    }
+    if (want[6] && bench_lookup(&bb) < 0) {
+        failed = 1;
+    }
+    if (want[7] && bench_scan(&bb) < 0) {
+        failed = 1;
+    }
+    printf("\n ]}\n");
+
+    lat_free(&(bb.lat));
+    storage_free();
+    if (failed) {
+        fprintf(stderr, "bench: a workload failed (see its \"error\")\n");
+    }
+    return failed;
+}
@@ -0,0 +1,26 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// "nufstool bench image [workload...] [key=value...]": formats image
+// and runs storage-layer workloads on it in-process, printing JSON.
+
+int bench_main(const char* img, int argc, char* argv[]);
+
+// shared with the other nufstool workloads (age, replay)
+
+typedef struct lat_log {
+    uint64_t* ns;
+    size_t count;
+    size_t cap;
+} lat_log;
+
+int64_t  bench_now_ns();
+void     lat_add(lat_log* ll, uint64_t ns);
+// pct in [0, 100]; sorts ll
+uint64_t lat_pct(lat_log* ll, double pct);
+void     lat_free(lat_log* ll);
+
+#endif
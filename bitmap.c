@@ -1,6 +1,11 @@
 #include <stdint.h>
 #include <stdio.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 #include "bitmap.h"
+#include "stats.h"
+#include "pages.h"
 
 int
 bitmap_get(void* bm, int ii) {
@@ -15,6 +20,7 @@ bitmap_put(void* bm, int ii, int vv) {
     else {
         ((uint8_t*)bm)[ii / 8] |= 1 << (ii & 7);
     }
+    pages_dirty_ptr((uint8_t*)bm + ii / 8, 1);
 } 
 
 void
@@ -28,3 +34,103 @@ bitmap_print(void* bm, int size) {
         printf("\n");
     }
 }
+
+#if defined(__x86_64__)
+// index of the first 256-bit block at or after word ww that is not all
+// ones; lets the scan step over long full stretches of a busy image
+__attribute__((target("avx2")))
+static int
+skip_full_avx2(const uint64_t* words, int ww, int last)
+{
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    while (ww + 4 <= last) {
+        __m256i vv = _mm256_loadu_si256((const __m256i*)(words + ww));
+        if (!_mm256_testc_si256(vv, ones)) {
+            break;
+        }
+        ww += 4;
+    }
+    return ww;
+}
+
+static int
+have_avx2()
+{
+    static int cached = -1;
+    if (cached < 0) {
+        cached = __builtin_cpu_supports("avx2");
+    }
+    return cached;
+}
+#endif
+
+static void
+scan_stats(int words)
+{
+    stats_add(STAT_BITMAP_SCANS, 1);
+    stats_add(STAT_BITMAP_WORDS, words);
+}
+
+// shared word loop; flip is all ones to search for zeros, 0 for ones
+static int
+next_bit(const uint64_t* words, int start, int end, uint64_t flip)
+{
+    if (start >= end) {
+        return -1;
+    }
+
+    int ww = start / 64;
+    int first = ww;
+    int last = (end + 63) / 64;
+    uint64_t bits = (words[ww] ^ flip) & (~0ULL << (start % 64));
+
+    while (1) {
+        if (bits) {
+            int ii = ww * 64 + __builtin_ctzll(bits);
+            scan_stats(ww + 1 - first);
+            return (ii < end) ? ii : -1;
+        }
+        ww += 1;
+#if defined(__x86_64__)
+        if (flip && have_avx2()) {
+            ww = skip_full_avx2(words, ww, last);
+        }
+#endif
+        if (ww >= last) {
+            scan_stats(last - first);
+            return -1;
+        }
+        bits = words[ww] ^ flip;
+    }
+}
+
+int
+bitmap_next_zero(void* bm, int start, int end)
+{
+    return next_bit((const uint64_t*) bm, start, end, ~0ULL);
+}
+
+int
+bitmap_next_one(void* bm, int start, int end)
+{
+    return next_bit((const uint64_t*) bm, start, end, 0);
+}
+
+int
+bitmap_first_zero(void* bm, int end)
+{
+    return bitmap_next_zero(bm, 0, end);
+}
+
+int
+bitmap_alloc_scan(void* bm, int lo, int hint, int end)
+{
+    if (hint < lo || hint >= end) {
+        hint = lo;
+    }
+    int ii = bitmap_next_zero(bm, hint, end);
+    if (ii < 0 && hint > lo) {
+        ii = bitmap_next_zero(bm, lo, hint);
+    }
+    return ii;
+}
@@ -7,4 +7,12 @@ int bitmap_get(void* bm, int ii);
 void bitmap_put(void* bm, int ii, int vv);
 void bitmap_print(void* bm, int size);
 
+// first clear / set bit in [start, end), or -1; scans a 64-bit word at
+// a time, so bm must be 8-byte aligned
+int bitmap_next_zero(void* bm, int start, int end);
+int bitmap_next_one(void* bm, int start, int end);
+int bitmap_first_zero(void* bm, int end);
+// like bitmap_next_zero, wrapping around to lo once [hint, end) is full
+int bitmap_alloc_scan(void* bm, int lo, int hint, int end);
+
 #endif
@@ -0,0 +1,199 @@
+
+#include <string.h>
+#include <errno.h>
+
+#include "blockmap.h"
+#include "inode.h"
+#include "pages.h"
+
+static int*
+ptr_page(int* pp, int alloc)
+{
+    if (*pp == 0) {
+        if (!alloc) {
+            return 0;
+        }
+        int pnum = alloc_page();
+        if (pnum < 0) {
+            return 0;
+        }
+        pages_zero_page(pnum);
+        *pp = pnum;
+    }
+    return (int*) pages_get_page(*pp);
+}
+
+// the pointer slot for file page fpn; *avail gets the number of slots
+// from there to the end of the array holding it
+static int*
+map_slot(inode* node, int fpn, int alloc, int* avail)
+{
+    if (fpn < INODE_DIRECT) {
+        *avail = INODE_DIRECT - fpn;
+        return &(node->ptrs[fpn]);
+    }
+    fpn -= INODE_DIRECT;
+
+    if (fpn < PTRS_PER_PAGE) {
+        int* ind = ptr_page(&(node->iptr), alloc);
+        if (!ind) {
+            return 0;
+        }
+        *avail = PTRS_PER_PAGE - fpn;
+        return &(ind[fpn]);
+    }
+    fpn -= PTRS_PER_PAGE;
+
+    if (fpn >= PTRS_PER_PAGE * PTRS_PER_PAGE) {
+        return 0;
+    }
+    int* dind = ptr_page(&(node->diptr), alloc);
+    if (!dind) {
+        return 0;
+    }
+    int* ind = ptr_page(&(dind[fpn / PTRS_PER_PAGE]), alloc);
+    if (!ind) {
+        return 0;
+    }
+    *avail = PTRS_PER_PAGE - fpn % PTRS_PER_PAGE;
+    return &(ind[fpn % PTRS_PER_PAGE]);
+}
+
+int
+blockmap_lookup(inode* node, int fpn, int* run)
+{
+    int avail;
+    int* slot = map_slot(node, fpn, 0, &avail);
+    if (!slot || *slot == 0) {
+        return -1;
+    }
+
+    if (run) {
+        int nn = 1;
+        while (nn < avail && slot[nn] == slot[0] + nn) {
+            nn += 1;
+        }
+        *run = nn;
+    }
+    return slot[0];
+}
+
+int
+blockmap_set(inode* node, int fpn, int pnum)
+{
+    int avail;
+    int* slot = map_slot(node, fpn, 1, &avail);
+    if (!slot) {
+        return -ENOSPC;
+    }
+    *slot = pnum;
+
+    // the inode's own slots are the caller's to mark
+    fpn -= INODE_DIRECT;
+    if (fpn >= 0 && fpn < PTRS_PER_PAGE) {
+        pages_dirty(node->iptr);
+    }
+    else if (fpn >= PTRS_PER_PAGE) {
+        int* dind = pages_get_page(node->diptr);
+        pages_dirty(node->diptr);
+        pages_dirty(dind[(fpn - PTRS_PER_PAGE) / PTRS_PER_PAGE]);
+    }
+    return 0;
+}
+
+// frees the data pages in ptrs[from, to) and clears them, a run of
+// adjacent page numbers at a time
+static void
+free_ptrs(int* ptrs, int from, int to)
+{
+    int run = 0;
+    int len = 0;
+    for (int ii = from; ii < to; ++ii) {
+        if (ptrs[ii] == 0) {
+            continue;
+        }
+        if (len > 0 && ptrs[ii] != run + len) {
+            free_pages(run, len);
+            len = 0;
+        }
+        if (len == 0) {
+            run = ptrs[ii];
+        }
+        len += 1;
+        ptrs[ii] = 0;
+    }
+    if (len > 0) {
+        free_pages(run, len);
+    }
+}
+
+// frees entries [from, PTRS_PER_PAGE) of a pointer page; returns 1 if
+// that emptied the whole page
+static int
+truncate_ptrs(int* ptrs, int from)
+{
+    if (from < 0) {
+        from = 0;
+    }
+    free_ptrs(ptrs, from, PTRS_PER_PAGE);
+    return from == 0;
+}
+
+void
+blockmap_truncate(inode* node, int npages)
+{
+    free_ptrs(node->ptrs, npages, INODE_DIRECT);
+    npages -= INODE_DIRECT;
+
+    if (node->iptr) {
+        if (truncate_ptrs(pages_get_page(node->iptr), npages)) {
+            free_page(node->iptr);
+            node->iptr = 0;
+        }
+        else {
+            pages_dirty(node->iptr);
+        }
+    }
+    npages -= PTRS_PER_PAGE;
+
+    if (node->diptr) {
+        int* dind = pages_get_page(node->diptr);
+        for (int jj = 0; jj < PTRS_PER_PAGE; ++jj) {
+            int from = npages - jj * PTRS_PER_PAGE;
+            if (dind[jj] == 0 || from >= PTRS_PER_PAGE) {
+                continue;
+            }
+            if (truncate_ptrs(pages_get_page(dind[jj]), from)) {
+                free_page(dind[jj]);
+                dind[jj] = 0;
+            }
+            else {
+                pages_dirty(dind[jj]);
+            }
+        }
+        if (npages <= 0) {
+            free_page(node->diptr);
+            node->diptr = 0;
+        }
+        else {
+            pages_dirty(node->diptr);
+        }
+    }
+}
+
+void
+blockmap_take_dirty(inode* node, page_ranges* rr)
+{
+    if (node->iptr) {
+        pages_take_dirty(rr, node->iptr, 1);
+    }
+    if (node->diptr) {
+        pages_take_dirty(rr, node->diptr, 1);
+        int* dind = pages_get_page(node->diptr);
+        for (int jj = 0; jj < PTRS_PER_PAGE; ++jj) {
+            if (dind[jj]) {
+                pages_take_dirty(rr, dind[jj], 1);
+            }
+        }
+    }
+}
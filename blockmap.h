@@ -0,0 +1,26 @@
+#ifndef BLOCKMAP_H
+#define BLOCKMAP_H
+
+#include "pages.h"
+
+// Classic block map: INODE_DIRECT pointers in the inode, then one
+// single-indirect and one double-indirect page of page numbers.
+// Translating a file page is at most two extra page reads.
+
+#define INODE_DIRECT  12
+#define PTRS_PER_PAGE ((int) (NUFS_PAGE_SIZE / sizeof(int)))
+#define BLOCKMAP_MAX_PAGES (INODE_DIRECT + PTRS_PER_PAGE + PTRS_PER_PAGE * PTRS_PER_PAGE)
+
+struct inode;
+
+// file page -> disk page, -1 if unmapped; *run gets the number of
+// contiguous pages starting there
+int  blockmap_lookup(struct inode* node, int fpn, int* run);
+// point file page fpn at disk page pnum, allocating pointer pages
+int  blockmap_set(struct inode* node, int fpn, int pnum);
+// unmap and free every page at or after file page npages
+void blockmap_truncate(struct inode* node, int npages);
+// takes the dirty bits of the pointer pages (see pages_take_dirty)
+void blockmap_take_dirty(struct inode* node, page_ranges* rr);
+
+#endif
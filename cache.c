@@ -0,0 +1,601 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "uring.h"
+#include "pages.h"
+#include "stats.h"
+#include "log.h"
+
+#define CACHE_MIN_FRAMES 64
+#define PIN_RECENT 8 // held pages cache_get checks before locking
+
+enum frame_state {
+    F_FREE,    // holds nothing, not in the hash
+    F_LOADING, // being read in; wait for it
+    F_VALID,
+    F_WRITING, // being written back for eviction; wait for it
+};
+
+typedef struct frame {
+    int      pnum;  // -1 when free
+    int      next;  // hash chain
+    int      pins;
+    uint8_t  state;
+    uint8_t  ref;   // CLOCK bit: used since the hand last passed
+    uint8_t  dirty; // marked by cache_dirty since it was last written
+    uint8_t  owns;  // first frame of a malloc'd run of data
+    void*    data;
+} frame;
+
+// frames can move when the pool grows, so everything in them is only
+// touched under cache_lock; data never moves
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  cache_cond = PTHREAD_COND_INITIALIZER;
+static frame*   frames = 0;
+static int      frame_count = 0;
+static int*     buckets = 0;
+static unsigned bucket_mask = 0;
+static int      hand = 0;
+
+static int cache_fd = -1;
+static int use_ring = 0;
+static int image_pages = 0;
+static int cache_gen = 0; // bumped by each cache_open
+
+// pages the calling thread holds pins on. A pinned frame can't be
+// reused, so the thread can use what's here without the lock.
+typedef struct pin {
+    int   pnum;
+    int   fi;
+    void* data;
+} pin;
+
+typedef struct pin_list {
+    int  gen;   // cache_open the pins belong to
+    int  count;
+    int  cap;
+    pin* pins;
+} pin_list;
+
+static __thread pin_list* my_pins = 0;
+static __thread int last_miss = -2; // to spot sequential misses
+static __thread int ra_end = -1;    // page after the last readahead
+static pthread_key_t pins_key;
+static pthread_once_t pins_once = PTHREAD_ONCE_INIT;
+
+// thread exit: whatever it still had pinned can go
+static void
+pins_release(void* arg)
+{
+    pin_list* pl = arg;
+    pthread_mutex_lock(&cache_lock);
+    for (int ii = 0; pl->gen == cache_gen && ii < pl->count; ++ii) {
+        frames[pl->pins[ii].fi].pins -= 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    free(pl->pins);
+    free(pl);
+}
+
+static void
+pins_key_init()
+{
+    pthread_key_create(&pins_key, pins_release);
+}
+
+static pin_list*
+pins_get()
+{
+    if (my_pins) {
+        return my_pins;
+    }
+    pthread_once(&pins_once, pins_key_init);
+    pin_list* pl = calloc(1, sizeof(pin_list));
+    assert(pl);
+    pthread_setspecific(pins_key, pl);
+    my_pins = pl;
+    return pl;
+}
+
+// with cache_lock held; fi mustn't be held by this thread already
+static void
+pin_frame(pin_list* pl, int fi)
+{
+    if (pl->gen != cache_gen) {
+        pl->gen = cache_gen;
+        pl->count = 0;
+    }
+    if (pl->count == pl->cap) {
+        pl->cap = pl->cap ? pl->cap * 2 : 64;
+        pl->pins = realloc(pl->pins, pl->cap * sizeof(pin));
+        assert(pl->pins);
+    }
+    pl->pins[pl->count++] = (pin) { frames[fi].pnum, fi, frames[fi].data };
+    frames[fi].pins += 1;
+}
+
+// this thread's pin on pnum, or -1; looks back over all of them with
+// all set, else just the last few
+static int
+held(pin_list* pl, int pnum, int all)
+{
+    if (pl->gen != cache_gen) {
+        return -1;
+    }
+    int stop = (all || pl->count < PIN_RECENT) ? 0 : pl->count - PIN_RECENT;
+    for (int ii = pl->count - 1; ii >= stop; --ii) {
+        if (pl->pins[ii].pnum == pnum) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+static unsigned
+bucket_of(int pnum)
+{
+    return ((unsigned) pnum * 2654435761u) & bucket_mask;
+}
+
+static int
+find(int pnum)
+{
+    for (int fi = buckets[bucket_of(pnum)]; fi >= 0; fi = frames[fi].next) {
+        if (frames[fi].pnum == pnum) {
+            return fi;
+        }
+    }
+    return -1;
+}
+
+static void
+hash_insert(int fi, int pnum)
+{
+    unsigned bb = bucket_of(pnum);
+    frames[fi].pnum = pnum;
+    frames[fi].next = buckets[bb];
+    buckets[bb] = fi;
+}
+
+static void
+hash_remove(int fi)
+{
+    for (int* pp = &buckets[bucket_of(frames[fi].pnum)]; *pp >= 0; pp = &(frames[*pp].next)) {
+        if (*pp == fi) {
+            *pp = frames[fi].next;
+            break;
+        }
+    }
+    frames[fi].pnum = -1;
+    frames[fi].next = -1;
+}
+
+// adds count frames to the pool
+static void
+grow(int count)
+{
+    frames = realloc(frames, (frame_count + count) * sizeof(frame));
+    char* data = aligned_alloc(NUFS_PAGE_SIZE, (size_t) count * NUFS_PAGE_SIZE);
+    assert(frames && data);
+    for (int ii = 0; ii < count; ++ii) {
+        frame* ff = frames + frame_count + ii;
+        memset(ff, 0, sizeof(frame));
+        ff->pnum = -1;
+        ff->next = -1;
+        ff->state = F_FREE;
+        ff->owns = (ii == 0);
+        ff->data = data + (size_t) ii * NUFS_PAGE_SIZE;
+    }
+    frame_count += count;
+}
+
+// with cache_lock held: a frame to reuse, unhashed, or -1. Dirty frames
+// the hand passes go into wb (up to CACHE_WRITEBACK, marked F_WRITING)
+// rather than being reused before they're written back.
+static int
+take_frame(int* wb, int* nwb)
+{
+    for (int steps = 0; steps < 2 * frame_count; ++steps) {
+        int fi = hand;
+        hand = (hand + 1) % frame_count;
+        frame* ff = frames + fi;
+        if (ff->state == F_FREE) {
+            return fi;
+        }
+        if (ff->state != F_VALID || ff->pins > 0) {
+            continue;
+        }
+        if (ff->ref) {
+            ff->ref = 0;
+            continue;
+        }
+        if (ff->dirty) {
+            if (*nwb < CACHE_WRITEBACK) {
+                ff->state = F_WRITING;
+                ff->dirty = 0;
+                wb[(*nwb)++] = fi;
+            }
+            continue;
+        }
+        hash_remove(fi);
+        ff->state = F_FREE;
+        return fi;
+    }
+    return -1;
+}
+
+static int
+do_io(io_req* reqs, int count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    return use_ring ? uring_rw(cache_fd, reqs, count) : sync_rw(cache_fd, reqs, count);
+}
+
+// with cache_lock held, drops it while wb's frames are written back
+// (and rd's, if any, are read in), then settles their states
+static void
+run_io(int* wb, int nwb, int* rd, int nrd)
+{
+    io_req reqs[CACHE_WRITEBACK + CACHE_READAHEAD];
+    for (int ii = 0; ii < nwb; ++ii) {
+        frame* ff = frames + wb[ii];
+        reqs[ii] = (io_req) { (int64_t) ff->pnum * NUFS_PAGE_SIZE, ff->data, NUFS_PAGE_SIZE, 1 };
+    }
+    for (int ii = 0; ii < nrd; ++ii) {
+        frame* ff = frames + rd[ii];
+        reqs[nwb + ii] = (io_req) { (int64_t) ff->pnum * NUFS_PAGE_SIZE, ff->data, NUFS_PAGE_SIZE, 0 };
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    // nobody holds F_WRITING or F_LOADING frames, so they hold still
+    int rv = do_io(reqs, nwb + nrd);
+    if (rv < 0) {
+        log_error("nufs: page I/O failed: %s\n", strerror(-rv));
+        if (nrd > 0) {
+            // the mmap backend would have taken a SIGBUS here
+            abort();
+        }
+    }
+    stats_add(STAT_PAGES_WRITTEN, nwb);
+    stats_add(STAT_PAGES_READ, nrd);
+
+    pthread_mutex_lock(&cache_lock);
+    for (int ii = 0; ii < nwb; ++ii) {
+        frame* ff = frames + wb[ii];
+        ff->state = F_VALID;
+        // a failed write stays dirty and is tried again later
+        if (rv < 0) {
+            ff->dirty = 1;
+        }
+    }
+    for (int ii = 0; ii < nrd; ++ii) {
+        frames[rd[ii]].state = F_VALID;
+    }
+    pthread_cond_broadcast(&cache_cond);
+}
+
+void
+cache_open(int fd, int use_uring, int64_t bytes, int page_count)
+{
+    cache_fd = fd;
+    image_pages = page_count;
+    use_ring = 0;
+    if (use_uring) {
+        int rv = uring_probe();
+        if (rv < 0) {
+            log_warn("nufs: no io_uring (%s); using pread\n", strerror(-rv));
+        }
+        use_ring = (rv == 0);
+    }
+
+    int count = bytes / NUFS_PAGE_SIZE;
+    if (count < CACHE_MIN_FRAMES) {
+        count = CACHE_MIN_FRAMES;
+    }
+    unsigned nbuckets = 1;
+    while (nbuckets < 2u * count) {
+        nbuckets *= 2;
+    }
+    buckets = malloc(nbuckets * sizeof(int));
+    assert(buckets);
+    memset(buckets, 0xff, nbuckets * sizeof(int));
+    bucket_mask = nbuckets - 1;
+    hand = 0;
+    grow(count);
+}
+
+void
+cache_close()
+{
+    pthread_mutex_lock(&cache_lock);
+    for (int fi = 0; fi < frame_count; ++fi) {
+        if (frames[fi].owns) {
+            free(frames[fi].data);
+        }
+    }
+    free(frames);
+    free(buckets);
+    frames = 0;
+    buckets = 0;
+    frame_count = 0;
+    cache_gen += 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+int
+cache_uring()
+{
+    return use_ring;
+}
+
+void*
+cache_get(int pnum, int fresh)
+{
+    assert(pnum >= 0 && pnum < image_pages);
+    pin_list* pl = pins_get();
+
+    // code that walks a page tends to get it over and over
+    int hh = held(pl, pnum, 0);
+    if (hh >= 0) {
+        void* data = pl->pins[hh].data;
+        if (fresh) {
+            memset(data, 0, NUFS_PAGE_SIZE);
+        }
+        return data;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (;;) {
+        int fi = find(pnum);
+        if (fi >= 0) {
+            frame* ff = frames + fi;
+            if (ff->state != F_VALID) {
+                pthread_cond_wait(&cache_cond, &cache_lock);
+                continue;
+            }
+            ff->ref = 1;
+            if (held(pl, pnum, 1) < 0) {
+                pin_frame(pl, fi);
+            }
+            if (fresh) {
+                memset(ff->data, 0, NUFS_PAGE_SIZE);
+            }
+            void* data = ff->data;
+            pthread_mutex_unlock(&cache_lock);
+            return data;
+        }
+
+        // a miss right after the last one, or where the last
+        // readahead stopped, looks sequential: read on ahead
+        int want = 1;
+        if (!fresh && (pnum == last_miss + 1 || pnum == ra_end)) {
+            want = image_pages - pnum;
+            if (want > CACHE_READAHEAD) {
+                want = CACHE_READAHEAD;
+            }
+        }
+
+        int wb[CACHE_WRITEBACK];
+        int rd[CACHE_READAHEAD];
+        int nwb = 0;
+        int nrd = 0;
+        for (int kk = 0; kk < want; ++kk) {
+            if (kk > 0 && find(pnum + kk) >= 0) {
+                break;
+            }
+            int got = take_frame(wb, &nwb);
+            if (got < 0) {
+                break;
+            }
+            frame* ff = frames + got;
+            hash_insert(got, pnum + kk);
+            ff->ref = (kk == 0);
+            ff->dirty = 0;
+            ff->state = F_LOADING;
+            rd[nrd++] = got;
+        }
+
+        if (nrd == 0) {
+            // nothing to reuse yet: write back what the hand found
+            // dirty, or wait for frames in flight, or if every frame is
+            // pinned, grow the pool
+            if (nwb > 0) {
+                run_io(wb, nwb, 0, 0);
+                continue;
+            }
+            int busy = 0;
+            for (int ii = 0; ii < frame_count && !busy; ++ii) {
+                busy = (frames[ii].state == F_LOADING || frames[ii].state == F_WRITING);
+            }
+            if (busy) {
+                pthread_cond_wait(&cache_cond, &cache_lock);
+                continue;
+            }
+            int more = frame_count / 4;
+            log_warn("nufs: all %d cached pages are pinned; adding %d\n", frame_count, more);
+            hand = frame_count;
+            grow(more);
+            continue;
+        }
+
+        frame* ff = frames + rd[0];
+        void* data = ff->data;
+        pin_frame(pl, rd[0]);
+        if (fresh) {
+            memset(data, 0, NUFS_PAGE_SIZE);
+            ff->state = F_VALID;
+            nrd = 0;
+        }
+        stats_add(STAT_CACHE_MISSES, 1);
+        last_miss = pnum;
+        ra_end = pnum + nrd;
+        if (nwb > 0 || nrd > 0) {
+            run_io(wb, nwb, rd, nrd);
+        }
+        pthread_mutex_unlock(&cache_lock);
+        return data;
+    }
+}
+
+void
+cache_dirty(int pnum)
+{
+    pin_list* pl = my_pins;
+    int hh = pl ? held(pl, pnum, 0) : -1;
+    pthread_mutex_lock(&cache_lock);
+    int fi = (hh >= 0) ? pl->pins[hh].fi : find(pnum);
+    if (fi >= 0) {
+        frames[fi].dirty = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void
+cache_put(int pnum)
+{
+    pin_list* pl = my_pins;
+    int hh = pl ? held(pl, pnum, 1) : -1;
+    if (hh < 0) {
+        return;
+    }
+    int fi = pl->pins[hh].fi;
+    pl->pins[hh] = pl->pins[--pl->count];
+    pthread_mutex_lock(&cache_lock);
+    frames[fi].pins -= 1;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+void
+cache_put_all()
+{
+    pin_list* pl = my_pins;
+    if (!pl || pl->count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    for (int ii = 0; pl->gen == cache_gen && ii < pl->count; ++ii) {
+        frames[pl->pins[ii].fi].pins -= 1;
+    }
+    pl->count = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+typedef struct flush_ent {
+    int      fi;
+    void*    data;
+    int64_t  off;
+} flush_ent;
+
+// with cache_lock held: pins frame fi for write_back if it's dirty.
+// The mark is cleared before the write, so one made while it's in
+// flight keeps the frame dirty.
+static void
+flush_add(flush_ent* ents, int* count, int fi)
+{
+    frame* ff = frames + fi;
+    if (!ff->dirty) {
+        return;
+    }
+    ff->dirty = 0;
+    ff->pins += 1;
+    ents[(*count)++] = (flush_ent) { fi, ff->data, (int64_t) ff->pnum * NUFS_PAGE_SIZE };
+}
+
+// writes out ents a batch at a time and unpins them; what failed is
+// marked dirty again
+static int
+write_back(flush_ent* ents, int count)
+{
+    int err = 0;
+    io_req reqs[CACHE_WRITEBACK];
+    for (int ii = 0; ii < count; ii += CACHE_WRITEBACK) {
+        int nn = (count - ii < CACHE_WRITEBACK) ? count - ii : CACHE_WRITEBACK;
+        for (int jj = 0; jj < nn; ++jj) {
+            reqs[jj] = (io_req) { ents[ii + jj].off, ents[ii + jj].data, NUFS_PAGE_SIZE, 1 };
+        }
+        int rv = do_io(reqs, nn);
+        if (rv < 0) {
+            err = rv;
+            pthread_mutex_lock(&cache_lock);
+            for (int jj = 0; jj < nn; ++jj) {
+                frames[ents[ii + jj].fi].dirty = 1;
+            }
+            pthread_mutex_unlock(&cache_lock);
+        }
+        else {
+            stats_add(STAT_PAGES_WRITTEN, nn);
+        }
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for (int ii = 0; ii < count; ++ii) {
+        frames[ents[ii].fi].pins -= 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (err < 0) {
+        log_error("nufs: write-back failed: %s\n", strerror(-err));
+    }
+    return err;
+}
+
+int
+cache_flush()
+{
+    // pin every dirty frame so none is reused while it's written out;
+    // an eviction's write has to land first
+    pthread_mutex_lock(&cache_lock);
+    for (int fi = 0; fi < frame_count; ++fi) {
+        if (frames[fi].state == F_WRITING) {
+            pthread_cond_wait(&cache_cond, &cache_lock);
+            fi = -1;
+        }
+    }
+    flush_ent* ents = malloc(frame_count * sizeof(flush_ent));
+    assert(ents);
+    int count = 0;
+    for (int fi = 0; fi < frame_count; ++fi) {
+        if (frames[fi].state == F_VALID) {
+            flush_add(ents, &count, fi);
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    int rv = write_back(ents, count);
+    free(ents);
+    return rv;
+}
+
+int
+cache_writeback(int pnum, int count)
+{
+    int rv = 0;
+    flush_ent ents[CACHE_WRITEBACK];
+    for (int base = pnum; base < pnum + count; ) {
+        int nn = 0;
+        pthread_mutex_lock(&cache_lock);
+        while (base < pnum + count && nn < CACHE_WRITEBACK) {
+            int fi = find(base);
+            // an eviction's write has to land before the caller syncs
+            if (fi >= 0 && frames[fi].state == F_WRITING) {
+                pthread_cond_wait(&cache_cond, &cache_lock);
+                continue;
+            }
+            if (fi >= 0 && frames[fi].state == F_VALID) {
+                flush_add(ents, &nn, fi);
+            }
+            base += 1;
+        }
+        pthread_mutex_unlock(&cache_lock);
+        int err = write_back(ents, nn);
+        if (err < 0) {
+            rv = err;
+        }
+    }
+    return rv;
+}
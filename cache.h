@@ -0,0 +1,48 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+
+// Page cache behind the pread and uring backends (see pages.h).
+//
+// A fixed pool of page frames, found through a hash on page number and
+// recycled in CLOCK order. cache_get pins the frame it returns; a pin
+// keeps the frame, and so the pointer, good until cache_put or the
+// thread's next cache_put_all. A thread holds at most one pin on a
+// page, however often it gets it, and gets of a page it already holds
+// don't lock.
+//
+// Whoever changes a page marks it with cache_dirty (pages_dirty does
+// this) while still holding its pin; write-back (at eviction, a batch
+// at a time, or cache_flush) only writes marked frames. A page changed
+// without a mark can be dropped unwritten.
+//
+// Misses on consecutive pages read CACHE_READAHEAD pages in one batch.
+// I/O goes through io_uring with use_uring, else pread / pwrite, and is
+// done with the cache lock dropped; frames in flight are waited for.
+
+#define CACHE_READAHEAD 32 // pages a sequential miss reads at once
+#define CACHE_WRITEBACK 32 // dirty frames an eviction writes back at once
+
+// bytes is the pool size; falls back to pread if use_uring is set but
+// the kernel has no io_uring
+void  cache_open(int fd, int use_uring, int64_t bytes, int page_count);
+// after cache_flush; drops every frame
+void  cache_close();
+// pins pnum's frame, reading it in if needed; with fresh the caller is
+// about to overwrite the page, which is zeroed rather than read
+void* cache_get(int pnum, int fresh);
+// marks pnum's frame as changed; no-op if it isn't cached
+void  cache_dirty(int pnum);
+// drops the calling thread's pin on pnum
+void  cache_put(int pnum);
+// unpins everything the calling thread has got
+void  cache_put_all();
+// writes back every marked frame; 0, or -errno if any write failed
+int   cache_flush();
+// the same for whichever of pages [pnum, pnum + count) are cached
+int   cache_writeback(int pnum, int count);
+// 1 if I/O is going through io_uring
+int   cache_uring();
+
+#endif
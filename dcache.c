@@ -0,0 +1,159 @@
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dcache.h"
+#include "util.h"
+#include "stats.h"
+
+typedef struct dset {
+    dentry ents[DCACHE_WAYS];
+    int    next; // way to overwrite when the set is full
+    unsigned seq; // odd while a writer is changing ents
+    pthread_spinlock_t lock; // serializes writers only
+} dset;
+
+static dset dcache[DCACHE_SETS];
+
+// FNV-1a over the parent inum and the name
+static uint32_t
+dcache_hash(int parent, const char* name, int len)
+{
+    uint32_t hh = 2166136261u ^ (uint32_t) parent;
+    hh *= 16777619u;
+    for (int ii = 0; ii < len; ++ii) {
+        hh ^= (uint8_t) name[ii];
+        hh *= 16777619u;
+    }
+    return hh;
+}
+
+static dset*
+dcache_set(int parent, const char* name, int len)
+{
+    return &(dcache[dcache_hash(parent, name, len) & (DCACHE_SETS - 1)]);
+}
+
+void
+dcache_init()
+{
+    for (int ii = 0; ii < DCACHE_SETS; ++ii) {
+        for (int jj = 0; jj < DCACHE_WAYS; ++jj) {
+            dcache[ii].ents[jj].parent = -1;
+        }
+        dcache[ii].next = 0;
+        dcache[ii].seq = 0;
+        pthread_spin_init(&(dcache[ii].lock), PTHREAD_PROCESS_PRIVATE);
+    }
+}
+
+static dentry*
+dcache_find(dset* set, int parent, const char* name, int len)
+{
+    for (int jj = 0; jj < DCACHE_WAYS; ++jj) {
+        dentry* de = &(set->ents[jj]);
+        if (de->parent == parent && memcmp(de->name, name, len) == 0 && de->name[len] == 0) {
+            return de;
+        }
+    }
+    return 0;
+}
+
+// Writers bracket their changes with these; readers take no lock and
+// instead retry if the set's seq was odd or moved while they looked.
+static void
+dset_write_begin(dset* set)
+{
+    pthread_spin_lock(&(set->lock));
+    __atomic_store_n(&(set->seq), set->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+dset_write_end(dset* set)
+{
+    __atomic_store_n(&(set->seq), set->seq + 1, __ATOMIC_RELEASE);
+    pthread_spin_unlock(&(set->lock));
+}
+
+int
+dcache_lookup(int parent, const char* name, int len)
+{
+    stats_add(STAT_LOOKUPS, 1);
+    if (len >= DIR_NAME) {
+        return -1;
+    }
+
+    dset* set = dcache_set(parent, name, len);
+    for (;;) {
+        unsigned seq = __atomic_load_n(&(set->seq), __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        dentry* de = dcache_find(set, parent, name, len);
+        int inum = de ? de->inum : -1;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(set->seq), __ATOMIC_RELAXED) == seq) {
+            if (inum >= 0) {
+                stats_add(STAT_DCACHE_HITS, 1);
+            }
+            return inum;
+        }
+    }
+}
+
+void
+dcache_insert(int parent, const char* name, int len, int inum)
+{
+    if (len >= DIR_NAME) {
+        return;
+    }
+
+    dset* set = dcache_set(parent, name, len);
+    dset_write_begin(set);
+    dentry* de = dcache_find(set, parent, name, len);
+    if (!de) {
+        de = &(set->ents[set->next]);
+        set->next = (set->next + 1) % DCACHE_WAYS;
+    }
+    de->parent = parent;
+    de->inum = inum;
+    memcpy(de->name, name, len);
+    de->name[len] = 0;
+    dset_write_end(set);
+}
+
+void
+dcache_remove(int parent, const char* name, int len)
+{
+    if (len >= DIR_NAME) {
+        return;
+    }
+
+    dset* set = dcache_set(parent, name, len);
+    dset_write_begin(set);
+    dentry* de = dcache_find(set, parent, name, len);
+    if (de) {
+        de->parent = -1;
+    }
+    dset_write_end(set);
+}
+
+// drops every entry under directory parent, for when its inode is freed
+void
+dcache_remove_dir(int parent)
+{
+    for (int ii = 0; ii < DCACHE_SETS; ++ii) {
+        dset* set = &(dcache[ii]);
+        for (int jj = 0; jj < DCACHE_WAYS; ++jj) {
+            if (set->ents[jj].parent == parent) {
+                dset_write_begin(set);
+                if (set->ents[jj].parent == parent) {
+                    set->ents[jj].parent = -1;
+                }
+                dset_write_end(set);
+            }
+        }
+    }
+}
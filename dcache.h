@@ -0,0 +1,29 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "directory.h"
+
+// Cache of (parent inum, name) -> inum in front of directory_lookup.
+// Fixed size and set-associative, so it never allocates; a full set
+// just overwrites its oldest entry. Lookups take no locks: each set has
+// a sequence count that writers bump around their changes, and readers
+// retry until they see the same even count before and after.
+
+#define DCACHE_SETS 8192 // power of two
+#define DCACHE_WAYS 4
+
+typedef struct dentry {
+    int  parent; // -1 marks an empty slot
+    int  inum;
+    char name[DIR_NAME];
+} dentry;
+
+void dcache_init();
+// the cached inum, or -1 on a miss
+// names are (pointer, length) views, as produced by path_next
+int  dcache_lookup(int parent, const char* name, int len);
+void dcache_insert(int parent, const char* name, int len, int inum);
+void dcache_remove(int parent, const char* name, int len);
+void dcache_remove_dir(int parent);
+
+#endif
@@ -10,249 +10,559 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdint.h>
 
 #include "directory.h"
 #include "pages.h"
 #include "slist.h"
 #include "util.h"
 #include "inode.h"
+#include "dcache.h"
+#include "path.h"
+#include "lock.h"
+#include "epoch.h"
+#include "log.h"
+
+// Directories are a B+tree keyed by a hash of the entry name. File page
+// 0 is the root; every page starts with a dir_node header and holds
+// either dirents (depth 0, a leaf) or dir_index entries. Entry i of an
+// index covers hashes from its own hash up to the next entry's, and
+// names with equal hashes always share a leaf. A zeroed page is an
+// empty leaf, so a new directory needs no setup.
+
+typedef struct dir_node {
+    int depth; // 0 for a leaf of dirents
+    int count; // entries in use
+    char _reserved[56];
+} dir_node;
+
+typedef struct dir_index {
+    uint32_t hash; // lowest name hash under this child
+    int      pnum; // disk page of the child node
+} dir_index;
+
+#define LEAF_MAX  ((int) ((NUFS_PAGE_SIZE - sizeof(dir_node)) / sizeof(dirent)))
+#define INDEX_MAX ((int) ((NUFS_PAGE_SIZE - sizeof(dir_node)) / sizeof(dir_index)))
+
+// 32-bit FNV-1a
+static uint32_t
+dir_hash(const char* name, int len)
+{
+    uint32_t hh = 2166136261u;
+    for (int ii = 0; ii < len; ++ii) {
+        hh ^= (uint8_t) name[ii];
+        hh *= 16777619u;
+    }
+    return hh;
+}
 
-#define ENT_SIZE 64
+static dir_node*
+node_page(int pnum)
+{
+    return (dir_node*) pages_get_page(pnum);
+}
 
-void
-directory_init()
+static dirent*
+leaf_ents(dir_node* nn)
 {
-   /* inode* rn = get_inode(0);
+    return (dirent*) (nn + 1);
+}
 
-    if (rn->mode == 0) {
-        rn->size = 0;
-        rn->mode = 040755;
-    }*/
+static dir_index*
+index_ents(dir_node* nn)
+{
+    return (dir_index*) (nn + 1);
 }
 
+static int
+node_full(dir_node* nn)
+{
+    return nn->count >= ((nn->depth == 0) ? LEAF_MAX : INDEX_MAX);
+}
 
-int
-directory_lookup(inode* dd, const char* name)
+// slot of the child covering hash hh
+static int
+index_find(dir_node* nn, uint32_t hh)
 {
-  void* directory = pages_get_page(dd->ptrs[0]);
+    dir_index* ents = index_ents(nn);
+    int lo = 1;
+    int hi = nn->count - 1;
+    int found = 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ents[mid].hash <= hh) {
+            found = mid;
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+// the leaf that would hold name, or 0 for a directory with no pages yet;
+// *pnum gets its page if pnum isn't null
+static dir_node*
+find_leaf(inode* dd, uint32_t hh, int* pnum)
+{
+    if (dd->size == 0) {
+        return 0;
+    }
+
+    int at = inode_get_pnum(dd, 0);
+    dir_node* nn = node_page(at);
+    while (nn->depth > 0) {
+        at = index_ents(nn)[index_find(nn, hh)].pnum;
+        nn = node_page(at);
+    }
+    if (pnum) {
+        *pnum = at;
+    }
+    return nn;
+}
 
-    for (int ii = 0; ii < dd->size; ii += ENT_SIZE) {
-        dirent* entry = (dirent*)(directory + ii);
-	printf("%d the searched directory is: %s, %s,  %d\n", ii, entry->name, name, entry->inum);
-        if (streq(entry->name, name)) {
-            return entry->inum;
+static dirent*
+leaf_find(dir_node* leaf, const char* name, int len, uint32_t hh)
+{
+    // no stored name is that long, and name[len] would be past the end
+    if (len >= DIR_NAME) {
+        return 0;
+    }
+    dirent* ents = leaf_ents(leaf);
+    for (int ii = 0; ii < leaf->count; ++ii) {
+        if (ents[ii].hash == hh && memcmp(ents[ii].name, name, len) == 0
+            && ents[ii].name[len] == 0) {
+            return &(ents[ii]);
         }
     }
-      	
-      return -ENOENT;
+    return 0;
 }
 
-int
-change_directory_name(inode* parent_node, const char* name, const char* new_name){
-  void* directory = pages_get_page(parent_node->ptrs[0]);
+// *pnum gets the page of the leaf searched, if pnum isn't null
+static dirent*
+dir_find_at(inode* dd, const char* name, int len, int* pnum)
+{
+    uint32_t hh = dir_hash(name, len);
+    dir_node* leaf = find_leaf(dd, hh, pnum);
+    return leaf ? leaf_find(leaf, name, len, hh) : 0;
+}
 
-    for (int ii = 0; ii < parent_node->size; ii += ENT_SIZE) {
-        dirent* entry = (dirent*)(directory + ii);
-        if (streq(entry->name, name)) {
+static dirent*
+dir_find(inode* dd, const char* name, int len)
+{
+    return dir_find_at(dd, name, len, 0);
+}
 
-	    char* dirent_name = entry->name;
-	    memset(dirent_name, '\0', sizeof(name));
-   	    strcpy(dirent_name, new_name);
+// appends a fresh zeroed page to the directory file, returning its disk page
+static int
+dir_new_page(inode* dd)
+{
+    int fpn = bytes_to_pages(dd->size);
+    int rv = grow_inode(dd, (int64_t) (fpn + 1) * NUFS_PAGE_SIZE);
+    if (rv < 0) {
+        return rv;
+    }
+    return inode_get_pnum(dd, fpn);
+}
+
+static int
+cmp_dirent_hash(const void* aa, const void* bb)
+{
+    uint32_t xx = ((const dirent*) aa)->hash;
+    uint32_t yy = ((const dirent*) bb)->hash;
+    return (xx > yy) - (xx < yy);
+}
 
-  
-	    return 0;
+// Splits the full child in slot ii of parent, which must have room,
+// moving its upper half into a new page linked in at slot ii + 1.
+static int
+split_child(inode* dd, dir_node* parent, int ii)
+{
+    dir_index* pents = index_ents(parent);
+    dir_node* child = node_page(pents[ii].pnum);
+
+    int split;
+    uint32_t boundary;
+    if (child->depth == 0) {
+        // cut between two different hashes nearest the middle
+        dirent* ents = leaf_ents(child);
+        qsort(ents, child->count, sizeof(dirent), cmp_dirent_hash);
+        split = -1;
+        for (int step = 0; step < child->count / 2 && split < 0; ++step) {
+            int lo = child->count / 2 - step;
+            int hi = child->count / 2 + step;
+            if (lo > 0 && ents[lo - 1].hash != ents[lo].hash) {
+                split = lo;
+            }
+            else if (hi < child->count && ents[hi - 1].hash != ents[hi].hash) {
+                split = hi;
+            }
+        }
+        if (split < 0) {
+            return -ENOSPC;
         }
+        boundary = ents[split].hash;
+    }
+    else {
+        split = child->count / 2;
+        boundary = index_ents(child)[split].hash;
     }
-      	
-      return -ENOENT;
 
+    int pnum = dir_new_page(dd);
+    if (pnum < 0) {
+        return pnum;
+    }
+    dir_node* sib = node_page(pnum);
+    sib->depth = child->depth;
+    sib->count = child->count - split;
+
+    size_t esize = (child->depth == 0) ? sizeof(dirent) : sizeof(dir_index);
+    memcpy((uint8_t*) (sib + 1), (uint8_t*) (child + 1) + split * esize, sib->count * esize);
+    child->count = split;
+
+    memmove(&(pents[ii + 2]), &(pents[ii + 1]), (parent->count - ii - 1) * sizeof(dir_index));
+    pents[ii + 1].hash = boundary;
+    pents[ii + 1].pnum = pnum;
+    parent->count += 1;
+    pages_dirty(pents[ii].pnum);
+    pages_dirty(pnum);
+    return 0;
+}
 
+// moves the full root into a new page and makes the root an index
+// over it, so the tree grows by one level
+static int
+push_down_root(inode* dd, dir_node* root)
+{
+    int pnum = dir_new_page(dd);
+    if (pnum < 0) {
+        return pnum;
+    }
+    memcpy(node_page(pnum), root, NUFS_PAGE_SIZE);
+
+    memset(root, 0, NUFS_PAGE_SIZE);
+    root->depth = node_page(pnum)->depth + 1;
+    root->count = 1;
+    index_ents(root)[0].hash = 0;
+    index_ents(root)[0].pnum = pnum;
+    pages_dirty(pnum);
+    return 0;
 }
 
-int
-tree_lookup(const char* path)
+// Inserts an entry, splitting full nodes on the way down so there is
+// always room for whatever a split pushes into the parent.
+static int
+dir_insert(inode* dd, const char* name, int inum, int is_dir)
 {
-    if (strcmp(path, "/") == 0) {
-        return 0;
+    if (strlen(name) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    if (dd->size == 0 && dir_new_page(dd) < 0) {
+        return -ENOSPC;
     }
 
-    slist* dir_list = directory_list(path + 1);
-    print_list(dir_list);
-    if(!dir_list->next){
-	char* name = get_name(path);
-	return directory_lookup(get_inode(0), dir_list->data);
+    uint32_t hh = dir_hash(name, strlen(name));
+    int at = inode_get_pnum(dd, 0);
+    dir_node* nn = node_page(at);
+    if (node_full(nn)) {
+        int rv = push_down_root(dd, nn);
+        if (rv < 0) {
+            return rv;
+        }
+        pages_dirty(at);
     }
 
+    while (nn->depth > 0) {
+        int ii = index_find(nn, hh);
+        if (node_full(node_page(index_ents(nn)[ii].pnum))) {
+            int rv = split_child(dd, nn, ii);
+            if (rv < 0) {
+                return rv;
+            }
+            pages_dirty(at);
+            ii = index_find(nn, hh);
+        }
+        at = index_ents(nn)[ii].pnum;
+        nn = node_page(at);
+    }
 
-    int inum = 0;
-    while (dir_list != 0 && inum != -1 && dir_list->next) {
-        inode* curr = get_inode(inum);
-        inum = directory_lookup(curr, dir_list->data);
-        dir_list = dir_list->next;
+    dirent* de = &(leaf_ents(nn)[nn->count]);
+    memset(de, 0, sizeof(dirent));
+    strcpy(de->name, name);
+    de->inum = inum;
+    de->is_dir = is_dir;
+    de->hash = hh;
+    nn->count += 1;
+    pages_dirty(at);
+    return 0;
+}
+
+// unlinks the entry for name from dd without touching the target inode
+static int
+dir_remove(inode* dd, const char* name, dirent* out)
+{
+    int len = strlen(name);
+    uint32_t hh = dir_hash(name, len);
+    int pnum;
+    dir_node* leaf = find_leaf(dd, hh, &pnum);
+    dirent* de = leaf ? leaf_find(leaf, name, len, hh) : 0;
+    if (!de) {
+        return -ENOENT;
     }
 
-  
-    return inum;
-   }
+    if (out) {
+        *out = *de;
+    }
+    dirent* last = &(leaf_ents(leaf)[leaf->count - 1]);
+    if (de != last) {
+        *de = *last;
+    }
+    leaf->count -= 1;
+    pages_dirty(pnum);
+    return 0;
+}
 
-int
-directory_put(inode* dd, const char* name, int inum, int is_dir)
+// Iterates over every entry in dd: start with *pos = 0 and call until
+// it returns 0. Leaves are visited in page order, not name order.
+// Pages are put as the walk leaves them, so a big directory doesn't
+// pin all of itself.
+dirent*
+directory_next(inode* dd, int* pos)
 {
-  
-   if (grow_inode(dd, sizeof(dirent)) != -1) {
-        void* base = pages_get_page(dd->ptrs[0]);
-    
-        dirent* de = (dirent*)(base + (dd->size - sizeof(dirent)));
-	char* new_name = de->name;
-	memset(new_name, '\0', sizeof(name));
-   	strcpy(new_name, name);
-        de->inum = inum;
-	de->is_dir = is_dir;
-	printf("directory put: %s, %d, is dir: %d\n", de->name, de->inum, is_dir);
-        return 0;
+    int pages = bytes_to_pages(dd->size);
+    int fpn = *pos / NUFS_PAGE_SIZE;
+    int slot = *pos % NUFS_PAGE_SIZE;
+
+    for (; fpn < pages; ++fpn, slot = 0) {
+        int pnum = inode_get_pnum(dd, fpn);
+        dir_node* nn = node_page(pnum);
+        if (nn->depth == 0 && slot < nn->count) {
+            *pos = fpn * NUFS_PAGE_SIZE + slot + 1;
+            return &(leaf_ents(nn)[slot]);
+        }
+        pages_put_page(pnum);
     }
-    
-    return -1;
-  }
+    *pos = pages * NUFS_PAGE_SIZE;
+    return 0;
+}
+
+void
+directory_init()
+{
+   /* inode* rn = get_inode(0);
+
+    if (rn->mode == 0) {
+        rn->size = 0;
+        rn->mode = 040755;
+    }*/
+}
+
 
 int
-directory_delete(inode* dd, const char* name)
+directory_lookup(inode* dd, const char* name)
 {
-    int rv = -1;
-    int dirent_addr = -1;
-    int dirent_inum = -1;
+    dirent* entry = dir_find(dd, name, strlen(name));
+    log_trace("+ directory_lookup(%s) -> %d\n", name, entry ? entry->inum : -ENOENT);
+    return entry ? entry->inum : -ENOENT;
+}
 
-    void* directory = pages_get_page(dd->ptrs[0]);
+static void unref_inode(int inum);
 
-    for (int i = 0; i < dd->size; i += sizeof(dirent)) {
-        dirent* ent = (dirent*)(directory + i);
+// Moves entry name of from_dd to new_name in to_dd, replacing whatever
+// new_name pointed at before. The new entry is in place before the old
+// one goes, so a failed insert leaves the file where it was. Whether
+// the replacement is allowed is the caller's call (see rename_locked).
+int
+directory_move(inode* from_dd, const char* name, inode* to_dd, const char* new_name)
+{
+    if (strlen(new_name) >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    dirent* src = dir_find(from_dd, name, strlen(name));
+    if (!src) {
+        return -ENOENT;
+    }
+    if (from_dd == to_dd && streq(name, new_name)) {
+        return 0;
+    }
+    dirent moved = *src;
 
-        if (streq(ent->name, name)) {
-            dirent_addr = i;
-            dirent_inum = ent->inum;
-            break;
-        }
+    int pnum;
+    int replaced = -1;
+    dirent* old = dir_find_at(to_dd, new_name, strlen(new_name), &pnum);
+    if (old && old->inum == moved.inum) {
+        // two links to the same file: rename does nothing
+        return 0;
     }
-    if(dirent_addr == -1){
-	return -1;
+    if (old) {
+        replaced = old->inum;
+        old->inum = moved.inum;
+        old->is_dir = moved.is_dir;
+        pages_dirty(pnum);
+        dcache_insert(inode_num(to_dd), new_name, strlen(new_name), moved.inum);
     }
-    inode* data = get_inode(dirent_inum);
-    data->refs -= 1;
-    if(data->refs == 0){
-	free_inode(dirent_inum);
+    else {
+        int rv = directory_put(to_dd, new_name, moved.inum, moved.is_dir);
+        if (rv < 0) {
+            return rv;
+        }
     }
 
+    dir_remove(from_dd, name, 0);
+    dcache_remove(inode_num(from_dd), name, strlen(name));
+    if (replaced >= 0) {
+        unref_inode(replaced);
+    }
+    return 0;
+}
 
-    for(int ii = dirent_addr + sizeof(dirent); ii < dd->size; ii += sizeof(dirent)){
-	dirent* curr = (dirent*)(directory + ii);
-	dirent* prev = (dirent*)(directory + ii - sizeof(dirent));
-	memset(prev->name, '\0', 48);
-	strcpy(prev->name, curr->name);
-	prev->inum = curr->inum;
-	prev->is_dir = curr->is_dir;
+int
+change_directory_name(inode* parent_node, const char* name, const char* new_name){
+    return directory_move(parent_node, name, parent_node, new_name);
+}
 
+// one path step, answered from the dentry cache when possible
+static int
+lookup_cached(int parent, const char* name, int len)
+{
+    int inum = dcache_lookup(parent, name, len);
+    if (inum >= 0) {
+        return inum;
     }
-   return shrink_inode(dd, sizeof(dirent));
-    
 
-   
-   }
+    inode* dd = get_inode(parent);
+    if (!S_ISDIR(dd->mode)) {
+        return -ENOTDIR;
+    }
 
-slist*
-list_all(const char* path){
-    slist* list = 0;
-    if (strcmp(path, "/") == 0) {
-	inode* node = get_inode(0);
-	void* directory = pages_get_page(node->ptrs[0]);	
-  	for (int ii = 0; ii < node->size; ii += ENT_SIZE) {
-        	dirent* entry = (dirent*)(directory + ii);
-        	list = s_cons(entry->name, list);
-    	}
-	return list;
-
-    }else{
-	int inum = tree_lookup(path);
-	inode* node = get_inode(inum);
-	void* directory = pages_get_page(node->ptrs[0]);	
-  	for (int ii = 0; ii < node->size; ii += ENT_SIZE) {
-        	dirent* entry = (dirent*)(directory + ii);
-        	list = s_cons(entry->name, list);
-    	}
-	return list;
+    dirent* entry = dir_find(dd, name, len);
+    if (!entry) {
+        return -ENOENT;
     }
+    dcache_insert(parent, name, len, entry->inum);
+    return entry->inum;
 }
 
-slist*
-directory_list(const char* path)
+// resolves the first len bytes of path
+int
+tree_lookup_len(const char* path, int len)
 {
-    slist* list = 0;
-    int i = 0;
-    int n = 0;
-    char hi[48];
-    char ch;
-    int slash = 0;
-    int length = strlen(path);
-    while (i < length){
-        ch = path[i];
-        hi[n] = ch;
-        n++;
-        if(ch == '/' || i == length - 1){
-            if(i == length - 1){
-                n++;
-            }
-            slash = i;
-            char data[48];
-            memcpy(data, hi, n - 1);
-            data[n - 1] = '\0';
-            list = s_cons(data, list);
-            memset(hi, '\0', sizeof(hi));
-            n = 0;
+    int inum = 0;
+    path_iter it;
+    const char* name;
+    int nlen;
+
+    path_iter_init(&it, path, len);
+    while (path_next(&it, &name, &nlen)) {
+        inum = lookup_cached(inum, name, nlen);
+        if (inum < 0) {
+            break;
         }
-    i++;
     }
+    return inum;
+}
 
-    return s_reverse(list);
-   }
+// tree_lookup through the dcache alone, for callers inside epoch_enter
+// that hold no locks; -1 if any component isn't cached
+int
+tree_lookup_fast(const char* path)
+{
+    int inum = 0;
+    path_iter it;
+    const char* name;
+    int nlen;
+
+    path_iter_init(&it, path, strlen(path));
+    while (path_next(&it, &name, &nlen)) {
+        inum = dcache_lookup(inum, name, nlen);
+        if (inum < 0) {
+            break;
+        }
+    }
+    return inum;
+}
 
-char* 
-get_name(const char* path){
-	
-      slist* list = directory_list(path + 1);
+int
+tree_lookup(const char* path)
+{
+    return tree_lookup_len(path, strlen(path));
+}
+
+int
+directory_put(inode* dd, const char* name, int inum, int is_dir)
+{
+    int rv = dir_insert(dd, name, inum, is_dir);
+    if (rv < 0) {
+        return rv;
+    }
 
-      while(list->next){
-	list = list->next;
-      }
-      return list->data;
+    log_trace("+ directory_put(%s, %d, is dir: %d)\n", name, inum, is_dir);
+    dcache_insert(inode_num(dd), name, strlen(name), inum);
+    return 0;
+}
 
+// deferred from directory_delete until lock-free lookups that may
+// have found the inode through the dcache are done with it
+static void
+release_inode(int inum)
+{
+    // and wait out reads and writes still going through open handles
+    inode_lock_wr(inum);
+    free_inode(inum);
+    inode_unlock(inum);
+}
 
+// drops a link to inum, freeing it with the last one
+static void
+unref_inode(int inum)
+{
+    inode* data = get_inode(inum);
+    data->refs -= 1;
+    pages_dirty_ptr(data, sizeof(inode));
+    if (data->refs == 0) {
+        if (S_ISDIR(data->mode)) {
+            dcache_remove_dir(inum);
+        }
+        epoch_defer(release_inode, inum);
+    }
 }
 
 int
-is_file_dir(const char* path){
-	char* parent = get_parent(path);
-	int parent_inum = tree_lookup(parent);
-	inode* parent_dir = get_inode(parent_inum);
-	
-	char* name = get_name(path);
-	void* directory = pages_get_page(parent_dir->ptrs[0]);	
-  	for (int ii = 0; ii < parent_dir->size; ii += ENT_SIZE) {
-        	dirent* entry = (dirent*)(directory + ii);
-        	if (streq(entry->name, name)) {
-	    		return entry->is_dir;
-        	}
-    	}
+directory_delete(inode* dd, const char* name)
+{
+    dirent old;
+    if (dir_remove(dd, name, &old) < 0) {
+        return -ENOENT;
+    }
+    dcache_remove(inode_num(dd), name, strlen(name));
+    unref_inode(old.inum);
+    return 0;
 }
 
+slist*
+list_all(const char* path){
+    slist* list = 0;
+    int inum = tree_lookup(path);
+    if (inum < 0) {
+        return 0;
+    }
+
+    inode* node = get_inode(inum);
+    dirent* entry;
+    for (int pos = 0; (entry = directory_next(node, &pos)); ) {
+        list = s_cons(entry->name, list);
+    }
+    return list;
+}
 
 void
 print_directory(inode* dd)
 {
     printf("Contents:\n");
-    
-    void* directory = pages_get_page(dd->ptrs[0]);
 
-    for (int ii = 0; ii < dd->size; ii += ENT_SIZE) {
-        dirent* entry = (dirent*)(directory + ii);
+    dirent* entry;
+    for (int pos = 0; (entry = directory_next(dd, &pos)); ) {
 	printf("- %s\n", entry->name);
 	if(entry->is_dir){
 		inode* more = get_inode(entry->inum);
@@ -5,6 +5,8 @@
 
 #define DIR_NAME 48
 
+#include <stdint.h>
+
 #include "slist.h"
 #include "pages.h"
 #include "inode.h"
@@ -13,7 +15,8 @@ typedef struct dirent {
     char name[DIR_NAME];
     int  inum;
     int  is_dir;
-    char _reserved[8];
+    uint32_t hash; // hash of name, checked before comparing names
+    char _reserved[4];
 } dirent;
 
 //init the root dir, which is inode 0;
@@ -25,14 +28,20 @@ int directory_lookup(inode* dd, const char* name);
 //given a path, it will look through the path given, and see if that file exist, if it does it will return the inode number for the last item in the path
 int tree_lookup(const char* path);
 
+//tree_lookup that only consults the dcache and takes no locks; -1 on a miss
+int tree_lookup_fast(const char* path);
+
+//tree_lookup on just the first len bytes of path, e.g. its parent from path_split
+int tree_lookup_len(const char* path, int len);
+
 //given a inode, which is the directory, it will put the name of the file or directory with the inum to the the inode directory given, and the is_dir indicates if the new file that is getting put in the inode directory is a file or a directory 
 int directory_put(inode* dd, const char* name, int inum, int is_dir);
 
 //deletes a file in the given inode directory, if refs become zero then that files data block also gets deleted
 int directory_delete(inode* dd, const char* name);
 
-//put the path into slist
-slist* directory_list(const char* path);
+//walks every entry of a directory; start with *pos = 0, stops at 0
+dirent* directory_next(inode* dd, int* pos);
 
 //prints all the stuff in the directory and also prints nested
 //directory
@@ -40,11 +49,10 @@ void print_directory(inode* dd);
 
 int change_directory_name(inode* parent_name, const char* name, const char* new_name);
 
-char* get_name(const char* path);
+//moves an entry between directories, replacing any existing new_name
+int directory_move(inode* from_dd, const char* name, inode* to_dd, const char* new_name);
 
 slist* list_all(const char* path);
 
-
-int is_file_dir(const char* path);
 #endif
 
@@ -0,0 +1,154 @@
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "epoch.h"
+
+typedef struct epoch_slot {
+    unsigned active; // epoch seen on entry, 0 while outside
+    int      used;   // claimed by a live thread
+    char     _pad[56]; // one cache line per slot
+} epoch_slot;
+
+typedef struct limbo {
+    void (*fn)(int);
+    int arg;
+    unsigned epoch; // global epoch when deferred
+    struct limbo* next;
+} limbo;
+
+static epoch_slot slots[EPOCH_THREADS];
+static unsigned global_epoch = 1;
+
+static __thread int my_slot = -1;
+static pthread_key_t slot_key;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+static limbo* limbo_list = 0;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// thread exit: give the slot back
+static void
+slot_release(void* arg)
+{
+    epoch_slot* slot = arg;
+    __atomic_store_n(&(slot->active), 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&(slot->used), 0, __ATOMIC_RELEASE);
+}
+
+static void
+slot_key_init()
+{
+    pthread_key_create(&slot_key, slot_release);
+}
+
+static int
+slot_claim()
+{
+    pthread_once(&slot_once, slot_key_init);
+    for (int ii = 0; ii < EPOCH_THREADS; ++ii) {
+        int free = 0;
+        if (__atomic_compare_exchange_n(&(slots[ii].used), &free, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            pthread_setspecific(slot_key, &(slots[ii]));
+            return ii;
+        }
+    }
+    return -1;
+}
+
+int
+epoch_enter()
+{
+    if (my_slot < 0) {
+        my_slot = slot_claim();
+        if (my_slot < 0) {
+            return 0;
+        }
+    }
+
+    unsigned ee = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&(slots[my_slot].active), ee, __ATOMIC_SEQ_CST);
+    // the announcement must be visible before any shared read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 1;
+}
+
+void
+epoch_exit()
+{
+    __atomic_store_n(&(slots[my_slot].active), 0, __ATOMIC_RELEASE);
+}
+
+// moves the global epoch on if every reader inside has seen it
+static void
+epoch_advance()
+{
+    unsigned ee = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    for (int ii = 0; ii < EPOCH_THREADS; ++ii) {
+        unsigned seen = __atomic_load_n(&(slots[ii].active), __ATOMIC_SEQ_CST);
+        if (seen != 0 && seen != ee) {
+            return;
+        }
+    }
+    __atomic_compare_exchange_n(&global_epoch, &ee, ee + 1, 0,
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+void
+epoch_defer(void (*fn)(int), int arg)
+{
+    unsigned ee = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    limbo* item = malloc(sizeof(limbo));
+    if (!item) {
+        // nowhere to queue it, so wait the readers out instead
+        while (__atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST) - ee < 2) {
+            epoch_advance();
+            sched_yield();
+        }
+        fn(arg);
+        return;
+    }
+    item->fn = fn;
+    item->arg = arg;
+    item->epoch = ee;
+
+    pthread_mutex_lock(&limbo_lock);
+    item->next = limbo_list;
+    limbo_list = item;
+    pthread_mutex_unlock(&limbo_lock);
+
+    epoch_collect();
+}
+
+void
+epoch_collect()
+{
+    epoch_advance();
+    epoch_advance();
+    unsigned ee = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    limbo* ready = 0;
+    pthread_mutex_lock(&limbo_lock);
+    for (limbo** pp = &limbo_list; *pp; ) {
+        limbo* item = *pp;
+        if (ee - item->epoch >= 2) {
+            *pp = item->next;
+            item->next = ready;
+            ready = item;
+        }
+        else {
+            pp = &(item->next);
+        }
+    }
+    pthread_mutex_unlock(&limbo_lock);
+
+    while (ready) {
+        limbo* item = ready;
+        ready = item->next;
+        item->fn(item->arg);
+        free(item);
+    }
+}
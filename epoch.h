@@ -0,0 +1,23 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+// Epoch-based reclamation for lock-free readers.
+//
+// Readers bracket lock-free lookups with epoch_enter/epoch_exit.
+// Writers that unlink something a reader might still be looking at hand
+// its release to epoch_defer, which runs it only once every reader
+// that was inside at the time has left; that takes two epoch advances.
+
+#define EPOCH_THREADS 256 // threads that can be inside at once
+
+// 1 if the calling thread is now inside; 0 if every slot is taken, in
+// which case it must take the locked path instead
+int  epoch_enter();
+void epoch_exit();
+
+// runs fn(arg) once no reader can still see what it releases
+void epoch_defer(void (*fn)(int), int arg);
+// runs whatever deferred work has become safe
+void epoch_collect();
+
+#endif
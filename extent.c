@@ -0,0 +1,240 @@
+
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "extent.h"
+#include "pages.h"
+
+static extent_node*
+node_page(int pnum)
+{
+    return (extent_node*) pages_get_page(pnum);
+}
+
+// index of the last entry whose fpn is <= fpn, or -1
+static int
+find_entry(extent_node* nn, int fpn)
+{
+    int lo = 0;
+    int hi = nn->count - 1;
+    int found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (nn->ents[mid].fpn <= fpn) {
+            found = mid;
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+int
+extent_lookup(extent_node* root, int fpn, int* run)
+{
+    extent_node* nn = root;
+    while (nn->depth > 0) {
+        int ii = find_entry(nn, fpn);
+        if (ii < 0) {
+            return -1;
+        }
+        nn = node_page(nn->ents[ii].pnum);
+    }
+
+    int ii = find_entry(nn, fpn);
+    if (ii < 0) {
+        return -1;
+    }
+
+    extent* ee = &(nn->ents[ii]);
+    int skip = fpn - ee->fpn;
+    if (skip >= ee->len) {
+        return -1;
+    }
+    if (run) {
+        *run = ee->len - skip;
+    }
+    return ee->pnum + skip;
+}
+
+// start a fresh node page holding a single entry
+static int
+new_node(int depth, extent ent)
+{
+    int pnum = alloc_page();
+    if (pnum < 0) {
+        return -ENOSPC;
+    }
+    extent_node* nn = pages_zero_page(pnum);
+    nn->depth = depth;
+    nn->count = 1;
+    nn->ents[0] = ent;
+    pages_dirty(pnum);
+    return pnum;
+}
+
+// frees a chain of nodes from new_node, each holding just the entry
+// that leads to the next, down to the leaf
+static void
+free_new(int pnum)
+{
+    extent_node* nn = node_page(pnum);
+    if (nn->depth > 0) {
+        free_new(nn->ents[0].pnum);
+    }
+    free_page(pnum);
+}
+
+// Add ent at the right edge of the subtree under nn. Returns 0 when it
+// fit, or the page of a new right sibling of nn that the caller must
+// link in.
+static int
+insert_right(extent_node* nn, int max, extent ent)
+{
+    if (nn->depth == 0) {
+        if (nn->count > 0) {
+            extent* last = &(nn->ents[nn->count - 1]);
+            if (last->fpn + last->len == ent.fpn && last->pnum + last->len == ent.pnum) {
+                last->len += ent.len;
+                return 0;
+            }
+        }
+        if (nn->count < max) {
+            nn->ents[nn->count++] = ent;
+            return 0;
+        }
+        return new_node(0, ent);
+    }
+
+    int cnum = nn->ents[nn->count - 1].pnum;
+    extent_node* child = node_page(cnum);
+    int sib = insert_right(child, PAGE_EXTENTS, ent);
+    pages_dirty(cnum);
+    if (sib <= 0) {
+        return sib;
+    }
+
+    extent idx = { ent.fpn, sib, 0 };
+    if (nn->count < max) {
+        nn->ents[nn->count++] = idx;
+        return 0;
+    }
+    int up = new_node(nn->depth, idx);
+    if (up < 0) {
+        free_new(sib);
+    }
+    return up;
+}
+
+int
+extent_append(extent_node* root, int fpn, int pnum, int len)
+{
+    extent ent = { fpn, pnum, len };
+    int sib = insert_right(root, INODE_EXTENTS, ent);
+    if (sib <= 0) {
+        return sib;
+    }
+
+    // the root itself overflowed: push its entries down into a page
+    // and grow the tree by one level
+    int down = alloc_page();
+    if (down < 0) {
+        free_new(sib);
+        return -ENOSPC;
+    }
+    extent_node* nn = pages_zero_page(down);
+    nn->count = root->count;
+    nn->depth = root->depth;
+    memcpy(nn->ents, root->ents, root->count * sizeof(extent));
+    pages_dirty(down);
+
+    root->depth += 1;
+    root->count = 2;
+    root->ents[0] = (extent) { nn->ents[0].fpn, down, 0 };
+    root->ents[1] = (extent) { ent.fpn, sib, 0 };
+    return 0;
+}
+
+static void
+truncate_node(extent_node* nn, int npages)
+{
+    while (nn->count > 0) {
+        extent* ee = &(nn->ents[nn->count - 1]);
+
+        if (nn->depth > 0) {
+            extent_node* child = node_page(ee->pnum);
+            truncate_node(child, npages);
+            if (child->count > 0) {
+                pages_dirty(ee->pnum);
+                return;
+            }
+            free_page(ee->pnum);
+            nn->count -= 1;
+            continue;
+        }
+
+        if (ee->fpn >= npages) {
+            free_pages(ee->pnum, ee->len);
+            nn->count -= 1;
+            continue;
+        }
+        if (ee->fpn + ee->len > npages) {
+            int keep = npages - ee->fpn;
+            free_pages(ee->pnum + keep, ee->len - keep);
+            ee->len = keep;
+        }
+        return;
+    }
+}
+
+void
+extent_truncate(extent_node* root, int npages)
+{
+    truncate_node(root, npages);
+
+    if (root->count == 0) {
+        root->depth = 0;
+    }
+
+    // pull a lone small child back up into the inode
+    while (root->depth > 0 && root->count == 1) {
+        int pnum = root->ents[0].pnum;
+        extent_node* child = node_page(pnum);
+        if (child->count > INODE_EXTENTS) {
+            break;
+        }
+        root->count = child->count;
+        root->depth = child->depth;
+        memcpy(root->ents, child->ents, child->count * sizeof(extent));
+        free_page(pnum);
+    }
+}
+
+int
+extent_count(extent_node* root)
+{
+    if (root->depth == 0) {
+        return root->count;
+    }
+
+    int sum = 0;
+    for (int ii = 0; ii < root->count; ++ii) {
+        sum += extent_count(node_page(root->ents[ii].pnum));
+    }
+    return sum;
+}
+
+void
+extent_take_dirty(extent_node* root, page_ranges* rr)
+{
+    if (root->depth == 0) {
+        return;
+    }
+    for (int ii = 0; ii < root->count; ++ii) {
+        pages_take_dirty(rr, root->ents[ii].pnum, 1);
+        extent_take_dirty(node_page(root->ents[ii].pnum), rr);
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "pages.h"
+
+// A file's pages are mapped by a B+tree of extents rooted in its inode.
+// Files only grow and shrink at the end, so the tree is only ever
+// modified along its right edge.
+
+// one run of contiguous pages; in index nodes pnum is the child node page
+typedef struct extent {
+    int fpn;  // first file page covered
+    int pnum; // first disk page (leaf) or child node page (index)
+    int len;  // pages in the run (leaf only)
+} extent;
+
+// header shared by the inline root and the extent tree pages
+typedef struct extent_node {
+    int count; // entries in use
+    int depth; // 0 means the entries are extents
+    extent ents[];
+} extent_node;
+
+#define INODE_EXTENTS 4
+#define PAGE_EXTENTS  ((NUFS_PAGE_SIZE - sizeof(extent_node)) / sizeof(extent))
+
+// file page -> disk page, -1 if unmapped; *run gets the number of
+// contiguous pages starting there
+int  extent_lookup(extent_node* root, int fpn, int* run);
+// map file pages [fpn, fpn + len) to disk pages [pnum, pnum + len);
+// fpn must be just past the last mapped page. On -ENOSPC none of the
+// run is mapped and the tree holds no new pages.
+int  extent_append(extent_node* root, int fpn, int pnum, int len);
+// unmap and free every page at or after file page npages
+void extent_truncate(extent_node* root, int npages);
+// number of leaf extents, for fragmentation reporting
+int  extent_count(extent_node* root);
+// takes the dirty bits of the tree's own pages (see pages_take_dirty)
+void extent_take_dirty(extent_node* root, page_ranges* rr);
+
+#endif
@@ -1,184 +1,293 @@
 
 #include <stdint.h>
 #include <assert.h>
+#include <errno.h>
 
 #include "pages.h"
 #include "inode.h"
 #include "util.h"
 #include "bitmap.h"
+#include "lock.h"
+#include "magazine.h"
+#include "log.h"
+#include "stats.h"
 
-const int INODE_COUNT = 256;
+static extent_node*
+inode_root(inode* node)
+{
+    return (extent_node*) &(node->ecount);
+}
 
-int grow_iptr(inode* node, int size);
-void shrink_one_page(inode* node);
+static void inode_unmap(inode* node, int npages);
 
 void*
 get_ibitmap()
 {
-    uint8_t* page = pages_get_page(0);
-    return (void*)(page + 32);
+    return pages_get_page(get_super()->ibitmap_start);
 }
 
 
 inode*
 get_inode(int inum)
 {
-    uint8_t* base = (uint8_t*) pages_get_page(1);
-    inode* nodes = (inode*)(base);
-    return &(nodes[inum]);
+    superblock* sb = get_super();
+    assert(inum >= 0 && inum < sb->inode_count);
+    int ipp = NUFS_PAGE_SIZE / sizeof(inode);
+    inode* nodes = (inode*) pages_get_page(sb->itable_start + inum / ipp);
+    return &(nodes[inum % ipp]);
+}
+
+// inverse of get_inode
+int
+inode_num(inode* node)
+{
+    superblock* sb = get_super();
+    uint8_t* table = pages_get_page(sb->itable_start);
+    int ipp = NUFS_PAGE_SIZE / sizeof(inode);
+    size_t off = (uint8_t*) node - table;
+    return (off / NUFS_PAGE_SIZE) * ipp + (off % NUFS_PAGE_SIZE) / sizeof(inode);
 }
 
 int
 alloc_inode(int mode)
 {
-    void* map = get_ibitmap();
-    for (int ii = 1; ii < INODE_COUNT; ++ii) {
-	    if(!bitmap_get(map, ii)){
-		bitmap_put(map, ii, 1);
-		inode* node = get_inode(ii);
-		node->refs = 1;
-		node->mode = mode;
-		node->size = 0;
-		node->iptr = 0;
-		printf("+ alloc_inode() -> %d\n", ii);
-		return ii;
-		}
+    superblock* sb = get_super();
+    thread_cache* tc = thread_cache_get();
+
+    if (tc->inodes.count == 0) {
+        alloc_lock();
+        mag_refill(&(tc->inodes), get_ibitmap(), 1, &(sb->inode_hint), sb->inode_count);
+        pages_dirty_ptr(&(sb->inode_hint), sizeof(int));
+        alloc_unlock();
+        if (tc->inodes.count == 0) {
+            return -1;
+        }
+    }
+
+    int ii = tc->inodes.nums[--tc->inodes.count];
+    stats_add(STAT_INODES_ALLOCED, 1);
+
+    inode* node = get_inode(ii);
+    memset(node, 0, sizeof(inode));
+    node->refs = 1;
+    node->mode = mode;
+    if (sb->flags & NUFS_BLOCKMAP) {
+        node->flags = INODE_BLOCKMAP;
     }
-    return -1;
+    pages_dirty_ptr(node, sizeof(inode));
+    log_trace("+ alloc_inode() -> %d\n", ii);
+    return ii;
 }
 
 void
 free_inode(int inum)
 {
-    printf("+ free_inode(%d)\n", inum);
+    log_trace("+ free_inode(%d)\n", inum);
+    stats_add(STAT_INODES_FREED, 1);
 
     inode* node = get_inode(inum);
-    int pages = bytes_to_pages(node->size);
-    
-    free_page(node->ptrs[0]);
-    free_page(node->ptrs[1]);
+    inode_unmap(node, 0);
+    pages_dirty_ptr(node, sizeof(inode));
 
-    if(pages > 2){
-	free_inode(node->iptr);
+    thread_cache* tc = thread_cache_get();
+    tc->inodes.nums[tc->inodes.count++] = inum;
+    if (tc->inodes.count == MAG_SIZE) {
+        alloc_lock();
+        mag_drain(&(tc->inodes), get_ibitmap(), MAG_SIZE - MAG_BATCH);
+        alloc_unlock();
     }
-	
-
-    
-    void* map = get_ibitmap();
-    bitmap_put(map, inum, 0);
     return;
 }
 
+// file page -> disk page, -1 past the end of the file
+int
+inode_get_pnum(inode* node, int fpn)
+{
+    return inode_map(node, fpn, 0);
+}
+
+// like inode_get_pnum, also reporting how many pages from there on are
+// contiguous on disk
 int
-grow_inode(inode* node, int size){
-	int current_size = node->size;
-	int current_page = bytes_to_pages(current_size);
-	int new_page = bytes_to_pages(current_size + size);
-	int grow_page = new_page - current_page;
-	if(grow_page == 0){
-		node->size = size;
-		return 0;
-	}else{
-		node->size = size;
-		while(current_page < 2 && grow_page > 0){
-			int page = alloc_page();
-			assert(page != -1);
-			node->ptrs[current_page] = page;
-			current_page += 1;
-			grow_page -= 1;
-			size -= 4096;
-		}
-		if(grow_page > 0){
-			node->size = 2 * 4096;
-			node->iptr = grow_iptr(node, size);
-			assert(node->iptr != -1);
-		}
-		return 0;
-		
-
-	}
-
-}
-
-int 
-grow_iptr(inode* node, int size){
-	int new_num = alloc_inode(node->mode);
-	assert(new_num != -1);
-	inode* new_node = get_inode(new_num);
-	grow_inode(new_node, size);
-	return new_num;
-}
-
-
-//gets the inode size, including the iptrs
+inode_map(inode* node, int fpn, int* run)
+{
+    if (node->flags & INODE_BLOCKMAP) {
+        return blockmap_lookup(node, fpn, run);
+    }
+    return extent_lookup(inode_root(node), fpn, run);
+}
+
+// number of contiguous on-disk runs the file is split into
 int
-get_isize(inode* node){
-	if(node->iptr){
-		inode* more_node = get_inode(node->iptr);
-		return node->size + get_isize(more_node);
-	}else{
-		return node->size;
-	}
+inode_extents(inode* node)
+{
+    if (!(node->flags & INODE_BLOCKMAP)) {
+        return extent_count(inode_root(node));
+    }
+
+    int count = 0;
+    int pages = bytes_to_pages(node->size);
+    for (int fpn = 0; fpn < pages; ) {
+        int run;
+        if (blockmap_lookup(node, fpn, &run) < 0) {
+            break;
+        }
+        count += 1;
+        fpn += run;
+    }
+    return count;
+}
+
+// maps the run; on failure *mapped gets how many of its pages already
+// were (an extent append maps all or none, a block map slot by slot)
+static int
+inode_append(inode* node, int fpn, int pnum, int len, int* mapped)
+{
+    *mapped = 0;
+    if (!(node->flags & INODE_BLOCKMAP)) {
+        return extent_append(inode_root(node), fpn, pnum, len);
+    }
+
+    for (int ii = 0; ii < len; ++ii) {
+        int rv = blockmap_set(node, fpn + ii, pnum + ii);
+        if (rv < 0) {
+            return rv;
+        }
+        *mapped = ii + 1;
+    }
+    return 0;
+}
+
+// bumped whenever pages are unmapped, so cached translations held by
+// open files know to look again; atomic since threads holding different
+// inode locks unmap concurrently
+static unsigned map_epoch = 0;
+
+unsigned
+inode_map_epoch()
+{
+    return __atomic_load_n(&map_epoch, __ATOMIC_ACQUIRE);
 }
 
+static void
+inode_unmap(inode* node, int npages)
+{
+    __atomic_add_fetch(&map_epoch, 1, __ATOMIC_RELEASE);
+    if (node->flags & INODE_BLOCKMAP) {
+        blockmap_truncate(node, npages);
+    }
+    else {
+        extent_truncate(inode_root(node), npages);
+    }
+}
 
+// grows the file to size bytes, mapping zeroed pages onto the end
 int
-shrink_inode(inode* node, int size) 
-{	
-	if (size > node->size) {
-        return -1;
-	}
-	int current_size = node->size;
-	int current_page = bytes_to_pages(current_size);
-	int new_page = bytes_to_pages(current_size - size);
-	int shrink_page = current_page - new_page;
+grow_inode(inode* node, int64_t size)
+{
+    if (size <= node->size) {
+        return 0;
+    }
+    if (node->flags & INODE_BLOCKMAP && bytes_to_pages(size) > BLOCKMAP_MAX_PAGES) {
+        return -EFBIG;
+    }
 
-	if(shrink_page == 0){
-		node->size = size;
-		return 0;
-	}else{
-		while(shrink_page){
-			shrink_one_page(node);
-			shrink_page -= 1;
-    		}
-		return 0;
-	}
+    int have = bytes_to_pages(node->size);
+    int want = bytes_to_pages(size);
 
+    // place new pages right after the file's current last page so
+    // sequential growth extends the last extent
+    int goal = (have > 0) ? inode_get_pnum(node, have - 1) + 1 : -1;
 
+    for (int fpn = have; fpn < want; ) {
+        int got;
+        int mapped = 0;
+        int page = alloc_pages(want - fpn, goal, &got);
+        if (page < 0 || inode_append(node, fpn, page, got, &mapped) < 0) {
+            // the unmap frees whatever got mapped, this run's included
+            inode_unmap(node, have);
+            if (page >= 0 && mapped < got) {
+                free_pages(page + mapped, got - mapped);
+            }
+            pages_dirty_ptr(node, sizeof(inode));
+            return -ENOSPC;
+        }
+        for (int ii = 0; ii < got; ++ii) {
+            pages_zero_page(page + ii);
+            pages_dirty(page + ii);
+            pages_put_page(page + ii);
+        }
+        fpn += got;
+        goal = page + got;
+    }
 
+    node->size = size;
+    pages_dirty_ptr(node, sizeof(inode));
+    return 0;
 }
 
-void
-shrink_one_page(inode* node){
-	if(node->iptr){
-		inode* next_node = get_inode(node->iptr);
-		if(get_isize(next_node) > 4096){
-			shrink_one_page(next_node);
-		}else{
-			int size = 4096 - next_node->size;
-		        node->size -= size;
-			free_inode(node->iptr);
-			node->iptr = 0;
-		}
-	}
-	else if(node->ptrs[1]){
-		free_page(node->ptrs[1]);
-		node->ptrs[1] = 0;
-		node->size -= 4096;
-	}else if(node->ptrs[0]){
-		free_page(node->ptrs[0]);
-		node->ptrs[0] = 0;
-		node->size = 0;
-	}
+// shrinks the file to size bytes, freeing pages past the new end
+int
+shrink_inode(inode* node, int64_t size)
+{
+    if (size > node->size) {
+        return -1;
+    }
+
+    int keep = bytes_to_pages(size);
+    inode_unmap(node, keep);
+
+    // zero the tail of the last page so a later grow reads back zeros
+    int tail = size % NUFS_PAGE_SIZE;
+    if (tail) {
+        int pnum = inode_get_pnum(node, keep - 1);
+        uint8_t* data = pages_get_page(pnum);
+        memset(data + tail, 0, NUFS_PAGE_SIZE - tail);
+        pages_dirty(pnum);
+    }
+
+    node->size = size;
+    pages_dirty_ptr(node, sizeof(inode));
+    return 0;
 }
 
+// Takes the dirty bits of everything fsync owes this file: its data,
+// the pages mapping it and the itable page holding the inode itself.
+void
+inode_take_dirty(inode* node, page_ranges* rr)
+{
+    int pages = bytes_to_pages(node->size);
+    for (int fpn = 0; fpn < pages; ) {
+        int run;
+        int pnum = inode_map(node, fpn, &run);
+        if (pnum < 0) {
+            break;
+        }
+        if (run > pages - fpn) {
+            run = pages - fpn;
+        }
+        pages_take_dirty(rr, pnum, run);
+        fpn += run;
+    }
+
+    if (node->flags & INODE_BLOCKMAP) {
+        blockmap_take_dirty(node, rr);
+    }
+    else {
+        extent_take_dirty(inode_root(node), rr);
+    }
+
+    superblock* sb = get_super();
+    int ipp = NUFS_PAGE_SIZE / sizeof(inode);
+    pages_take_dirty(rr, sb->itable_start + inode_num(node) / ipp, 1);
+}
 
 void
 print_inode(inode* node)
 {
     if (node) {
-        printf("node{mode: %04o, size: %d}\n",
-               node->mode, node->size);
+        printf("node{mode: %04o, size: %ld}\n",
+               node->mode, (long) node->size);
     }
     else {
         printf("node{null}\n");
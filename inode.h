@@ -3,24 +3,47 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <stdint.h>
+
 #include "pages.h"
+#include "extent.h"
+#include "blockmap.h"
+
+// inode flags
+#define INODE_BLOCKMAP 1 // mapped by ptrs/iptr/diptr rather than extents
 
 typedef struct inode {
     int refs; // reference count
     int mode; // permission & type
-    int size; // bytes
-    int ptrs[2]; // direct pointers
-    int iptr; // single indirect pointer
+    int64_t size; // bytes
+    int flags;
+    union {
+        struct {
+            // root of the extent tree, laid out as an extent_node
+            int ecount; // entries in ext[]
+            int edepth; // 0 when ext[] holds the extents themselves
+            extent ext[INODE_EXTENTS];
+        };
+        struct {
+            int ptrs[INODE_DIRECT]; // direct pointers
+            int iptr;  // page of PTRS_PER_PAGE direct pointers
+            int diptr; // page of PTRS_PER_PAGE iptr-style pages
+        };
+    };
 } inode;
 
 void print_inode(inode* node);
 inode* get_inode(int inum);
+int inode_num(inode* node);
 int alloc_inode(int mode);
 void free_inode(int inum);
-int get_isize(inode* node);
-int grow_inode(inode* node, int size);
-int shrink_inode(inode* node, int size);
+int grow_inode(inode* node, int64_t size);
+int shrink_inode(inode* node, int64_t size);
 void* get_ibitmap();
-//int inode_get_pnum(inode* node, int fpn);
+int inode_get_pnum(inode* node, int fpn);
+int inode_map(inode* node, int fpn, int* run);
+int inode_extents(inode* node);
+unsigned inode_map_epoch();
+void inode_take_dirty(inode* node, page_ranges* rr);
 
 #endif
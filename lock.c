@@ -0,0 +1,72 @@
+
+#include <pthread.h>
+
+#include "lock.h"
+
+static pthread_rwlock_t ns_rwlock;
+static pthread_rwlock_t inode_rwlocks[INODE_LOCKS];
+static pthread_mutex_t  alloc_mutex;
+
+void
+lock_init()
+{
+    pthread_rwlock_init(&ns_rwlock, 0);
+    for (int ii = 0; ii < INODE_LOCKS; ++ii) {
+        pthread_rwlock_init(&(inode_rwlocks[ii]), 0);
+    }
+    pthread_mutex_init(&alloc_mutex, 0);
+}
+
+void
+ns_lock_rd()
+{
+    pthread_rwlock_rdlock(&ns_rwlock);
+}
+
+void
+ns_lock_wr()
+{
+    pthread_rwlock_wrlock(&ns_rwlock);
+}
+
+void
+ns_unlock()
+{
+    pthread_rwlock_unlock(&ns_rwlock);
+}
+
+static pthread_rwlock_t*
+inode_rwlock(int inum)
+{
+    return &(inode_rwlocks[inum & (INODE_LOCKS - 1)]);
+}
+
+void
+inode_lock_rd(int inum)
+{
+    pthread_rwlock_rdlock(inode_rwlock(inum));
+}
+
+void
+inode_lock_wr(int inum)
+{
+    pthread_rwlock_wrlock(inode_rwlock(inum));
+}
+
+void
+inode_unlock(int inum)
+{
+    pthread_rwlock_unlock(inode_rwlock(inum));
+}
+
+void
+alloc_lock()
+{
+    pthread_mutex_lock(&alloc_mutex);
+}
+
+void
+alloc_unlock()
+{
+    pthread_mutex_unlock(&alloc_mutex);
+}
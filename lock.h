@@ -0,0 +1,30 @@
+#ifndef LOCK_H
+#define LOCK_H
+
+// Locks for running nufsmount multithreaded (without -s).
+//
+//  - the namespace lock covers every directory: lookups and readdir
+//    take it shared, mknod/unlink/link/rename take it exclusive
+//  - inode locks cover a file's size and page mapping; they are a
+//    striped table of rwlocks, so two inodes may share one
+//  - the allocator lock covers the page and inode bitmaps and the
+//    superblock hints
+//
+// Always acquired in that order, and at most one inode lock at a time.
+
+#define INODE_LOCKS 1024 // power of two
+
+void lock_init();
+
+void ns_lock_rd();
+void ns_lock_wr();
+void ns_unlock();
+
+void inode_lock_rd(int inum);
+void inode_lock_wr(int inum);
+void inode_unlock(int inum);
+
+void alloc_lock();
+void alloc_unlock();
+
+#endif
@@ -0,0 +1,25 @@
+
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "log.h"
+#include "util.h"
+
+int log_level = LV_WARN;
+
+static const char* level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+int
+log_parse_level(const char* name)
+{
+    if (isdigit(name[0]) && name[1] == 0) {
+        int lvl = name[0] - '0';
+        return (lvl <= LV_TRACE) ? lvl : -1;
+    }
+    for (int ii = 0; ii <= LV_TRACE; ++ii) {
+        if (streq(name, level_names[ii])) {
+            return ii;
+        }
+    }
+    return -1;
+}
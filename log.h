@@ -0,0 +1,41 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+// Leveled logging to stderr.
+//
+// Messages above NUFS_LOG_MAX are compiled out (make RELEASE=1 keeps
+// only errors and warnings); the rest are checked against log_level,
+// set at mount time, before anything gets formatted. Per-op callbacks
+// log at debug, anything inside them at trace.
+
+#define LV_ERROR 0
+#define LV_WARN  1
+#define LV_INFO  2
+#define LV_DEBUG 3
+#define LV_TRACE 4
+
+#ifndef NUFS_LOG_MAX
+#define NUFS_LOG_MAX LV_TRACE
+#endif
+
+extern int log_level;
+
+// "error", "warn", "info", "debug", "trace" or a digit; -1 if unknown
+int log_parse_level(const char* name);
+
+#define LOG_AT(lvl, ...)                                              \
+    do {                                                              \
+        if ((lvl) <= NUFS_LOG_MAX && __builtin_expect((lvl) <= log_level, 0)) { \
+            fprintf(stderr, __VA_ARGS__);                             \
+        }                                                             \
+    } while (0)
+
+#define log_error(...) LOG_AT(LV_ERROR, __VA_ARGS__)
+#define log_warn(...)  LOG_AT(LV_WARN, __VA_ARGS__)
+#define log_info(...)  LOG_AT(LV_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LV_DEBUG, __VA_ARGS__)
+#define log_trace(...) LOG_AT(LV_TRACE, __VA_ARGS__)
+
+#endif
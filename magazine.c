@@ -0,0 +1,133 @@
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "magazine.h"
+#include "pages.h"
+#include "inode.h"
+#include "bitmap.h"
+#include "lock.h"
+
+// every live thread's cache, under the allocator lock
+static thread_cache* caches = 0;
+static int cache_count = 0; // caches ever made, to spread out regions
+
+static __thread thread_cache* my_cache = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static void
+cache_drain(thread_cache* tc)
+{
+    mag_drain(&(tc->pages), get_pbitmap(), 0);
+    run_drain(tc, get_pbitmap());
+    mag_drain(&(tc->inodes), get_ibitmap(), 0);
+}
+
+// thread exit: give the cached numbers back and forget the cache
+static void
+cache_release(void* arg)
+{
+    thread_cache* tc = arg;
+    alloc_lock();
+    cache_drain(tc);
+    for (thread_cache** pp = &caches; *pp; pp = &((*pp)->next)) {
+        if (*pp == tc) {
+            *pp = tc->next;
+            break;
+        }
+    }
+    alloc_unlock();
+    free(tc);
+}
+
+static void
+cache_key_init()
+{
+    pthread_key_create(&cache_key, cache_release);
+}
+
+thread_cache*
+thread_cache_get()
+{
+    if (my_cache) {
+        return my_cache;
+    }
+
+    pthread_once(&cache_once, cache_key_init);
+    thread_cache* tc = calloc(1, sizeof(thread_cache));
+    assert(tc);
+
+    // the first thread carries on from the persisted hint; the rest
+    // start in their own slice so concurrent writers don't interleave
+    superblock* sb = get_super();
+    alloc_lock();
+    int kk = cache_count++;
+    int64_t span = sb->page_count - sb->data_start;
+    tc->page_goal = (kk == 0) ? sb->page_hint
+                  : sb->data_start + (int)((kk % MAG_REGIONS) * span / MAG_REGIONS);
+    tc->next = caches;
+    caches = tc;
+    alloc_unlock();
+
+    pthread_setspecific(cache_key, tc);
+    my_cache = tc;
+    return tc;
+}
+
+int
+mag_refill(magazine* mag, void* bm, int lo, int* hint, int end)
+{
+    int first = mag->count;
+    int ii = *hint;
+    while (mag->count < MAG_BATCH) {
+        ii = bitmap_alloc_scan(bm, lo, ii, end);
+        if (ii < 0) {
+            break;
+        }
+        bitmap_put(bm, ii, 1);
+        mag->nums[mag->count++] = ii;
+        ii += 1;
+    }
+    if (ii >= 0) {
+        *hint = ii;
+    }
+
+    // hand them out lowest first
+    for (int aa = first, bb = mag->count - 1; aa < bb; ++aa, --bb) {
+        int tmp = mag->nums[aa];
+        mag->nums[aa] = mag->nums[bb];
+        mag->nums[bb] = tmp;
+    }
+    return mag->count;
+}
+
+void
+mag_drain(magazine* mag, void* bm, int keep)
+{
+    while (mag->count > keep) {
+        mag->count -= 1;
+        bitmap_put(bm, mag->nums[mag->count], 0);
+    }
+}
+
+void
+run_drain(thread_cache* tc, void* pbm)
+{
+    for (int ii = 0; ii < tc->run_len; ++ii) {
+        bitmap_put(pbm, tc->run_start + ii, 0);
+    }
+    tc->run_len = 0;
+}
+
+void
+thread_cache_drain_all()
+{
+    alloc_lock();
+    for (thread_cache* tc = caches; tc; tc = tc->next) {
+        cache_drain(tc);
+    }
+    alloc_unlock();
+}
@@ -0,0 +1,51 @@
+#ifndef MAGAZINE_H
+#define MAGAZINE_H
+
+// Per-thread caches ("magazines") of free page and inode numbers, so
+// most alloc_page / free_page / alloc_inode / free_inode calls touch
+// neither the allocator lock nor the shared bitmaps. Numbers sitting in
+// a magazine are marked used in their bitmap; they move between the two
+// MAG_BATCH at a time, under the allocator lock.
+//
+// File data comes from alloc_pages instead, in runs. Each time it takes
+// the lock it also reserves up to MAG_RUN free pages just past the run
+// it hands out, marked used like a magazine's, and serves the next
+// calls that continue from there out of that reservation without it.
+
+#define MAG_SIZE    32
+#define MAG_BATCH   16
+#define MAG_REGIONS 16 // slices of the data area threads start out in
+#define MAG_RUN     64 // pages alloc_pages reserves past a run
+
+typedef struct magazine {
+    int count;
+    int nums[MAG_SIZE];
+} magazine;
+
+typedef struct thread_cache {
+    magazine pages;
+    magazine inodes;
+    int page_goal; // where this thread's next unplaced allocation looks first
+    int run_start; // pages reserved for alloc_pages, marked used
+    int run_len;
+    struct thread_cache* next;
+} thread_cache;
+
+// the calling thread's cache, made on first use; not with the allocator
+// lock held
+thread_cache* thread_cache_get();
+
+// these two with the allocator lock held:
+// tops mag up to MAG_BATCH clear bits of bm in [lo, end), searching
+// from *hint and moving it past what was taken; returns mag->count
+int  mag_refill(magazine* mag, void* bm, int lo, int* hint, int end);
+// clears the bits of all but keep of mag's numbers
+void mag_drain(magazine* mag, void* bm, int keep);
+// clears the bits of tc's reserved run and drops it
+void run_drain(thread_cache* tc, void* pbm);
+
+// hands every thread's cached numbers back to the bitmaps; for
+// shutdown, once no other thread is allocating
+void thread_cache_drain_all();
+
+#endif
@@ -6,6 +6,9 @@
 #include <sys/stat.h>
 #include <bsd/string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
 
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
@@ -13,14 +16,55 @@
 #include "storage.h"
 #include "slist.h"
 #include "util.h"
+#include "log.h"
+#include "trace.h"
+#include "stats.h"
+#include "record.h"
+#include "pages.h"
+
+// every callback brackets its work with these, for the latency
+// histograms and, when it is on, the trace; those that change or read
+// the filesystem also hand record_op what replay needs
+static inline uint64_t
+op_begin()
+{
+    return trace_clock();
+}
+
+static void
+op_end(int op, int inum, int64_t offset, uint32_t size, uint64_t t0, int rv)
+{
+    uint64_t t1 = trace_clock();
+    stats_op(op, t1 - t0);
+    trace_record(op, inum, offset, size, t0, t1, rv);
+}
+
+// the most one write request may carry, when the kernel and libfuse
+// agree to it
+#define NUFS_MAX_WRITE (1 << 20)
+
+// an open STATS_PATH: the text is rendered once, at open
+typedef struct stats_file {
+    size_t len;
+    char text[8192];
+} stats_file;
+
+static int
+is_stats(const char* path)
+{
+    return path[1] == '.' && streq(path, STATS_PATH);
+}
 
 // implementation for: man 2 access
 // Checks if a file exists.
 int
 nufs_access(const char *path, int mask)
 {
+    uint64_t t0 = op_begin();
     int rv = 0;
-    printf("access(%s, %04o) -> %d\n", path, mask, rv);
+    op_end(TOP_ACCESS, -1, 0, mask, t0, rv);
+    record_op(TOP_ACCESS, path, 0, 0, 0, mask, 0, t0, rv);
+    log_debug("access(%s, %04o) -> %d\n", path, mask, rv);
     return rv;
 }
 
@@ -29,8 +73,21 @@ nufs_access(const char *path, int mask)
 int
 nufs_getattr(const char *path, struct stat *st)
 {
-    int rv = storage_stat(path, st);
-    printf("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
+    uint64_t t0 = op_begin();
+    int rv;
+    if (is_stats(path)) {
+        memset(st, 0, sizeof(struct stat));
+        st->st_mode = 0100444;
+        st->st_nlink = 1;
+        st->st_uid = getuid();
+        rv = 0;
+    }
+    else {
+        rv = storage_stat(path, st);
+    }
+    op_end(TOP_GETATTR, rv == 0 ? st->st_ino : -1, 0, 0, t0, rv);
+    record_op(TOP_GETATTR, path, 0, 0, 0, 0, 0, t0, rv);
+    log_debug("getattr(%s) -> (%d) {mode: %04o, size: %ld}\n", path, rv, st->st_mode, st->st_size);
     return rv;
 }
 
@@ -40,28 +97,32 @@ int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
              off_t offset, struct fuse_file_info *fi)
 {
+    uint64_t t0 = op_begin();
     struct stat st;
-    char item_path[128];
     int rv;
 
     rv = storage_stat(path, &st);
-    assert(rv == 0);
+    if (rv == 0) {
+        filler(buf, ".", &st, 0);
 
-    filler(buf, ".", &st, 0);
-
-    slist* items = storage_list("/");
-    for (slist* xs = items; xs != 0; xs = xs->next) {
-        printf("+ looking at path: '%s'\n", xs->data);
-        item_path[0] = '/';
-        strlcpy(item_path + 1, xs->data, 127);
-        rv = storage_stat(item_path, &st);
-        assert(rv == 0);
-        filler(buf, xs->data, &st, 0);
+        // under mount-mt, entries can be unlinked or renamed away
+        // between the listing and their stat; those are left out
+        slist* items = storage_list(path);
+        for (slist* xs = items; xs != 0; xs = xs->next) {
+            log_trace("+ looking at path: '%s'\n", xs->data);
+            char* item_path = path_join(path, xs->data);
+            if (storage_stat(item_path, &st) == 0) {
+                filler(buf, xs->data, &st, 0);
+            }
+            free(item_path);
+        }
+        s_free(items);
     }
-    s_free(items);
 
-    printf("readdir(%s) -> %d\n", path, rv);
-    return 0;
+    op_end(TOP_READDIR, -1, offset, 0, t0, rv);
+    record_op(TOP_READDIR, path, 0, offset, 0, 0, 0, t0, rv);
+    log_debug("readdir(%s) -> %d\n", path, rv);
+    return rv;
 }
 
 // mknod makes a filesystem object like a file or directory
@@ -69,8 +130,14 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 int
 nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 {
+    if (is_stats(path)) {
+        return -EEXIST;
+    }
+    uint64_t t0 = op_begin();
     int rv = storage_mknod(path, mode, 0);
-    printf("mknod(%s, %04o) -> %d\n", path, mode, rv);
+    op_end(TOP_MKNOD, -1, 0, 0, t0, rv);
+    record_op(TOP_MKNOD, path, 0, 0, 0, mode, 0, t0, rv);
+    log_debug("mknod(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
 
@@ -79,32 +146,47 @@ nufs_mknod(const char *path, mode_t mode, dev_t rdev)
 int
 nufs_mkdir(const char *path, mode_t mode)
 {
+    if (is_stats(path)) {
+        return -EEXIST;
+    }
+    uint64_t t0 = op_begin();
     int rv = storage_mknod(path, mode | 040000, 1);
-    printf("mkdir(%s) -> %d\n", path, rv);
+    op_end(TOP_MKDIR, -1, 0, 0, t0, rv);
+    record_op(TOP_MKDIR, path, 0, 0, 0, mode, 0, t0, rv);
+    log_debug("mkdir(%s) -> %d\n", path, rv);
     return rv;
 }
 
 int
 nufs_unlink(const char *path)
 {
+    uint64_t t0 = op_begin();
     int rv = storage_unlink(path);
-    printf("unlink(%s) -> %d\n", path, rv);
+    op_end(TOP_UNLINK, -1, 0, 0, t0, rv);
+    record_op(TOP_UNLINK, path, 0, 0, 0, 0, 0, t0, rv);
+    log_debug("unlink(%s) -> %d\n", path, rv);
     return rv;
 }
 
 int
 nufs_link(const char *from, const char *to)
 {
+    uint64_t t0 = op_begin();
     int rv = storage_link(from, to);
-    printf("link(%s => %s) -> %d\n", from, to, rv);
+    op_end(TOP_LINK, -1, 0, 0, t0, rv);
+    record_op(TOP_LINK, from, to, 0, 0, 0, 0, t0, rv);
+    log_debug("link(%s => %s) -> %d\n", from, to, rv);
 	return rv;
 }
 
 int
 nufs_rmdir(const char *path)
 {
+    uint64_t t0 = op_begin();
     int rv = storage_unlink(path);
-    printf("rmdir(%s) -> %d\n", path, rv);
+    op_end(TOP_RMDIR, -1, 0, 0, t0, rv);
+    record_op(TOP_RMDIR, path, 0, 0, 0, 0, 0, t0, rv);
+    log_debug("rmdir(%s) -> %d\n", path, rv);
     return rv;
 }
 
@@ -113,53 +195,322 @@ nufs_rmdir(const char *path)
 int
 nufs_rename(const char *from, const char *to)
 {
+    uint64_t t0 = op_begin();
     int rv = storage_rename(from, to);
-    printf("rename(%s => %s) -> %d\n", from, to, rv);
+    op_end(TOP_RENAME, -1, 0, 0, t0, rv);
+    record_op(TOP_RENAME, from, to, 0, 0, 0, 0, t0, rv);
+    log_debug("rename(%s => %s) -> %d\n", from, to, rv);
     return rv;
 }
 
 int
 nufs_chmod(const char *path, mode_t mode)
 {
+    uint64_t t0 = op_begin();
     int rv = storage_chmod(path, mode);
-    printf("chmod(%s, %04o) -> %d\n", path, mode, rv);
+    op_end(TOP_CHMOD, -1, 0, 0, t0, rv);
+    record_op(TOP_CHMOD, path, 0, 0, 0, mode, 0, t0, rv);
+    log_debug("chmod(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
 
 int
 nufs_truncate(const char *path, off_t size)
 {
+    uint64_t t0 = op_begin();
     int rv = storage_truncate(path, size);
-    printf("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+    op_end(TOP_TRUNCATE, -1, size, 0, t0, rv);
+    record_op(TOP_TRUNCATE, path, 0, size, 0, 0, 0, t0, rv);
+    log_debug("truncate(%s, %ld bytes) -> %d\n", path, size, rv);
+    return rv;
+}
+
+// the open_file stashed in fi by open/create, if any
+static open_file*
+file_of(struct fuse_file_info *fi)
+{
+    return fi ? (open_file*)(uintptr_t) fi->fh : 0;
+}
+
+int
+nufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    uint64_t t0 = op_begin();
+    open_file* of = file_of(fi);
+    int rv = of ? storage_truncate_fh(of, size) : storage_truncate(path, size);
+    op_end(TOP_TRUNCATE, of ? of->inum : -1, size, 0, t0, rv);
+    record_op(TOP_TRUNCATE, path, 0, size, 0, 0, (uintptr_t) of, t0, rv);
+    log_debug("ftruncate(%s, %ld bytes) -> %d\n", path, size, rv);
     return rv;
 }
 
-// this is called on open, but doesn't need to do much
-// since FUSE doesn't assume you maintain state for
-// open files.
+// resolves the path once and keeps the result in fi->fh for the
+// reads and writes that follow
 int
 nufs_open(const char *path, struct fuse_file_info *fi)
 {
-    int rv = nufs_access(path, 0);
-    printf("open(%s) -> %d\n", path, rv);
+    if (is_stats(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        stats_file* sf = malloc(sizeof(stats_file));
+        if (!sf) {
+            return -ENOMEM;
+        }
+        sf->len = stats_format(sf->text, sizeof(sf->text));
+        fi->fh = (uintptr_t) sf;
+        // the size getattr reports (0) isn't the real one
+        fi->direct_io = 1;
+        return 0;
+    }
+
+    uint64_t t0 = op_begin();
+    open_file* of;
+    int rv = storage_open(path, fi->flags, &of);
+    if (rv == 0) {
+        fi->fh = (uintptr_t) of;
+    }
+    op_end(TOP_OPEN, rv == 0 ? of->inum : -1, 0, 0, t0, rv);
+    record_op(TOP_OPEN, path, 0, 0, 0, fi->flags, rv == 0 ? (uintptr_t) of : 0, t0, rv);
+    log_debug("open(%s) -> %d\n", path, rv);
+    return rv;
+}
+
+int
+nufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    if (is_stats(path)) {
+        return -EEXIST;
+    }
+    uint64_t t0 = op_begin();
+    open_file* of = 0;
+    int rv = storage_mknod(path, mode, 0);
+    if (rv == 0) {
+        rv = storage_open(path, fi->flags, &of);
+    }
+    if (rv == 0) {
+        fi->fh = (uintptr_t) of;
+    }
+    op_end(TOP_CREATE, rv == 0 ? of->inum : -1, 0, 0, t0, rv);
+    record_op(TOP_CREATE, path, 0, 0, 0, mode, (uintptr_t) of, t0, rv);
+    log_debug("create(%s, %04o) -> %d\n", path, mode, rv);
     return rv;
 }
 
+int
+nufs_release(const char *path, struct fuse_file_info *fi)
+{
+    if (is_stats(path)) {
+        free((stats_file*)(uintptr_t) fi->fh);
+        fi->fh = 0;
+        return 0;
+    }
+
+    uint64_t t0 = op_begin();
+    open_file* of = file_of(fi);
+    int inum = of ? of->inum : -1;
+    // recorded while the handle is still ours: once freed, its address
+    // can come back as the next open's handle id
+    record_op(TOP_RELEASE, path, 0, 0, 0, 0, (uintptr_t) of, t0, 0);
+    storage_release(of);
+    fi->fh = 0;
+    op_end(TOP_RELEASE, inum, 0, 0, t0, 0);
+    log_debug("release(%s)\n", path);
+    return 0;
+}
+
 // Actually read data
 int
 nufs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int rv = storage_read(path, buf, size, offset);
-    printf("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    if (is_stats(path)) {
+        stats_file* sf = (stats_file*)(uintptr_t) fi->fh;
+        if (offset >= sf->len) {
+            return 0;
+        }
+        size_t nn = (size < sf->len - offset) ? size : sf->len - offset;
+        memcpy(buf, sf->text + offset, nn);
+        return nn;
+    }
+
+    uint64_t t0 = op_begin();
+    open_file* of = file_of(fi);
+    int rv = of ? storage_read_fh(of, buf, size, offset) : storage_read(path, buf, size, offset);
+    op_end(TOP_READ, of ? of->inum : -1, offset, size, t0, rv);
+    record_op(TOP_READ, path, 0, offset, size, 0, (uintptr_t) of, t0, rv);
+    log_debug("read(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
     return rv;
 }
 
+// FUSE reads through this rather than nufs_read when it's set: instead
+// of the data it gets the byte ranges of the image file that hold it,
+// and with splice moves them to the kernel without a copy through here
+// (it copies small replies itself). The handle-less and stats cases,
+// and the cache backends, where the image file may be behind, go
+// through nufs_read into a buffer FUSE frees.
+int
+nufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+              struct fuse_file_info *fi)
+{
+    open_file* of = file_of(fi);
+    if (!of || is_stats(path) || !pages_mapped()) {
+        char* mem = malloc(size);
+        struct fuse_bufvec* bv = malloc(sizeof(struct fuse_bufvec));
+        int rv = (mem && bv) ? nufs_read(path, mem, size, offset, fi) : -ENOMEM;
+        if (rv < 0) {
+            free(mem);
+            free(bv);
+            return rv;
+        }
+        *bv = FUSE_BUFVEC_INIT(rv);
+        bv->buf[0].mem = mem;
+        *bufp = bv;
+        return 0;
+    }
+
+    uint64_t t0 = op_begin();
+    int max = size / 4096 + 2;
+    file_run* runs = malloc(max * sizeof(file_run));
+    struct fuse_bufvec* bv = malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+    if (!runs || !bv) {
+        free(runs);
+        free(bv);
+        return -ENOMEM;
+    }
+
+    size_t total;
+    int count = storage_read_runs(of, size, offset, runs, max, &total);
+    *bv = FUSE_BUFVEC_INIT(0);
+    for (int ii = 0; ii < count; ++ii) {
+        bv->buf[ii].size = runs[ii].len;
+        bv->buf[ii].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv->buf[ii].mem = 0;
+        bv->buf[ii].fd = pages_get_fd();
+        bv->buf[ii].pos = runs[ii].pos;
+    }
+    bv->count = count ? count : 1;
+    free(runs);
+    *bufp = bv;
+
+    op_end(TOP_READ, of->inum, offset, size, t0, total);
+    record_op(TOP_READ, path, 0, offset, size, 0, (uintptr_t) of, t0, total);
+    log_debug("read_buf(%s, %ld bytes, @+%ld) -> %zu in %d runs\n", path, size, offset, total, count);
+    return 0;
+}
+
 // Actually write data
 int
 nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    int rv = storage_write(path, buf, size, offset);
-    printf("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    uint64_t t0 = op_begin();
+    open_file* of = file_of(fi);
+    int rv = of ? storage_write_fh(of, buf, size, offset) : storage_write(path, buf, size, offset);
+    op_end(TOP_WRITE, of ? of->inum : -1, offset, size, t0, rv);
+    record_op(TOP_WRITE, path, 0, offset, size, 0, (uintptr_t) of, t0, rv);
+    log_debug("write(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    return rv;
+}
+
+// FUSE writes through this rather than nufs_write when it's set. With
+// splice the data arrives as a pipe, and fuse_buf_copy splices it
+// straight into the image file at the pages the file was grown over;
+// otherwise it's one pwrite per run. The inode stays locked throughout.
+// Under the cache backends the data has to land in the cache instead,
+// so it's copied out and handed to nufs_write.
+int
+nufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+               struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    // write(2) of nothing changes nothing; begin would grow the file
+    // out to offset
+    if (size == 0) {
+        return 0;
+    }
+    open_file* of = file_of(fi);
+    if (!of || !pages_mapped()) {
+        char* mem = malloc(size);
+        if (!mem) {
+            return -ENOMEM;
+        }
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = mem;
+        ssize_t got = fuse_buf_copy(&dst, buf, 0);
+        int rv = (got < 0) ? got : nufs_write(path, mem, got, offset, fi);
+        free(mem);
+        return rv;
+    }
+
+    uint64_t t0 = op_begin();
+    int max = size / 4096 + 2;
+    file_run* runs = malloc(max * sizeof(file_run));
+    struct fuse_bufvec* dst = malloc(sizeof(struct fuse_bufvec) + max * sizeof(struct fuse_buf));
+    int rv = (runs && dst) ? storage_write_begin(of, size, offset, runs, max) : -ENOMEM;
+    if (rv >= 0) {
+        *dst = FUSE_BUFVEC_INIT(0);
+        for (int ii = 0; ii < rv; ++ii) {
+            dst->buf[ii].size = runs[ii].len;
+            dst->buf[ii].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            dst->buf[ii].mem = 0;
+            dst->buf[ii].fd = pages_get_fd();
+            dst->buf[ii].pos = runs[ii].pos;
+        }
+        dst->count = rv ? rv : 1;
+        ssize_t nn = fuse_buf_copy(dst, buf, 0);
+        rv = storage_write_end(of, size, offset, nn);
+    }
+    free(runs);
+    free(dst);
+
+    op_end(TOP_WRITE, of->inum, offset, size, t0, rv);
+    record_op(TOP_WRITE, path, 0, offset, size, 0, (uintptr_t) of, t0, rv);
+    log_debug("write_buf(%s, %ld bytes, @+%ld) -> %d\n", path, size, offset, rv);
+    return rv;
+}
+
+// Durability costs what the file changed: only its dirty pages, its
+// mapping and the allocation metadata are written (see storage.c).
+// datasync makes no difference, since the inode is what finds the data.
+int
+nufs_fsync(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    if (is_stats(path)) {
+        return 0;
+    }
+    uint64_t t0 = op_begin();
+    open_file* of = file_of(fi);
+    int rv = of ? storage_fsync_fh(of) : storage_fsync(path);
+    op_end(TOP_FSYNC, of ? of->inum : -1, 0, datasync, t0, rv);
+    record_op(TOP_FSYNC, path, 0, 0, 0, datasync, (uintptr_t) of, t0, rv);
+    log_debug("fsync(%s, %d) -> %d\n", path, datasync, rv);
+    return rv;
+}
+
+// directories have no handles of their own, so this goes by path
+int
+nufs_fsyncdir(const char* path, int datasync, struct fuse_file_info* fi)
+{
+    uint64_t t0 = op_begin();
+    int rv = storage_fsync(path);
+    op_end(TOP_FSYNC, -1, 0, datasync, t0, rv);
+    record_op(TOP_FSYNC, path, 0, 0, 0, datasync, 0, t0, rv);
+    log_debug("fsyncdir(%s, %d) -> %d\n", path, datasync, rv);
+    return rv;
+}
+
+// every close(2) of a handle, before release
+int
+nufs_flush(const char* path, struct fuse_file_info* fi)
+{
+    if (is_stats(path)) {
+        return 0;
+    }
+    uint64_t t0 = op_begin();
+    open_file* of = file_of(fi);
+    int rv = of ? storage_flush(of) : 0;
+    op_end(TOP_FLUSH, of ? of->inum : -1, 0, 0, t0, rv);
+    record_op(TOP_FLUSH, path, 0, 0, 0, 0, (uintptr_t) of, t0, rv);
+    log_debug("flush(%s) -> %d\n", path, rv);
     return rv;
 }
 
@@ -167,8 +518,11 @@ nufs_write(const char *path, const char *buf, size_t size, off_t offset, struct
 int
 nufs_utimens(const char* path, const struct timespec ts[2])
 {
+    uint64_t t0 = op_begin();
     int rv = storage_set_time(path, ts);
-    printf("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
+    op_end(TOP_UTIMENS, -1, 0, 0, t0, rv);
+    record_op(TOP_UTIMENS, path, 0, 0, 0, 0, 0, t0, rv);
+    log_debug("utimens(%s, [%ld, %ld; %ld %ld]) -> %d\n",
            path, ts[0].tv_sec, ts[0].tv_nsec, ts[1].tv_sec, ts[1].tv_nsec, rv);
 	return rv;
 }
@@ -178,11 +532,47 @@ int
 nufs_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi,
            unsigned int flags, void* data)
 {
-    int rv = -1;
-    printf("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
+    uint64_t t0 = op_begin();
+    int rv = -ENOTTY;
+    if ((unsigned int) cmd == NUFS_IOC_STATS) {
+        stats_snapshot_take((stats_snapshot*) data);
+        rv = 0;
+    }
+    else if ((unsigned int) cmd == NUFS_IOC_SYNC) {
+        rv = storage_sync();
+    }
+    op_end(TOP_IOCTL, -1, 0, cmd, t0, rv);
+    log_debug("ioctl(%s, %d, ...) -> %d\n", path, cmd, rv);
     return rv;
 }
 
+// asks for splice both ways where the kernel can do it, which is what
+// lets read_buf and write_buf skip the copies, and for writes as big
+// as libfuse's buffers take (libfuse trims max_write to fit them)
+void*
+nufs_init(struct fuse_conn_info *conn)
+{
+    conn->want |= FUSE_CAP_BIG_WRITES;
+    conn->max_write = NUFS_MAX_WRITE;
+#ifdef FUSE_CAP_SPLICE_WRITE
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_READ);
+#endif
+    log_debug("init(capable %#x, want %#x, max_write %u)\n",
+              conn->capable, conn->want, conn->max_write);
+    return 0;
+}
+
+// unmount: return per-thread caches to the bitmaps before the image
+// is unmapped
+void
+nufs_destroy(void* private_data)
+{
+    trace_dump();
+    record_close();
+    storage_free();
+    log_debug("destroy()\n");
+}
+
 void
 nufs_init_ops(struct fuse_operations* ops)
 {
@@ -198,20 +588,92 @@ nufs_init_ops(struct fuse_operations* ops)
     ops->rename   = nufs_rename;
     ops->chmod    = nufs_chmod;
     ops->truncate = nufs_truncate;
+    ops->ftruncate = nufs_ftruncate;
     ops->open	  = nufs_open;
+    ops->create   = nufs_create;
+    ops->release  = nufs_release;
     ops->read     = nufs_read;
+    ops->read_buf = nufs_read_buf;
     ops->write    = nufs_write;
+    ops->write_buf = nufs_write_buf;
+    ops->fsync    = nufs_fsync;
+    ops->fsyncdir = nufs_fsyncdir;
+    ops->flush    = nufs_flush;
     ops->utimens  = nufs_utimens;
     ops->ioctl    = nufs_ioctl;
+    ops->init     = nufs_init;
+    ops->destroy  = nufs_destroy;
 };
 
 struct fuse_operations nufs_ops;
 
+// removes the first argument starting with prefix, which is ours rather
+// than fuse's, and returns what follows the prefix
+static const char*
+take_option(int* argc, char* argv[], const char* prefix)
+{
+    size_t len = strlen(prefix);
+    for (int ii = 1; ii < *argc; ++ii) {
+        if (strncmp(argv[ii], prefix, len) == 0) {
+            const char* value = argv[ii] + len;
+            memmove(&(argv[ii]), &(argv[ii + 1]), (*argc - ii) * sizeof(char*));
+            *argc -= 1;
+            return value;
+        }
+    }
+    return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
+    const char* level = take_option(&argc, argv, "--log=");
+    if (level) {
+        log_level = log_parse_level(level);
+        if (log_level < 0) {
+            fprintf(stderr, "nufsmount: unknown log level '%s'\n", level);
+            return 1;
+        }
+    }
+    const char* trace_file = take_option(&argc, argv, "--trace=");
+    if (trace_file) {
+        trace_init(trace_file);
+    }
+    const char* record_file = take_option(&argc, argv, "--record=");
+    if (record_file && record_init(record_file) < 0) {
+        fprintf(stderr, "nufsmount: can't record to '%s'\n", record_file);
+        return 1;
+    }
+
+    if (take_option(&argc, argv, "--populate")) {
+        pages_populate = 1;
+    }
+    const char* backend = take_option(&argc, argv, "--backend=");
+    if (backend) {
+        pages_backend = pages_parse_backend(backend);
+        if (pages_backend < 0) {
+            fprintf(stderr, "nufsmount: unknown backend '%s'\n", backend);
+            return 1;
+        }
+    }
+    const char* cache = take_option(&argc, argv, "--cache=");
+    if (cache) {
+        pages_cache_bytes = parse_size(cache);
+        if (pages_cache_bytes <= 0) {
+            fprintf(stderr, "nufsmount: bad cache size '%s'\n", cache);
+            return 1;
+        }
+    }
+
     assert(argc > 2 && argc < 6);
-    storage_init(argv[--argc], 1);
+    const char* image = argv[--argc];
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    storage_init(image, 1);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_info("nufs: %s: %d pages, %d inodes, %s backend, opened in %.0f us\n", image,
+             get_super()->page_count, get_super()->inode_count, pages_backend_name(),
+             (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
     nufs_init_ops(&nufs_ops);
     return fuse_main(argc, argv, &nufs_ops, NULL);
 }
@@ -8,6 +8,11 @@
 #include "storage.h"
 #include "slist.h"
 #include "util.h"
+#include "pages.h"
+#include "trace.h"
+#include "bench.h"
+#include "age.h"
+#include "replay.h"
 
 slist*
 image_ls_tree(const char* base)
@@ -26,6 +31,12 @@ void
 print_usage(const char* name)
 {
     fprintf(stderr, "Usage: %s cmd ...\n", name);
+    fprintf(stderr, "  %s new image [size[K|M|G] [inodes [extent|indirect]]]\n", name);
+    fprintf(stderr, "  %s ls image\n", name);
+    fprintf(stderr, "  %s trace file\n", name);
+    fprintf(stderr, "  %s bench image [workload...] [key=value...]\n", name);
+    fprintf(stderr, "  %s age image [key=value...]\n", name);
+    fprintf(stderr, "  %s replay image log [key=value...]\n", name);
     exit(1);
 }
 
@@ -40,13 +51,47 @@ main(int argc, char* argv[])
     const char* img = argv[2];
 
     if (streq(cmd, "new")) {
-        assert(argc == 3);
+        if (argc > 6) {
+            print_usage(argv[0]);
+        }
 
-        storage_init(img, 1);
+        int64_t nbytes = (argc > 3) ? parse_size(argv[3]) : NUFS_DEFAULT_SIZE;
+        int inodes = (argc > 4) ? atoi(argv[4]) : 0;
+        int flags = 0;
+        if (argc > 5 && streq(argv[5], "indirect")) {
+            flags |= NUFS_BLOCKMAP;
+        }
+        else if (argc > 5 && !streq(argv[5], "extent")) {
+            print_usage(argv[0]);
+        }
+        if (nbytes < NUFS_PAGE_SIZE) {
+            print_usage(argv[0]);
+        }
+
+        if (storage_new(img, nbytes, inodes, flags) < 0) {
+            return 1;
+        }
+        storage_free();
         printf("Created disk image: %s\n", img);
         return 0;
     }
 
+    if (streq(cmd, "trace")) {
+        return (trace_print(argv[2]) < 0) ? 1 : 0;
+    }
+
+    if (streq(cmd, "bench")) {
+        return bench_main(img, argc - 3, argv + 3);
+    }
+
+    if (streq(cmd, "age")) {
+        return age_main(img, argc - 3, argv + 3);
+    }
+
+    if (streq(cmd, "replay")) {
+        return replay_main(img, argc - 3, argv + 3);
+    }
+
     if (access(img, R_OK) == -1) {
         fprintf(stderr, "No such image: %s\n", img);
         return 1;
@@ -60,6 +105,7 @@ main(int argc, char* argv[])
             printf("%s\n", it->data);
         }
         s_free(xs);
+        storage_free();
         return 0;
     }
 
@@ -12,92 +12,672 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "pages.h"
 #include "util.h"
 #include "bitmap.h"
 #include "inode.h"
+#include "lock.h"
+#include "magazine.h"
+#include "log.h"
+#include "stats.h"
+#include "cache.h"
 
-const int PAGE_COUNT = 256;
-const int NUFS_SIZE  = 4096 * 256; // 1MB
+// free runs alloc_pages looks at before settling for the longest seen
+#define ALLOC_PROBES 64
 
-static int   pages_fd   = -1;
-static void* pages_base =  0;
+int pages_populate = 0;
+int pages_backend = PAGES_MMAP;
+int64_t pages_cache_bytes = PAGES_CACHE_DEFAULT;
 
-void
-pages_init(const char* path, int create)
+static const char* backend_names[] = { "mmap", "pread", "uring" };
+
+static int    pages_fd   = -1;
+static void*  pages_base =  0;
+static size_t pages_size =  0;
+static int    pages_flat =  0; // pages below this are in the mapping
+static int    pages_total = 0;
+static uint64_t* dirty_bits = 0; // see pages_dirty
+
+static int
+div_up(int64_t xx, int64_t yy)
 {
-   if (create) {
-        pages_fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
-        assert(pages_fd != -1);
+    return (int)((xx + yy - 1) / yy);
+}
 
-        int rv = ftruncate(pages_fd, NUFS_SIZE);
-        assert(rv == 0);
+// maps the image, all of it for mmap; the cache backends map only the
+// first meta_pages (superblock, bitmaps, inode table) and go through
+// the cache for the rest
+static void
+pages_map(int64_t nbytes, int meta_pages)
+{
+    int page_count = nbytes / NUFS_PAGE_SIZE;
+    pages_flat = (pages_backend == PAGES_MMAP) ? page_count : meta_pages;
+    pages_size = (size_t) pages_flat * NUFS_PAGE_SIZE;
+    pages_base = mmap(0, pages_size, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
+    assert(pages_base != MAP_FAILED);
+    pages_total = page_count;
+    dirty_bits = calloc(page_count / 64 + 1, sizeof(uint64_t));
+    assert(dirty_bits);
+    if (pages_backend != PAGES_MMAP) {
+        cache_open(pages_fd, pages_backend == PAGES_URING, pages_cache_bytes, page_count);
     }
-    else {
-        pages_fd = open(path, O_RDWR);
-        assert(pages_fd != -1);
+}
+
+int
+pages_parse_backend(const char* name)
+{
+    for (int ii = 0; ii < (int)(sizeof(backend_names) / sizeof(backend_names[0])); ++ii) {
+        if (streq(name, backend_names[ii])) {
+            return ii;
+        }
+    }
+    return -1;
+}
+
+const char*
+pages_backend_name()
+{
+    // uring quietly becomes pread on kernels without it
+    if (pages_backend == PAGES_URING && pages_fd >= 0 && !cache_uring()) {
+        return backend_names[PAGES_PREAD];
     }
+    return backend_names[pages_backend];
+}
+
+// lay out a fresh image: superblock, page bitmap, inode bitmap,
+// inode table, then data pages; the root directory is inode 0
+int
+pages_format(const char* path, int64_t nbytes, int inodes, int flags)
+{
+    int page_count = nbytes / NUFS_PAGE_SIZE;
+    if (inodes <= 0) {
+        inodes = nbytes / NUFS_BYTES_PER_INODE;
+    }
+    int bits_per_page = NUFS_PAGE_SIZE * 8;
+    int ipp = NUFS_PAGE_SIZE / sizeof(inode);
 
-    pages_base = mmap(0, NUFS_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, pages_fd, 0);
-    assert(pages_base != MAP_FAILED); 
+    superblock sb;
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = NUFS_MAGIC;
+    sb.version = NUFS_VERSION;
+    sb.page_size = NUFS_PAGE_SIZE;
+    sb.page_count = page_count;
+    sb.inode_count = inodes;
+    sb.pbitmap_start = 1;
+    sb.pbitmap_pages = div_up(page_count, bits_per_page);
+    sb.ibitmap_start = sb.pbitmap_start + sb.pbitmap_pages;
+    sb.ibitmap_pages = div_up(inodes, bits_per_page);
+    sb.itable_start = sb.ibitmap_start + sb.ibitmap_pages;
+    sb.itable_pages = div_up(inodes, ipp);
+    sb.data_start = sb.itable_start + sb.itable_pages;
+    sb.root_inum = 0;
+    sb.flags = flags;
+
+    if (sb.data_start >= page_count) {
+        log_error("nufs: %ld bytes is too small for %d inodes\n",
+                (long) nbytes, inodes);
+        return -EINVAL;
+    }
+
+    // never format over something that's already there
+    pages_fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (pages_fd == -1) {
+        int err = errno;
+        log_error("nufs: can't create %s: %s\n", path, strerror(err));
+        return -err;
+    }
+
+    if (ftruncate(pages_fd, (off_t) page_count * NUFS_PAGE_SIZE) != 0) {
+        int err = errno;
+        log_error("nufs: can't size %s: %s\n", path, strerror(err));
+        close(pages_fd);
+        unlink(path);
+        pages_fd = -1;
+        return -err;
+    }
+
+    pages_map((int64_t) page_count * NUFS_PAGE_SIZE, sb.data_start);
+    memcpy(get_super(), &sb, sizeof(sb));
 
-    
-    if(create){
     void* pbm = get_pbitmap();
-    bitmap_put(pbm, 0, 1);
-    bitmap_put(pbm, 1, 1);
+    for (int ii = 0; ii < sb.data_start; ++ii) {
+        bitmap_put(pbm, ii, 1);
+    }
 
     void* ibm = get_ibitmap();
-    bitmap_put(ibm, 0, 1);
-    inode* root_node = get_inode(0);
-    root_node->ptrs[0] = 1;
+    bitmap_put(ibm, sb.root_inum, 1);
+    inode* root_node = get_inode(sb.root_inum);
+    root_node->refs = 1;
+    root_node->flags = (flags & NUFS_BLOCKMAP) ? INODE_BLOCKMAP : 0;
     root_node->mode = 040755;
     root_node->size = 0;
+    pages_dirty_range(0, sb.data_start);
+    return 0;
+}
+
+// geometry checks only: the superblock's layout has to be consistent
+// and fit the file, and the bitmaps have to cover what they describe;
+// nothing is scanned, so this costs the same for any size of image
+static const char*
+pages_check(superblock* sb, int64_t file_bytes)
+{
+    int bits_per_page = NUFS_PAGE_SIZE * 8;
+    int ipp = NUFS_PAGE_SIZE / sizeof(inode);
+
+    if (sb->magic != NUFS_MAGIC || sb->version != NUFS_VERSION) {
+        return "bad magic or version";
+    }
+    if (sb->page_size != NUFS_PAGE_SIZE || sb->page_count <= 0
+        || (int64_t) sb->page_count * NUFS_PAGE_SIZE > file_bytes) {
+        return "page count doesn't fit the file";
     }
+    if (sb->pbitmap_start != 1
+        || sb->ibitmap_start != sb->pbitmap_start + sb->pbitmap_pages
+        || sb->itable_start != sb->ibitmap_start + sb->ibitmap_pages
+        || sb->data_start != sb->itable_start + sb->itable_pages
+        || sb->data_start >= sb->page_count) {
+        return "regions out of order";
+    }
+    if ((int64_t) sb->pbitmap_pages * bits_per_page < sb->page_count
+        || (int64_t) sb->ibitmap_pages * bits_per_page < sb->inode_count
+        || (int64_t) sb->itable_pages * ipp < sb->inode_count) {
+        return "bitmaps or inode table too small";
+    }
+    if (sb->root_inum < 0 || sb->root_inum >= sb->inode_count
+        || !bitmap_get(get_ibitmap(), sb->root_inum)
+        || (get_inode(sb->root_inum)->mode & 0170000) != 040000) {
+        return "no root directory";
+    }
+    // the metadata itself must never look allocatable
+    if (bitmap_next_zero(get_pbitmap(), 0, sb->data_start) >= 0) {
+        return "metadata pages free in the page bitmap";
+    }
+    return 0;
+}
 
+int
+pages_init(const char* path, int create)
+{
+    pages_fd = open(path, O_RDWR);
+    if (pages_fd == -1 && errno == ENOENT && create) {
+        if (pages_format(path, NUFS_DEFAULT_SIZE, 0, 0) < 0) {
+            exit(1);
+        }
+        return 1;
+    }
+    if (pages_fd == -1) {
+        log_error("nufs: can't open %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+
+    struct stat st;
+    int rv = fstat(pages_fd, &st);
+    assert(rv == 0);
+    if (st.st_size < NUFS_PAGE_SIZE) {
+        log_error("nufs: %s is not a valid image: too small\n", path);
+        exit(1);
+    }
+
+    // the cache backends only map the metadata, so find out how much
+    // of it there is first; pages_check has the final word on the rest
+    superblock head;
+    if (pread(pages_fd, &head, sizeof(head), 0) != sizeof(head)) {
+        log_error("nufs: can't read %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    int64_t file_pages = st.st_size / NUFS_PAGE_SIZE;
+    int meta = (head.data_start > 0 && head.data_start <= file_pages) ? head.data_start : 1;
+    pages_map(st.st_size, meta);
+
+    superblock* sb = get_super();
+    const char* why = pages_check(sb, st.st_size);
+    if (why) {
+        log_error("nufs: %s is not a valid image: %s\n", path, why);
+        exit(1);
+    }
+
+    // only the metadata is wanted soon; data pages fault in as files
+    // are touched
+    size_t meta_bytes = (size_t) sb->data_start * NUFS_PAGE_SIZE;
+    if (pages_populate) {
+        void* again = mmap(pages_base, meta_bytes, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_FIXED | MAP_POPULATE, pages_fd, 0);
+        assert(again == pages_base);
+    }
+    else {
+        madvise(pages_base, meta_bytes, MADV_WILLNEED);
+    }
+
+    // hints from the last mount may point anywhere; allocation only
+    // needs them in range
+    if (sb->page_hint < sb->data_start || sb->page_hint >= sb->page_count) {
+        sb->page_hint = sb->data_start;
+    }
+    if (sb->inode_hint < 0 || sb->inode_hint >= sb->inode_count) {
+        sb->inode_hint = 0;
+    }
+    return 0;
 }
 
 void
 pages_free()
 {
-    int rv = munmap(pages_base, NUFS_SIZE);
+    // unmount is a global sync, whatever the backend: every marked
+    // page, then anything the cache still holds marked (a failed
+    // write-back gets another go) before the cache goes away
+    pages_flush();
+    if (pages_backend != PAGES_MMAP) {
+        cache_flush();
+    }
+    fdatasync(pages_fd);
+    if (pages_backend != PAGES_MMAP) {
+        cache_close();
+    }
+    int rv = munmap(pages_base, pages_size);
     assert(rv == 0);
+    close(pages_fd);
+    pages_fd = -1;
+    free(dirty_bits);
+    dirty_bits = 0;
 }
 
 void*
 pages_get_page(int pnum)
 {
-    return pages_base + 4096 * pnum;
+    if (pnum < pages_flat) {
+        return pages_base + (size_t) NUFS_PAGE_SIZE * pnum;
+    }
+    return cache_get(pnum, 0);
+}
+
+void*
+pages_zero_page(int pnum)
+{
+    if (pnum < pages_flat) {
+        void* page = pages_base + (size_t) NUFS_PAGE_SIZE * pnum;
+        memset(page, 0, NUFS_PAGE_SIZE);
+        return page;
+    }
+    return cache_get(pnum, 1);
+}
+
+void
+pages_put_page(int pnum)
+{
+    if (pnum >= pages_flat) {
+        cache_put(pnum);
+    }
+}
+
+void
+pages_put_all()
+{
+    if (pages_backend != PAGES_MMAP) {
+        cache_put_all();
+    }
+}
+
+int
+pages_mapped()
+{
+    return pages_backend == PAGES_MMAP;
+}
+
+void
+pages_dirty(int pnum)
+{
+    uint64_t* word = dirty_bits + pnum / 64;
+    uint64_t bit = 1ull << (pnum % 64);
+    // most marks land on a page that's already marked; don't keep
+    // pulling the line in exclusive for those
+    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit)) {
+        __atomic_fetch_or(word, bit, __ATOMIC_RELEASE);
+    }
+    // the bit says the disk is behind; the cache has to know too that
+    // its copy is, however it got there
+    if (pnum >= pages_flat) {
+        cache_dirty(pnum);
+    }
+}
+
+void
+pages_dirty_range(int pnum, int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        pages_dirty(pnum + ii);
+    }
+}
+
+void
+pages_dirty_ptr(const void* addr, size_t len)
+{
+    size_t off = (const uint8_t*) addr - (const uint8_t*) pages_base;
+    if ((const uint8_t*) addr < (const uint8_t*) pages_base || off >= pages_size || len == 0) {
+        return;
+    }
+    int first = off / NUFS_PAGE_SIZE;
+    int last = (off + len - 1) / NUFS_PAGE_SIZE;
+    pages_dirty_range(first, last - first + 1);
+}
+
+void
+pages_add_range(page_ranges* rr, int start, int count)
+{
+    if (count <= 0) {
+        return;
+    }
+    if (rr->count > 0) {
+        page_range* last = &(rr->ents[rr->count - 1]);
+        if (last->start + last->count == start) {
+            last->count += count;
+            return;
+        }
+    }
+    if (rr->count == rr->cap) {
+        rr->cap = rr->cap ? rr->cap * 2 : 16;
+        rr->ents = realloc(rr->ents, rr->cap * sizeof(page_range));
+        assert(rr->ents);
+    }
+    rr->ents[rr->count++] = (page_range) { start, count };
+}
+
+void
+pages_take_dirty(page_ranges* rr, int start, int count)
+{
+    int end = start + count;
+    if (start < 0 || end > pages_total) {
+        return;
+    }
+    int run = -1;
+    for (int ww = start / 64; ww * 64 < end; ++ww) {
+        int lo = (ww * 64 > start) ? ww * 64 : start;
+        int hi = (ww * 64 + 64 < end) ? ww * 64 + 64 : end;
+        uint64_t mask = ((hi - lo == 64) ? ~0ull : ((1ull << (hi - lo)) - 1)) << (lo % 64);
+        uint64_t bits = __atomic_load_n(dirty_bits + ww, __ATOMIC_RELAXED) & mask;
+        if (bits) {
+            bits = __atomic_fetch_and(dirty_bits + ww, ~mask, __ATOMIC_ACQ_REL) & mask;
+        }
+        for (int ii = lo; ii < hi; ++ii) {
+            int set = (bits >> (ii % 64)) & 1;
+            if (set && run < 0) {
+                run = ii;
+            }
+            else if (!set && run >= 0) {
+                pages_add_range(rr, run, ii - run);
+                run = -1;
+            }
+        }
+    }
+    if (run >= 0) {
+        pages_add_range(rr, run, end - run);
+    }
+}
+
+static int
+cmp_range(const void* aa, const void* bb)
+{
+    int xx = ((const page_range*) aa)->start;
+    int yy = ((const page_range*) bb)->start;
+    return (xx > yy) - (xx < yy);
+}
+
+int
+pages_sync_ranges(page_ranges* rr, int durable)
+{
+    // fsync collects data runs in file order, then metadata; put them
+    // in disk order and join what touches
+    qsort(rr->ents, rr->count, sizeof(page_range), cmp_range);
+    int kept = 0;
+    for (int ii = 0; ii < rr->count; ++ii) {
+        page_range* last = kept ? &(rr->ents[kept - 1]) : 0;
+        page_range* cur = &(rr->ents[ii]);
+        if (last && cur->start <= last->start + last->count) {
+            int end = cur->start + cur->count;
+            if (end > last->start + last->count) {
+                last->count = end - last->start;
+            }
+        }
+        else {
+            rr->ents[kept++] = *cur;
+        }
+    }
+    rr->count = kept;
+
+    int rv = 0;
+    int cached = 0;
+    for (int ii = 0; ii < rr->count; ++ii) {
+        int start = rr->ents[ii].start;
+        int end = start + rr->ents[ii].count;
+        int mid = (end < pages_flat) ? end : pages_flat;
+        if (durable && start < mid) {
+            void* at = (uint8_t*) pages_base + (size_t) start * NUFS_PAGE_SIZE;
+            if (msync(at, (size_t)(mid - start) * NUFS_PAGE_SIZE, MS_SYNC) != 0 && rv == 0) {
+                rv = -errno;
+            }
+        }
+        if (end > pages_flat) {
+            int lo = (start > pages_flat) ? start : pages_flat;
+            int err = cache_writeback(lo, end - lo);
+            if (err < 0 && rv == 0) {
+                rv = err;
+            }
+            cached = 1;
+        }
+        stats_add(STAT_PAGES_SYNCED, end - start);
+    }
+    stats_add(STAT_SYNC_RANGES, rr->count);
+    if (durable && cached && fdatasync(pages_fd) != 0 && rv == 0) {
+        rv = -errno;
+    }
+    return rv;
+}
+
+void
+pages_ranges_free(page_ranges* rr)
+{
+    free(rr->ents);
+    rr->ents = 0;
+    rr->count = 0;
+    rr->cap = 0;
+}
+
+int
+pages_flush()
+{
+    page_ranges rr = {0};
+    pages_take_dirty(&rr, 0, pages_total);
+    int rv = pages_sync_ranges(&rr, 1);
+    pages_ranges_free(&rr);
+    return rv;
+}
+
+int
+pages_get_fd()
+{
+    return pages_fd;
+}
+
+superblock*
+get_super()
+{
+    return (superblock*) pages_base;
 }
 
 void*
 get_pbitmap()
 {
-    return pages_get_page(0);
+    return pages_get_page(get_super()->pbitmap_start);
 }
 
 int
 alloc_page()
 {
-    void* pbm = get_pbitmap();
+    superblock* sb = get_super();
+    thread_cache* tc = thread_cache_get();
 
-    for (int ii = 2; ii < PAGE_COUNT; ++ii) {
-        if (!bitmap_get(pbm, ii)) {
-            bitmap_put(pbm, ii, 1);
-            printf("+ alloc_page() -> %d\n", ii);
-            return ii;
+    if (tc->pages.count == 0) {
+        alloc_lock();
+        mag_refill(&(tc->pages), get_pbitmap(), sb->data_start, &(tc->page_goal), sb->page_count);
+        alloc_unlock();
+        if (tc->pages.count == 0) {
+            return -1;
         }
     }
 
-    return -1;
+    int ii = tc->pages.nums[--tc->pages.count];
+    stats_add(STAT_PAGES_ALLOCED, 1);
+    log_trace("+ alloc_page() -> %d\n", ii);
+    return ii;
+}
+
+// the longest free run of up to count pages among the first
+// ALLOC_PROBES found from goal on, wrapping around once; -1 if none
+static int
+find_run(void* pbm, int count, int goal, int* len)
+{
+    superblock* sb = get_super();
+    int best = -1;
+    int best_len = 0;
+    int lo = goal;
+    int hi = sb->page_count;
+    for (int probes = 0; probes < ALLOC_PROBES && best_len < count; ++probes) {
+        int ii = bitmap_next_zero(pbm, lo, hi);
+        if (ii < 0) {
+            if (hi == goal || goal == sb->data_start) {
+                break;
+            }
+            // wrap around once and search below the goal
+            lo = sb->data_start;
+            hi = goal;
+            continue;
+        }
+
+        int limit = (hi - ii < count) ? hi : ii + count;
+        int jj = bitmap_next_one(pbm, ii, limit);
+        int len = ((jj < 0) ? limit : jj) - ii;
+        if (len > best_len) {
+            best = ii;
+            best_len = len;
+        }
+        lo = ii + len;
+    }
+
+    *len = best_len;
+    return best;
+}
+
+// Allocates up to count contiguous pages, preferring a run that starts
+// at or after goal, or in the calling thread's region if goal is -1.
+// Returns the first page and sets *got to the run length, which is
+// count unless no free run that long turned up near goal; returns -1
+// when the image is full.
+int
+alloc_pages(int count, int goal, int* got)
+{
+    superblock* sb = get_super();
+    thread_cache* tc = thread_cache_get();
+    int anywhere = (goal < sb->data_start || goal >= sb->page_count);
+
+    // carrying on from the last run: the reservation after it serves
+    // this without the lock, if it's long enough; otherwise the search
+    // below may well find a longer run than the reservation
+    if (count <= tc->run_len && (anywhere || goal == tc->run_start)) {
+        int first = tc->run_start;
+        int len = count;
+        tc->run_start += len;
+        tc->run_len -= len;
+        tc->page_goal = tc->run_start;
+        stats_add(STAT_PAGES_ALLOCED, len);
+        log_trace("+ alloc_pages(%d, %d) -> %d+%d reserved\n", count, goal, first, len);
+
+        *got = len;
+        return first;
+    }
+
+    void* pbm = get_pbitmap();
+    alloc_lock();
+    // a reservation somewhere else is no use to this run
+    run_drain(tc, pbm);
+    if (anywhere) {
+        goal = tc->page_goal;
+    }
+    if (goal < sb->data_start || goal >= sb->page_count) {
+        goal = sb->data_start;
+    }
+
+    int best_len;
+    int best = find_run(pbm, count, goal, &best_len);
+    if (best < 0 && tc->pages.count > 0) {
+        // nearly full: put back what this thread has cached and retry
+        mag_drain(&(tc->pages), pbm, 0);
+        best = find_run(pbm, count, goal, &best_len);
+    }
+    if (best < 0) {
+        alloc_unlock();
+        return -1;
+    }
+
+    for (int ii = 0; ii < best_len; ++ii) {
+        bitmap_put(pbm, best + ii, 1);
+    }
+
+    // reserve whatever is free right after it for the next call
+    int end = best + best_len;
+    int limit = min(end + MAG_RUN, sb->page_count);
+    int stop = (best_len < count) ? end : bitmap_next_one(pbm, end, limit);
+    if (stop < 0) {
+        stop = limit;
+    }
+    for (int ii = end; ii < stop; ++ii) {
+        bitmap_put(pbm, ii, 1);
+    }
+    tc->run_start = end;
+    tc->run_len = stop - end;
+
+    sb->page_hint = end;
+    pages_dirty_ptr(&(sb->page_hint), sizeof(int));
+    tc->page_goal = end;
+    alloc_unlock();
+    stats_add(STAT_PAGES_ALLOCED, best_len);
+    log_trace("+ alloc_pages(%d, %d) -> %d+%d\n", count, goal, best, best_len);
+
+    *got = best_len;
+    return best;
 }
 
 void
 free_page(int pnum)
 {
-    printf("+ free_page(%d)\n", pnum);
+    log_trace("+ free_page(%d)\n", pnum);
+    assert(pnum >= get_super()->data_start);
+    stats_add(STAT_PAGES_FREED, 1);
+
+    thread_cache* tc = thread_cache_get();
+    tc->pages.nums[tc->pages.count++] = pnum;
+    if (tc->pages.count == MAG_SIZE) {
+        alloc_lock();
+        mag_drain(&(tc->pages), get_pbitmap(), MAG_SIZE - MAG_BATCH);
+        alloc_unlock();
+    }
+}
+
+// file data pages go straight back to the bitmap, a run at a time, so
+// alloc_pages can find them; only alloc_page's single pages are worth
+// keeping in the magazine
+void
+free_pages(int pnum, int count)
+{
+    log_trace("+ free_pages(%d, %d)\n", pnum, count);
+    assert(pnum >= get_super()->data_start);
+    stats_add(STAT_PAGES_FREED, count);
+
     void* pbm = get_pbitmap();
-    bitmap_put(pbm, pnum, 0);
+    alloc_lock();
+    for (int ii = 0; ii < count; ++ii) {
+        bitmap_put(pbm, pnum + ii, 0);
+    }
+    alloc_unlock();
 }
 
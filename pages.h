@@ -4,12 +4,129 @@
 #define PAGES_H
 
 #include <stdio.h>
+#include <stdint.h>
 
-void pages_init(const char* path, int create);
+#define NUFS_MAGIC     0x5346554e // "NUFS"
+#define NUFS_VERSION   1
+#define NUFS_PAGE_SIZE 4096
+
+// default geometry for "nufstool new" without a size: 1MB, one inode per 4k
+#define NUFS_DEFAULT_SIZE   (1024 * 1024)
+#define NUFS_BYTES_PER_INODE 4096
+
+// superblock flags
+#define NUFS_BLOCKMAP 1 // new inodes use indirect block pointers, not extents
+
+// page 0 of every image; describes where everything else lives
+typedef struct superblock {
+    uint32_t magic;
+    uint32_t version;
+    int page_size;     // bytes per page
+    int page_count;    // total pages in the image
+    int inode_count;   // slots in the inode table
+    int pbitmap_start; // first page of the page bitmap
+    int pbitmap_pages;
+    int ibitmap_start; // first page of the inode bitmap
+    int ibitmap_pages;
+    int itable_start;  // first page of the inode table
+    int itable_pages;
+    int data_start;    // first page alloc_page may hand out
+    int root_inum;
+    int flags;
+    int page_hint;  // next-fit start for alloc_page
+    int inode_hint; // next-fit start for alloc_inode
+} superblock;
+
+// when set, pages_init faults the metadata pages (superblock, bitmaps,
+// inode table) in up front rather than leaving them to readahead
+extern int pages_populate;
+
+// How pages reach the image, set before pages_init / pages_format.
+// PAGES_MMAP maps all of it. The other two map only the metadata, which
+// is small and always hot, and keep up to pages_cache_bytes of data,
+// directory and tree pages in a cache (see cache.h) that reads and
+// writes them with pread / pwrite or with batched io_uring requests.
+enum pages_backends {
+    PAGES_MMAP,
+    PAGES_PREAD,
+    PAGES_URING,
+};
+
+#define PAGES_CACHE_DEFAULT (64 << 20)
+
+extern int pages_backend;
+extern int64_t pages_cache_bytes;
+
+// "mmap", "pread" or "uring"; -1 if unknown
+int pages_parse_backend(const char* name);
+// the backend in use, for reports
+const char* pages_backend_name();
+
+// maps an existing image, or with create formats a default one if path
+// doesn't exist; returns 1 if it formatted
+int  pages_init(const char* path, int create);
+// creates and formats a new image; 0, or -errno (with a logged reason)
+// if path exists or the geometry doesn't fit
+int  pages_format(const char* path, int64_t nbytes, int inodes, int flags);
+// syncs every dirty page to disk (see pages_flush) and unmaps
 void pages_free();
+
+// A page's memory. Under a cache backend the page is pinned: the pointer
+// stays good until pages_put_page, or until the thread's next
+// pages_put_all, which storage_* calls as each op starts. Pins don't
+// stack; one put drops the page however many times it was got.
 void* pages_get_page(int pnum);
+// the same for a page the caller will fill from scratch: zeroed, and
+// never read from the image
+void* pages_zero_page(int pnum);
+void  pages_put_page(int pnum);
+void  pages_put_all();
+// 1 if every page is in one mapping, so runs of consecutive pages are
+// contiguous in memory and the image file is always current
+int   pages_mapped();
+
+// Dirty tracking: one bit per page, set by whatever changes the page
+// (after the change, before putting it) and taken by fsync and global
+// syncs, so those write back what changed rather than the whole image.
+// The cache backends write back only marked pages, so a change that
+// isn't marked may never reach the image. pages_dirty_ptr
+// is for memory that's always mapped: the superblock, the bitmaps and
+// inodes.
+void  pages_dirty(int pnum);
+void  pages_dirty_range(int pnum, int count);
+void  pages_dirty_ptr(const void* addr, size_t len);
+
+typedef struct page_range {
+    int start;
+    int count;
+} page_range;
+
+typedef struct page_ranges {
+    int count;
+    int cap;
+    page_range* ents;
+} page_ranges;
+
+// appends [start, start + count) to rr
+void  pages_add_range(page_ranges* rr, int start, int count);
+// appends the dirty runs in [start, start + count), clearing their bits
+void  pages_take_dirty(page_ranges* rr, int start, int count);
+// sorts and merges rr, then makes each range durable (durable = 1) with
+// a ranged msync, or a cache write-back and one fdatasync; with
+// durable = 0 cached pages are only handed to the kernel. 0 or -errno.
+int   pages_sync_ranges(page_ranges* rr, int durable);
+void  pages_ranges_free(page_ranges* rr);
+
+// every dirty page onto the disk, as few msyncs as adjacent runs allow;
+// 0 or -errno
+int   pages_flush();
+// the image file itself, for I/O that goes around the mapping
+int   pages_get_fd();
+superblock* get_super();
 void* get_pbitmap();
 int alloc_page();
+int alloc_pages(int count, int goal, int* got);
 void free_page(int pnum);
+void free_pages(int pnum, int count);
 
 #endif
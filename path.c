@@ -0,0 +1,64 @@
+
+#include <string.h>
+#include <errno.h>
+
+#include "path.h"
+#include "directory.h"
+
+void
+path_iter_init(path_iter* it, const char* path, int len)
+{
+    it->pos = path;
+    it->end = path + len;
+}
+
+int
+path_next(path_iter* it, const char** name, int* len)
+{
+    while (it->pos < it->end && *it->pos == '/') {
+        it->pos += 1;
+    }
+    if (it->pos >= it->end) {
+        return 0;
+    }
+
+    const char* start = it->pos;
+    while (it->pos < it->end && *it->pos != '/') {
+        it->pos += 1;
+    }
+    *name = start;
+    *len = it->pos - start;
+    return 1;
+}
+
+void
+path_split(const char* path, int* parent_len, const char** leaf, int* leaf_len)
+{
+    int nn = strlen(path);
+    while (nn > 1 && path[nn - 1] == '/') {
+        nn -= 1;
+    }
+
+    int slash = nn - 1;
+    while (slash >= 0 && path[slash] != '/') {
+        slash -= 1;
+    }
+
+    *leaf = path + slash + 1;
+    *leaf_len = nn - slash - 1;
+    *parent_len = (slash > 0) ? slash : 1;
+}
+
+int
+path_copy_name(char* buf, const char* name, int len)
+{
+    if (len <= 0) {
+        return -EINVAL;
+    }
+    if (len >= DIR_NAME) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(buf, name, len);
+    buf[len] = 0;
+    return 0;
+}
@@ -0,0 +1,21 @@
+#ifndef PATH_H
+#define PATH_H
+
+// Walks paths in place: components come back as (pointer, length)
+// views into the caller's string, so nothing is copied or allocated.
+
+typedef struct path_iter {
+    const char* pos;
+    const char* end;
+} path_iter;
+
+// iterate over the first len bytes of path
+void path_iter_init(path_iter* it, const char* path, int len);
+// next component, skipping repeated slashes; 0 when there are no more
+int  path_next(path_iter* it, const char** name, int* len);
+// "/a/b/c" -> parent "/a/b" as a prefix length of path, leaf "c"
+void path_split(const char* path, int* parent_len, const char** leaf, int* leaf_len);
+// copies a component into a DIR_NAME buffer as a C string
+int  path_copy_name(char* buf, const char* name, int len);
+
+#endif
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "record.h"
+#include "trace.h"
+
+#define RECORD_BUF (1 << 20)
+
+int record_on = 0;
+
+static int record_fd = -1;
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* record_buf;
+static size_t record_len;
+static uint64_t record_count;
+static int thread_count = 0;
+static __thread int my_thread = -1;
+
+static uint64_t base_ticks; // trace_clock() and monotonic ns at
+static int64_t  base_ns;    // record_init, to work out the tick rate
+
+static int64_t
+mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+write_all(int fd, const void* buf, size_t size)
+{
+    const char* data = buf;
+    while (size > 0) {
+        ssize_t nn = write(fd, data, size);
+        if (nn <= 0) {
+            return;
+        }
+        data += nn;
+        size -= nn;
+    }
+}
+
+static void
+write_header(uint64_t ticks_per_sec)
+{
+    record_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RECORD_MAGIC;
+    hdr.version = RECORD_VERSION;
+    hdr.rec_size = sizeof(record_rec);
+    hdr.ticks_per_sec = ticks_per_sec;
+    hdr.count = ticks_per_sec ? record_count : 0;
+    lseek(record_fd, 0, SEEK_SET);
+    write_all(record_fd, &hdr, sizeof(hdr));
+    lseek(record_fd, 0, SEEK_END);
+}
+
+int
+record_init(const char* path)
+{
+    // opened now, since fuse may chdir("/") when it daemonizes
+    record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    record_buf = malloc(RECORD_BUF);
+    if (record_fd < 0 || !record_buf) {
+        return -1;
+    }
+    write_header(0);
+    base_ticks = trace_clock();
+    base_ns = mono_ns();
+    record_on = 1;
+    return 0;
+}
+
+// appends one record; ops are rare next to the work they do, so one
+// lock and a shared buffer are enough, and they keep the log in order
+void
+record_op(int op, const char* path, const char* path2, int64_t offset,
+          uint32_t size, uint32_t mode, uint64_t handle,
+          uint64_t start, int result)
+{
+    if (!record_on) {
+        return;
+    }
+    uint64_t end = trace_clock();
+    if (my_thread < 0) {
+        my_thread = __atomic_fetch_add(&thread_count, 1, __ATOMIC_RELAXED);
+    }
+
+    record_rec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.start = start - base_ticks;
+    rec.ticks = end - start;
+    rec.offset = offset;
+    rec.handle = handle;
+    rec.size = size;
+    rec.mode = mode;
+    rec.result = result;
+    rec.op = op;
+    rec.thread = my_thread;
+    rec.path_len = path ? strnlen(path, UINT16_MAX) : 0;
+    rec.path2_len = path2 ? strnlen(path2, UINT16_MAX) : 0;
+    size_t need = sizeof(rec) + rec.path_len + rec.path2_len;
+
+    pthread_mutex_lock(&record_lock);
+    if (!record_on) {
+        pthread_mutex_unlock(&record_lock);
+        return;
+    }
+    if (record_len + need > RECORD_BUF) {
+        write_all(record_fd, record_buf, record_len);
+        record_len = 0;
+    }
+    char* at = record_buf + record_len;
+    memcpy(at, &rec, sizeof(rec));
+    if (rec.path_len) {
+        memcpy(at + sizeof(rec), path, rec.path_len);
+    }
+    if (rec.path2_len) {
+        memcpy(at + sizeof(rec) + rec.path_len, path2, rec.path2_len);
+    }
+    record_len += need;
+    record_count += 1;
+    pthread_mutex_unlock(&record_lock);
+}
+
+void
+record_close()
+{
+    if (!record_on) {
+        return;
+    }
+    pthread_mutex_lock(&record_lock);
+    record_on = 0;
+    write_all(record_fd, record_buf, record_len);
+    record_len = 0;
+    int64_t ns = mono_ns() - base_ns;
+    uint64_t tps = (ns > 0) ? (uint64_t)((double)(trace_clock() - base_ticks) * 1e9 / ns) : 0;
+    write_header(tps ? tps : 1);
+    close(record_fd);
+    record_fd = -1;
+    pthread_mutex_unlock(&record_lock);
+}
@@ -0,0 +1,51 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+// Workload capture. With "nufsmount --record=FILE" every FUSE call is
+// appended to FILE as it completes: op, paths, offset, size, mode and
+// result, but none of the data. "nufstool replay" runs the log against
+// storage_* again. Unlike the trace this keeps everything, not just the
+// newest TRACE_RING per thread, and the order is the order ops finished
+// in across all threads.
+
+#define RECORD_MAGIC   0x5045524e // "NREP"
+#define RECORD_VERSION 1
+
+// file layout: record_header, then record_recs, each followed by its
+// path_len bytes of path and path2_len bytes of path2 (no NULs)
+typedef struct record_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t pad;
+    uint64_t ticks_per_sec; // 0 if nufsmount didn't get to unmount
+    uint64_t count;         // records, or 0 likewise; read to EOF then
+} record_header;
+
+typedef struct record_rec {
+    uint64_t start;     // trace_clock() ticks since recording began
+    uint64_t ticks;     // how long the op took
+    int64_t  offset;    // read, write, truncate
+    uint64_t handle;    // open_file the op used, 0 if it went by path
+    uint32_t size;      // read, write
+    uint32_t mode;      // mknod, mkdir, create, chmod; flags for open
+    int32_t  result;
+    uint16_t op;        // enum trace_op
+    uint16_t thread;    // which FUSE thread ran it
+    uint16_t path_len;
+    uint16_t path2_len; // link and rename targets
+} record_rec;
+
+extern int record_on;
+
+// starts appending to path; returns -1 if it can't be created
+int  record_init(const char* path);
+void record_op(int op, const char* path, const char* path2, int64_t offset,
+               uint32_t size, uint32_t mode, uint64_t handle,
+               uint64_t start, int result);
+// flushes and finishes the header; at unmount
+void record_close();
+
+#endif
@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "record.h"
+#include "bench.h"
+#include "storage.h"
+#include "pages.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+
+#define REPLAY_MAX_THREADS 64
+#define HANDLE_BUCKETS     4096
+
+typedef struct replay_op {
+    record_rec rec;
+    char* path;
+    char* path2;
+} replay_op;
+
+// recorded handle -> the open_file standing in for it; refs keeps a
+// release on one thread from freeing what another is reading through
+typedef struct handle_ent {
+    uint64_t handle;
+    open_file* of;
+    int refs;
+    int dead;
+    struct handle_ent* next;
+} handle_ent;
+
+typedef struct replay {
+    replay_op* ops;
+    size_t count;
+    uint64_t ticks_per_sec;
+    int threads;
+    double pace;       // 0 is as fast as possible, 1 is recorded speed
+    int64_t start_ns;
+
+    handle_ent* handles[HANDLE_BUCKETS];
+    pthread_mutex_t handle_lock;
+    int failed;        // a worker couldn't run an op; everyone stops
+} replay;
+
+typedef struct replay_worker {
+    replay* rp;
+    int id;
+    lat_log recorded[TOP_COUNT];
+    lat_log replayed[TOP_COUNT];
+    long mismatches;
+    long skipped;
+    char* buf;
+    size_t buf_size;
+    size_t failed_size; // the buffer it couldn't get, when it stopped the replay
+} replay_worker;
+
+static void
+handle_put(replay* rp, uint64_t handle, open_file* of)
+{
+    handle_ent* ent = calloc(1, sizeof(handle_ent));
+    ent->handle = handle;
+    ent->of = of;
+    ent->refs = 1; // the open's, dropped by its release
+    handle_ent** bucket = &(rp->handles[(handle >> 4) % HANDLE_BUCKETS]);
+    pthread_mutex_lock(&(rp->handle_lock));
+    ent->next = *bucket;
+    *bucket = ent;
+    pthread_mutex_unlock(&(rp->handle_lock));
+}
+
+// the live entry for a recorded handle, with a reference taken; the
+// same address can come back from a later open once it's released
+static handle_ent*
+handle_get(replay* rp, uint64_t handle)
+{
+    if (!handle) {
+        return 0;
+    }
+    pthread_mutex_lock(&(rp->handle_lock));
+    handle_ent* ent = rp->handles[(handle >> 4) % HANDLE_BUCKETS];
+    while (ent && (ent->handle != handle || ent->dead)) {
+        ent = ent->next;
+    }
+    if (ent) {
+        ent->refs += 1;
+    }
+    pthread_mutex_unlock(&(rp->handle_lock));
+    return ent;
+}
+
+// drops the reference handle_get took, and with release the open's as
+// well; the last one out releases the open_file
+static void
+handle_done(replay* rp, handle_ent* ent, int release)
+{
+    pthread_mutex_lock(&(rp->handle_lock));
+    if (release && !ent->dead) {
+        ent->dead = 1;
+        ent->refs -= 1;
+    }
+    ent->refs -= 1;
+    if (ent->refs == 0) {
+        handle_ent** slot = &(rp->handles[(ent->handle >> 4) % HANDLE_BUCKETS]);
+        while (*slot != ent) {
+            slot = &((*slot)->next);
+        }
+        *slot = ent->next;
+        storage_release(ent->of);
+        free(ent);
+    }
+    pthread_mutex_unlock(&(rp->handle_lock));
+}
+
+// a buffer of at least size bytes for a read or write; when there's
+// no memory for it, stops the replay and returns 0
+static char*
+worker_buf(replay_worker* ww, size_t size)
+{
+    if (size > ww->buf_size) {
+        free(ww->buf);
+        ww->buf_size = 0;
+        ww->buf = malloc(size);
+        if (!ww->buf) {
+            ww->failed_size = size;
+            __atomic_store_n(&(ww->rp->failed), 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        memset(ww->buf, 0x5a, size);
+        ww->buf_size = size;
+    }
+    return ww->buf;
+}
+
+// runs one recorded op and returns its result; *skipped is set for
+// the ones replay doesn't run (access, ioctl)
+static int
+replay_one(replay_worker* ww, replay_op* op, int* skipped)
+{
+    replay* rp = ww->rp;
+    record_rec* rec = &(op->rec);
+    const char* path = op->path;
+    handle_ent* ent = handle_get(rp, rec->handle);
+    open_file* of = ent ? ent->of : 0;
+    struct stat st;
+    int rv = 0;
+    *skipped = 0;
+
+    switch (rec->op) {
+    case TOP_GETATTR:
+        rv = storage_stat(path, &st);
+        break;
+    case TOP_READDIR: {
+        // as nufsmount does it: the list, then a stat of each entry
+        rv = storage_stat(path, &st);
+        slist* names = (rv == 0) ? storage_list(path) : 0;
+        for (slist* xs = names; xs; xs = xs->next) {
+            char* item = path_join(path, xs->data);
+            storage_stat(item, &st);
+            free(item);
+        }
+        s_free(names);
+        break;
+    }
+    case TOP_MKNOD:
+        rv = storage_mknod(path, rec->mode, 0);
+        break;
+    case TOP_MKDIR:
+        rv = storage_mknod(path, rec->mode | 040000, 1);
+        break;
+    case TOP_UNLINK:
+    case TOP_RMDIR:
+        rv = storage_unlink(path);
+        break;
+    case TOP_LINK:
+        rv = storage_link(path, op->path2);
+        break;
+    case TOP_RENAME:
+        rv = storage_rename(path, op->path2);
+        break;
+    case TOP_CHMOD:
+        rv = storage_chmod(path, rec->mode);
+        break;
+    case TOP_TRUNCATE:
+        rv = of ? storage_truncate_fh(of, rec->offset) : storage_truncate(path, rec->offset);
+        break;
+    case TOP_OPEN:
+    case TOP_CREATE: {
+        open_file* nof;
+        rv = (rec->op == TOP_CREATE) ? storage_mknod(path, rec->mode, 0) : 0;
+        if (rv == 0) {
+            rv = storage_open(path, (rec->op == TOP_CREATE) ? O_RDWR : (int) rec->mode, &nof);
+        }
+        if (rv == 0 && rec->handle) {
+            handle_put(rp, rec->handle, nof);
+        }
+        else if (rv == 0) {
+            storage_release(nof);
+        }
+        break;
+    }
+    case TOP_RELEASE:
+        if (ent) {
+            handle_done(rp, ent, 1);
+            ent = 0;
+        }
+        break;
+    case TOP_READ: {
+        char* buf = worker_buf(ww, rec->size);
+        if (!buf) {
+            rv = -ENOMEM;
+            break;
+        }
+        rv = of ? storage_read_fh(of, buf, rec->size, rec->offset)
+                : storage_read(path, buf, rec->size, rec->offset);
+        break;
+    }
+    case TOP_WRITE: {
+        char* buf = worker_buf(ww, rec->size);
+        if (!buf) {
+            rv = -ENOMEM;
+            break;
+        }
+        rv = of ? storage_write_fh(of, buf, rec->size, rec->offset)
+                : storage_write(path, buf, rec->size, rec->offset);
+        break;
+    }
+    case TOP_FSYNC:
+        rv = of ? storage_fsync_fh(of) : storage_fsync(path);
+        break;
+    case TOP_FLUSH:
+        rv = of ? storage_flush(of) : 0;
+        break;
+    case TOP_UTIMENS: {
+        struct timespec ts[2];
+        clock_gettime(CLOCK_REALTIME, &(ts[0]));
+        ts[1] = ts[0];
+        rv = storage_set_time(path, ts);
+        break;
+    }
+    default:
+        *skipped = 1;
+        break;
+    }
+
+    if (ent) {
+        handle_done(rp, ent, 0);
+    }
+    return rv;
+}
+
+static void*
+replay_thread(void* arg)
+{
+    replay_worker* ww = arg;
+    replay* rp = ww->rp;
+    double ns_per_tick = 1e9 / rp->ticks_per_sec;
+
+    for (size_t ii = 0; ii < rp->count && !__atomic_load_n(&(rp->failed), __ATOMIC_RELAXED); ++ii) {
+        replay_op* op = &(rp->ops[ii]);
+        if (op->rec.thread % rp->threads != ww->id) {
+            continue;
+        }
+        if (op->rec.op >= TOP_COUNT || streq(op->path, STATS_PATH)) {
+            ww->skipped += 1;
+            continue;
+        }
+
+        if (rp->pace > 0) {
+            int64_t due = rp->start_ns + (int64_t)(op->rec.start * ns_per_tick / rp->pace);
+            int64_t now = bench_now_ns();
+            if (due > now) {
+                struct timespec ts = { (due - now) / 1000000000, (due - now) % 1000000000 };
+                nanosleep(&ts, 0);
+            }
+        }
+
+        int skipped;
+        int64_t t0 = bench_now_ns();
+        int rv = replay_one(ww, op, &skipped);
+        int64_t t1 = bench_now_ns();
+        if (skipped) {
+            ww->skipped += 1;
+            continue;
+        }
+
+        lat_add(&(ww->replayed[op->rec.op]), t1 - t0);
+        lat_add(&(ww->recorded[op->rec.op]), (uint64_t)(op->rec.ticks * ns_per_tick));
+        int was = op->rec.result;
+        if ((rv < 0) != (was < 0) || (rv >= 0 && was >= 0 && rv != was
+                                      && (op->rec.op == TOP_READ || op->rec.op == TOP_WRITE))) {
+            ww->mismatches += 1;
+        }
+    }
+    return 0;
+}
+
+static char*
+copy_path(const char* data, int len)
+{
+    char* path = malloc(len + 1);
+    memcpy(path, data, len);
+    path[len] = 0;
+    return path;
+}
+
+// reads the whole log; a torn record at the end (nufsmount killed
+// mid-write) is dropped
+static int
+replay_load(replay* rp, const char* log)
+{
+    int fd = open(log, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "replay: can't open %s\n", log);
+        return -1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    char* data = malloc(st.st_size + 1);
+    ssize_t got = 0;
+    while (got < st.st_size) {
+        ssize_t nn = read(fd, data + got, st.st_size - got);
+        if (nn <= 0) {
+            break;
+        }
+        got += nn;
+    }
+    close(fd);
+
+    record_header hdr;
+    if (got < (ssize_t) sizeof(hdr)) {
+        fprintf(stderr, "replay: %s is too short\n", log);
+        free(data);
+        return -1;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if (hdr.magic != RECORD_MAGIC || hdr.version != RECORD_VERSION
+        || hdr.rec_size != sizeof(record_rec)) {
+        fprintf(stderr, "replay: %s is not a record log\n", log);
+        free(data);
+        return -1;
+    }
+    // without a rate (nufsmount never unmounted) assume nanoseconds
+    rp->ticks_per_sec = hdr.ticks_per_sec ? hdr.ticks_per_sec : 1000000000;
+
+    size_t cap = 1024;
+    rp->ops = malloc(cap * sizeof(replay_op));
+    size_t pos = sizeof(hdr);
+    while (pos + sizeof(record_rec) <= (size_t) got) {
+        record_rec rec;
+        memcpy(&rec, data + pos, sizeof(rec));
+        size_t next = pos + sizeof(rec) + rec.path_len + rec.path2_len;
+        if (next > (size_t) got) {
+            break;
+        }
+        if (rp->count == cap) {
+            cap *= 2;
+            rp->ops = realloc(rp->ops, cap * sizeof(replay_op));
+        }
+        replay_op* op = &(rp->ops[rp->count++]);
+        op->rec = rec;
+        op->path = copy_path(data + pos + sizeof(rec), rec.path_len);
+        op->path2 = copy_path(data + pos + sizeof(rec) + rec.path_len, rec.path2_len);
+        pos = next;
+    }
+    free(data);
+    return 0;
+}
+
+static int
+replay_usage()
+{
+    fprintf(stderr, "replay image log [key=value...]\n");
+    fprintf(stderr, "  threads=1 pace=0 (1 = recorded speed, 0 = flat out)"
+                    " new=SIZE (format image first)\n");
+    return 1;
+}
+
+int
+replay_main(const char* img, int argc, char* argv[])
+{
+    if (argc < 1) {
+        return replay_usage();
+    }
+    replay rp;
+    memset(&rp, 0, sizeof(rp));
+    pthread_mutex_init(&(rp.handle_lock), 0);
+    rp.threads = 1;
+    int64_t new_bytes = 0;
+
+    for (int ii = 1; ii < argc; ++ii) {
+        char* eq = strchr(argv[ii], '=');
+        if (!eq) {
+            return replay_usage();
+        }
+
+        const char* val = eq + 1;
+        int rv = 0;
+        if (strncmp(argv[ii], "threads=", 8) == 0) {
+            rp.threads = atoi(val);
+            rv = (rp.threads > 0 && rp.threads <= REPLAY_MAX_THREADS) ? 0 : -1;
+        }
+        else if (strncmp(argv[ii], "pace=", 5) == 0) {
+            rv = ((rp.pace = atof(val)) < 0) ? -1 : 0;
+        }
+        else if (strncmp(argv[ii], "new=", 4) == 0) {
+            rv = ((new_bytes = parse_size(val)) < NUFS_PAGE_SIZE) ? -1 : 0;
+        }
+        else {
+            rv = -1;
+        }
+        if (rv < 0) {
+            return replay_usage();
+        }
+    }
+
+    if (replay_load(&rp, argv[0]) < 0) {
+        return 1;
+    }
+
+    if (new_bytes) {
+        unlink(img);
+        if (storage_new(img, new_bytes, 0, 0) < 0) {
+            return 1;
+        }
+    }
+    else if (access(img, R_OK) == -1) {
+        fprintf(stderr, "No such image: %s\n", img);
+        return 1;
+    }
+    else {
+        storage_init(img, 0);
+    }
+
+    int log_threads = 0;
+    for (size_t ii = 0; ii < rp.count; ++ii) {
+        log_threads = max(log_threads, rp.ops[ii].rec.thread + 1);
+    }
+    double log_secs = rp.count ? (double) rp.ops[rp.count - 1].rec.start / rp.ticks_per_sec : 0;
+
+    replay_worker* workers = calloc(rp.threads, sizeof(replay_worker));
+    pthread_t* tids = calloc(rp.threads, sizeof(pthread_t));
+    rp.start_ns = bench_now_ns();
+    for (int ii = 0; ii < rp.threads; ++ii) {
+        workers[ii].rp = &rp;
+        workers[ii].id = ii;
+        pthread_create(&(tids[ii]), 0, replay_thread, &(workers[ii]));
+    }
+    for (int ii = 0; ii < rp.threads; ++ii) {
+        pthread_join(tids[ii], 0);
+    }
+    double secs = (bench_now_ns() - rp.start_ns) / 1e9;
+
+    // handles the log never released
+    for (int bb = 0; bb < HANDLE_BUCKETS; ++bb) {
+        while (rp.handles[bb]) {
+            handle_done(&rp, rp.handles[bb], 1);
+        }
+    }
+
+    if (rp.failed) {
+        for (int ii = 0; ii < rp.threads; ++ii) {
+            if (workers[ii].failed_size) {
+                fprintf(stderr, "replay: no memory for a %zu-byte read or write buffer\n",
+                        workers[ii].failed_size);
+            }
+        }
+    }
+
+    long mismatches = 0;
+    long skipped = 0;
+    lat_log recorded[TOP_COUNT];
+    lat_log replayed[TOP_COUNT];
+    memset(recorded, 0, sizeof(recorded));
+    memset(replayed, 0, sizeof(replayed));
+    for (int ii = 0; ii < rp.threads; ++ii) {
+        mismatches += workers[ii].mismatches;
+        skipped += workers[ii].skipped;
+        for (int op = 0; op < TOP_COUNT; ++op) {
+            for (size_t jj = 0; jj < workers[ii].replayed[op].count; ++jj) {
+                lat_add(&(replayed[op]), workers[ii].replayed[op].ns[jj]);
+                lat_add(&(recorded[op]), workers[ii].recorded[op].ns[jj]);
+            }
+            lat_free(&(workers[ii].replayed[op]));
+            lat_free(&(workers[ii].recorded[op]));
+        }
+        free(workers[ii].buf);
+    }
+
+    size_t ran = rp.count - skipped;
+    printf("{\"log\": {\"records\": %zu, \"threads\": %d, \"seconds\": %.3f},\n",
+           rp.count, log_threads, log_secs);
+    printf(" \"replay\": {\"threads\": %d, \"pace\": %.2f, \"ops\": %zu, \"seconds\": %.3f,"
+           " \"ops_per_sec\": %.1f, \"mismatches\": %ld, \"skipped\": %ld, \"error\": %d},\n",
+           rp.threads, rp.pace, ran, secs, secs > 0 ? ran / secs : 0.0, mismatches, skipped,
+           rp.failed ? -ENOMEM : 0);
+    printf(" \"ops\": [");
+    int printed = 0;
+    for (int op = 0; op < TOP_COUNT; ++op) {
+        if (replayed[op].count == 0) {
+            continue;
+        }
+        printf("%s\n    {\"op\": \"%s\", \"count\": %zu,"
+               " \"recorded_p50_ns\": %lu, \"recorded_p99_ns\": %lu,"
+               " \"replay_p50_ns\": %lu, \"replay_p99_ns\": %lu}",
+               printed ? "," : "", trace_op_name(op), replayed[op].count,
+               (unsigned long) lat_pct(&(recorded[op]), 50),
+               (unsigned long) lat_pct(&(recorded[op]), 99),
+               (unsigned long) lat_pct(&(replayed[op]), 50),
+               (unsigned long) lat_pct(&(replayed[op]), 99));
+        printed += 1;
+        lat_free(&(recorded[op]));
+        lat_free(&(replayed[op]));
+    }
+    printf("\n ]}\n");
+
+    for (size_t ii = 0; ii < rp.count; ++ii) {
+        free(rp.ops[ii].path);
+        free(rp.ops[ii].path2);
+    }
+    free(rp.ops);
+    free(workers);
+    free(tids);
+    storage_free();
+    return rp.failed ? 1 : 0;
+}
@@ -0,0 +1,10 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// "nufstool replay image log [key=value...]": runs a log recorded by
+// "nufsmount --record=log" against storage_* on image, in-process, and
+// prints per-op latencies next to the recorded ones, as JSON.
+
+int replay_main(const char* img, int argc, char* argv[]);
+
+#endif
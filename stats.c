@@ -0,0 +1,206 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+__thread stats_block* stats_self = 0;
+
+static stats_block* blocks = 0;  // live threads'
+static stats_block  retired;     // totals from threads that exited
+static stats_block  overflow;    // shared, for threads calloc failed on
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static uint64_t base_ticks; // trace_clock() and monotonic ns at
+static int64_t  base_ns;    // stats_init, to turn ticks into ns
+
+static const char* counter_names[STAT_COUNT] = {
+    "lookups", "dcache_hits", "pages_alloced", "pages_freed",
+    "inodes_alloced", "inodes_freed", "bytes_read", "bytes_written",
+    "bitmap_scans", "bitmap_words", "cache_misses", "pages_read",
+    "pages_written", "fsyncs", "pages_synced", "sync_ranges",
+};
+
+static int64_t
+mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_init()
+{
+    base_ticks = trace_clock();
+    base_ns = mono_ns();
+}
+
+static void
+block_add(stats_block* into, const stats_block* from)
+{
+    for (int ii = 0; ii < STAT_COUNT; ++ii) {
+        into->counters[ii] += __atomic_load_n(&(from->counters[ii]), __ATOMIC_RELAXED);
+    }
+    for (int op = 0; op < TOP_COUNT; ++op) {
+        for (int bb = 0; bb < STATS_BUCKETS; ++bb) {
+            into->ops[op][bb] += __atomic_load_n(&(from->ops[op][bb]), __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// thread exit: fold the block into the retired totals
+static void
+stats_release(void* arg)
+{
+    stats_block* sb = arg;
+    pthread_mutex_lock(&stats_lock);
+    block_add(&retired, sb);
+    for (stats_block** pp = &blocks; *pp; pp = &((*pp)->next)) {
+        if (*pp == sb) {
+            *pp = sb->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+    free(sb);
+}
+
+static void
+stats_key_init()
+{
+    pthread_key_create(&stats_key, stats_release);
+}
+
+stats_block*
+stats_attach()
+{
+    pthread_once(&stats_once, stats_key_init);
+    stats_block* sb = calloc(1, sizeof(stats_block));
+    if (!sb) {
+        stats_self = &overflow;
+        return stats_self;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    sb->next = blocks;
+    blocks = sb;
+    pthread_mutex_unlock(&stats_lock);
+
+    pthread_setspecific(stats_key, sb);
+    stats_self = sb;
+    return sb;
+}
+
+// smallest and largest tick count that land in bucket bb
+static uint64_t
+bucket_low(int bb)
+{
+    if (bb < (1 << STATS_SUB_BITS)) {
+        return bb;
+    }
+    int top = (bb >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    uint64_t sub = bb & ((1 << STATS_SUB_BITS) - 1);
+    return (1ULL << top) | (sub << (top - STATS_SUB_BITS));
+}
+
+static uint64_t
+bucket_high(int bb)
+{
+    if (bb < (1 << STATS_SUB_BITS)) {
+        return bb;
+    }
+    int top = (bb >> STATS_SUB_BITS) + STATS_SUB_BITS - 1;
+    return bucket_low(bb) + (1ULL << (top - STATS_SUB_BITS)) - 1;
+}
+
+static void
+summarize(const uint64_t* hist, double ns_per_tick, stats_op_summary* out)
+{
+    memset(out, 0, sizeof(stats_op_summary));
+    double total = 0;
+    for (int bb = 0; bb < STATS_BUCKETS; ++bb) {
+        out->count += hist[bb];
+        total += hist[bb] * (bucket_low(bb) + bucket_high(bb)) / 2.0;
+    }
+    if (out->count == 0) {
+        return;
+    }
+    out->mean = total / out->count * ns_per_tick;
+
+    uint64_t seen = 0;
+    for (int bb = 0; bb < STATS_BUCKETS; ++bb) {
+        if (hist[bb] == 0) {
+            continue;
+        }
+        seen += hist[bb];
+        uint64_t high = bucket_high(bb) * ns_per_tick;
+        if (out->p50 == 0 && seen * 2 >= out->count) {
+            out->p50 = high;
+        }
+        if (out->p99 == 0 && seen * 100 >= out->count * 99) {
+            out->p99 = high;
+        }
+        out->max = high;
+    }
+}
+
+void
+stats_snapshot_take(stats_snapshot* snap)
+{
+    stats_block* total = calloc(1, sizeof(stats_block));
+    memset(snap, 0, sizeof(stats_snapshot));
+    if (!total) {
+        return;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    block_add(total, &retired);
+    block_add(total, &overflow);
+    for (stats_block* sb = blocks; sb; sb = sb->next) {
+        block_add(total, sb);
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    int64_t ns = mono_ns() - base_ns;
+    uint64_t ticks = trace_clock() - base_ticks;
+    double ns_per_tick = (ticks > 0 && ns > 0) ? (double) ns / ticks : 1.0;
+
+    memcpy(snap->counters, total->counters, sizeof(snap->counters));
+    for (int op = 0; op < TOP_COUNT; ++op) {
+        summarize(total->ops[op], ns_per_tick, &(snap->ops[op]));
+    }
+    free(total);
+}
+
+size_t
+stats_format(char* buf, size_t size)
+{
+    stats_snapshot snap;
+    stats_snapshot_take(&snap);
+
+    size_t len = 0;
+#define EMIT(...) \
+    len += snprintf(buf + len, (len < size) ? size - len : 0, __VA_ARGS__)
+
+    for (int ii = 0; ii < STAT_COUNT; ++ii) {
+        EMIT("%-16s %lu\n", counter_names[ii], (unsigned long) snap.counters[ii]);
+    }
+    EMIT("\n%-10s %10s %10s %10s %10s %10s\n", "op", "count", "mean_ns", "p50_ns", "p99_ns", "max_ns");
+    for (int op = 0; op < TOP_COUNT; ++op) {
+        stats_op_summary* os = &(snap.ops[op]);
+        if (os->count) {
+            EMIT("%-10s %10lu %10lu %10lu %10lu %10lu\n", trace_op_name(op),
+                 (unsigned long) os->count, (unsigned long) os->mean,
+                 (unsigned long) os->p50, (unsigned long) os->p99,
+                 (unsigned long) os->max);
+        }
+    }
+#undef EMIT
+    return (len < size) ? len : size - 1;
+}
@@ -0,0 +1,106 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+
+#include "trace.h"
+
+// Always-on counters and per-op latency histograms. Each thread adds
+// to its own block, so recording is a couple of plain adds; readers sum
+// the blocks (plus whatever exited threads left behind) on demand.
+
+enum stats_counter {
+    STAT_LOOKUPS,       // name lookups, one per path component tried
+    STAT_DCACHE_HITS,   // of those, answered by the dcache
+    STAT_PAGES_ALLOCED,
+    STAT_PAGES_FREED,
+    STAT_INODES_ALLOCED,
+    STAT_INODES_FREED,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_BITMAP_SCANS,
+    STAT_BITMAP_WORDS,  // 64-bit words those scans looked at
+    STAT_CACHE_MISSES,  // cache_get calls that had to find a frame
+    STAT_PAGES_READ,    // pages the cache read from the image
+    STAT_PAGES_WRITTEN, // and wrote back
+    STAT_FSYNCS,
+    STAT_PAGES_SYNCED,  // pages fsync / sync wrote back or msynced
+    STAT_SYNC_RANGES,   // in this many runs
+    STAT_COUNT
+};
+
+// latency buckets are HDR-style: the top set bit of the duration in
+// clock ticks, then the next STATS_SUB_BITS bits
+#define STATS_SUB_BITS 2
+#define STATS_BUCKETS  (64 << STATS_SUB_BITS)
+
+typedef struct stats_block {
+    uint64_t counters[STAT_COUNT];
+    uint64_t ops[TOP_COUNT][STATS_BUCKETS];
+    struct stats_block* next;
+} stats_block;
+
+extern __thread stats_block* stats_self;
+stats_block* stats_attach();
+
+static inline stats_block*
+stats_mine()
+{
+    return stats_self ? stats_self : stats_attach();
+}
+
+static inline void
+stats_add(int counter, uint64_t nn)
+{
+    stats_block* sb = stats_mine();
+    __atomic_store_n(&(sb->counters[counter]), sb->counters[counter] + nn, __ATOMIC_RELAXED);
+}
+
+static inline int
+stats_bucket(uint64_t ticks)
+{
+    if (ticks < (1 << STATS_SUB_BITS)) {
+        return (int) ticks;
+    }
+    int top = 63 - __builtin_clzll(ticks);
+    int sub = (ticks >> (top - STATS_SUB_BITS)) & ((1 << STATS_SUB_BITS) - 1);
+    return ((top - STATS_SUB_BITS + 1) << STATS_SUB_BITS) + sub;
+}
+
+static inline void
+stats_op(int op, uint64_t ticks)
+{
+    uint64_t* slot = &(stats_mine()->ops[op][stats_bucket(ticks)]);
+    __atomic_store_n(slot, *slot + 1, __ATOMIC_RELAXED);
+}
+
+// what the NUFS_IOC_STATS ioctl returns; latencies in nanoseconds
+typedef struct stats_op_summary {
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t max;
+} stats_op_summary;
+
+typedef struct stats_snapshot {
+    uint64_t counters[STAT_COUNT];
+    stats_op_summary ops[TOP_COUNT];
+} stats_snapshot;
+
+#define NUFS_IOC_STATS _IOR('N', 1, stats_snapshot)
+// makes every change to the image durable, like sync(2) for just this
+// filesystem (FUSE has no syncfs)
+#define NUFS_IOC_SYNC  _IO('N', 2)
+
+// read-only virtual file with the same numbers as text
+#define STATS_PATH "/.nufs_stats"
+
+void stats_init();
+void stats_snapshot_take(stats_snapshot* snap);
+// the snapshot as text into buf; returns the length
+size_t stats_format(char* buf, size_t size);
+
+#endif
@@ -12,6 +12,7 @@
 #include <libgen.h>
 #include <bsd/string.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "storage.h"
 #include "slist.h"
@@ -19,231 +20,519 @@
 #include "pages.h"
 #include "inode.h"
 #include "directory.h"
-
-
-int iptr_write(int iptr, const char* buf, size_t size, off_t offset);
-int ptr_write(inode* node, int ptr, const char* buf, size_t size, off_t offset);
-int iptr_read(int iptr, char* buf, size_t size, off_t offset);
-int ptr_read(inode* node, int ptr, char* buf, size_t size, off_t offset);
+#include "dcache.h"
+#include "path.h"
+#include "lock.h"
+#include "epoch.h"
+#include "magazine.h"
+#include "stats.h"
+#include "log.h"
+
+
+static size_t copy_pages(open_file* of, inode* node, char* buf, size_t size, off_t offset, int to_file);
+static int lookup_locked(const char* path, int exclusive);
+static int file_map(open_file* of, inode* node, int fpn, int* run);
 	
 	void
 storage_init(const char* path, int create)
 {
-    //printf("storage_init(%s, %d);\n", path, create);
-    pages_init(path, create);
-    if (create) {
+    int fresh = pages_init(path, create);
+    stats_init();
+    lock_init();
+    dcache_init();
+    if (fresh) {
         directory_init();
     }
 }
 
 int
-storage_stat(const char* path, struct stat* st)
+storage_new(const char* path, int64_t nbytes, int inodes, int flags)
 {
-    printf("+ storage_stat(%s)\n", path);
-    int inum = tree_lookup(path);
-    printf("the inum is: %d\n", inum);
+    int rv = pages_format(path, nbytes, inodes, flags);
+    if (rv < 0) {
+        return rv;
+    }
+    stats_init();
+    lock_init();
+    dcache_init();
+    directory_init();
+    return 0;
+}
 
+// puts back anything threads have cached and unmaps the image; for
+// shutdown, once nothing else is running
+void
+storage_free()
+{
+    epoch_collect();
+    thread_cache_drain_all();
+    pages_free();
+}
 
+int
+storage_stat(const char* path, struct stat* st)
+{
+    pages_put_all();
+    int inum = lookup_locked(path, 0);
+    log_trace("+ storage_stat(%s) -> %d\n", path, inum);
     if (inum < 0) {
         return inum;
     }
 
     inode* node = get_inode(inum);
-    printf("+ storage_stat(%s); inode %d\n", path, inum);
-    print_inode(node);
 
     memset(st, 0, sizeof(struct stat));
+    st->st_ino   = inum;
     st->st_uid   = getuid();
     st->st_mode  = node->mode;
     st->st_size  = node->size;
     st->st_nlink = node->refs;
+    inode_unlock(inum);
     return 0;
 }
 
-int
-storage_read(const char* path, char* buf, size_t size, off_t offset)
+static void
+file_init(open_file* of, int inum, int flags)
+{
+    memset(of, 0, sizeof(open_file));
+    of->inum = inum;
+    of->flags = flags;
+    pthread_mutex_init(&(of->cur_lock), 0);
+}
+
+static void
+lock_inode(int inum, int exclusive)
+{
+    if (exclusive) {
+        inode_lock_wr(inum);
+    }
+    else {
+        inode_lock_rd(inum);
+    }
+}
+
+// looks up path and returns its inum with the inode locked, shared or
+// exclusive. Fully cached paths resolve without locks inside an epoch,
+// which keeps the inode from being freed before it is locked; anything
+// else walks the directories under the shared namespace lock.
+static int
+lookup_locked(const char* path, int exclusive)
 {
-    int trv = storage_truncate(path, offset + size);
-    if (trv < 0) {
-        return trv;
+    if (epoch_enter()) {
+        int inum = tree_lookup_fast(path);
+        if (inum >= 0) {
+            lock_inode(inum, exclusive);
+        }
+        epoch_exit();
+        if (inum >= 0) {
+            return inum;
+        }
     }
 
+    ns_lock_rd();
     int inum = tree_lookup(path);
+    if (inum >= 0) {
+        lock_inode(inum, exclusive);
+    }
+    ns_unlock();
+    return inum;
+}
+
+int
+storage_open(const char* path, int flags, open_file** out)
+{
+    pages_put_all();
+    int inum = lookup_locked(path, 0);
     if (inum < 0) {
         return inum;
     }
+    inode_unlock(inum);
 
-    inode* node = get_inode(inum);
-    int start_idx = offset /4096;
-    off_t real_off = offset - (start_idx * 4096);
-
-    if ((offset + size) > node->size) {
-        if(grow_inode(node, offset + size - node->size) < 0){
-		return -1;
-        }
+    open_file* of = malloc(sizeof(open_file));
+    if (!of) {
+        return -ENOMEM;
     }
-    
+    file_init(of, inum, flags);
+    *out = of;
+    return 0;
+}
 
-    if(start_idx >= 2){
-	    return iptr_read(node->iptr, buf, size, offset - 8192);
-    }else{
-	    return ptr_read(node, start_idx, buf, size, real_off);
-    }
+void
+storage_release(open_file* of)
+{
+    pthread_mutex_destroy(&(of->cur_lock));
+    free(of);
 }
 
-int
-storage_write(const char* path, const char* buf, size_t size, off_t offset)
+static int
+truncate_inode(inode* node, off_t size)
 {
-    int trv = storage_truncate(path, offset + size);
-    if (trv < 0) {
-        return trv;
+    if (node->size > size) {
+        return shrink_inode(node, size);
     }
+    return grow_inode(node, size);
+}
 
-    int inum = tree_lookup(path);
-    if (inum < 0) {
-        return inum;
+// Reads never change the image: the request is clamped to the file size
+// and the result is the number of bytes copied, short at EOF.
+// Caller holds the inode lock, shared.
+static int
+file_read(open_file* of, char* buf, size_t size, off_t offset)
+{
+    inode* node = get_inode(of->inum);
+    if (offset >= node->size) {
+        return 0;
+    }
+    if (size > node->size - offset) {
+        size = node->size - offset;
     }
 
-    inode* node = get_inode(inum);
-    int start_idx = offset /4096;
-    off_t real_off = offset - (start_idx * 4096);
+    size_t done = copy_pages(of, node, buf, size, offset, 0);
+    stats_add(STAT_BYTES_READ, done);
+    return done;
+}
 
+// caller holds the inode lock, exclusive
+static int
+file_write(open_file* of, const char* buf, size_t size, off_t offset)
+{
+    inode* node = get_inode(of->inum);
     if ((offset + size) > node->size) {
-        if(grow_inode(node, offset + size - node->size) < 0){
-		return -1;
+        int rv = grow_inode(node, offset + size);
+        if (rv < 0) {
+            return rv;
         }
     }
-    
-
-    if(start_idx >= 2){
-	    return iptr_write(node->iptr, buf, size, offset - 8192);
-    }else{
-	    return ptr_write(node, start_idx, buf, size, real_off);
-    }
 
-    
-   }
+    size_t done = copy_pages(of, node, (char*) buf, size, offset, 1);
+    stats_add(STAT_BYTES_WRITTEN, done);
+    return done;
+}
 
 int
-ptr_write(inode* node, int ptr, const char* buf, size_t size, off_t offset){
-	void* data = pages_get_page(node->ptrs[ptr]);
-	if(offset + size < 4096){	
-		memcpy(data + offset, buf, size);
-		return 0;
-	}else{
-		size_t curr_size = 4096 - offset;
-		memcpy(data + offset, buf, curr_size);
-		if(ptr){
-			return iptr_write(node->iptr, buf + curr_size, size - curr_size, 0);
-		}else{
-			return ptr_write(node, 1, buf + curr_size, size - curr_size, 0);
-		}
-	}
-
+storage_read_fh(open_file* of, char* buf, size_t size, off_t offset)
+{
+    pages_put_all();
+    inode_lock_rd(of->inum);
+    int rv = file_read(of, buf, size, offset);
+    inode_unlock(of->inum);
+    return rv;
 }
 
+int
+storage_write_fh(open_file* of, const char* buf, size_t size, off_t offset)
+{
+    pages_put_all();
+    inode_lock_wr(of->inum);
+    int rv = file_write(of, buf, size, offset);
+    inode_unlock(of->inum);
+    return rv;
+}
 
 int
-iptr_write(int iptr, const char* buf, size_t size, off_t offset){
-	inode* node = get_inode(iptr);
-    	uint8_t* data = pages_get_page(iptr);
+storage_truncate_fh(open_file* of, off_t size)
+{
+    pages_put_all();
+    inode_lock_wr(of->inum);
+    int rv = truncate_inode(get_inode(of->inum), size);
+    inode_unlock(of->inum);
+    return rv;
+}
 
-    	int start_idx = offset /4096;
-    	off_t real_off = offset - (start_idx * 4096);    
+// where [offset, offset + size) of the file sits in the image, as up
+// to max runs; returns how many, and the bytes they cover in *done.
+// Caller holds the inode lock and has clamped size to the file.
+static int
+map_runs(open_file* of, inode* node, size_t size, off_t offset,
+         file_run* runs, int max, size_t* done)
+{
+    int count = 0;
+    *done = 0;
+    while (*done < size && count < max) {
+        off_t pos = offset + *done;
+        int run;
+        int pnum = file_map(of, node, pos / 4096, &run);
+        if (pnum < 0) {
+            break;
+        }
+
+        off_t in_page = pos % 4096;
+        size_t span = (size_t) run * 4096 - in_page;
+        runs[count].pos = (int64_t) pnum * 4096 + in_page;
+        runs[count].len = (size - *done < span) ? size - *done : span;
+        *done += runs[count].len;
+        count += 1;
+    }
+    return count;
+}
 
-    	if(start_idx >= 2){
-		return iptr_write(node->iptr, buf, size, offset - 8192);
-   	}else{
-		return ptr_write(node, start_idx, buf, size, real_off);
-    	}
+int
+storage_read_runs(open_file* of, size_t size, off_t offset,
+                  file_run* runs, int max, size_t* total)
+{
+    if (!pages_mapped()) {
+        return -EOPNOTSUPP;
+    }
+    inode_lock_rd(of->inum);
+    inode* node = get_inode(of->inum);
+    int count = 0;
+    *total = 0;
+    if (offset < node->size) {
+        if (size > node->size - offset) {
+            size = node->size - offset;
+        }
+        count = map_runs(of, node, size, offset, runs, max, total);
+    }
+    inode_unlock(of->inum);
 
+    stats_add(STAT_BYTES_READ, *total);
+    return count;
 }
 
 int
-ptr_read(inode* node, int ptr, char* buf, size_t size, off_t offset){
-	void* data = pages_get_page(node->ptrs[ptr]);
-	if(offset + size < 4096){	
-		memcpy(buf, data + offset, size);
-		return 0;
-	}else{
-		size_t curr_size = 4096 - offset;
-		memcpy(buf, data + offset, curr_size);
-		if(ptr){
-			return iptr_read(node->iptr, buf + curr_size, size - curr_size, 0);
-		}else{
-			return ptr_read(node, 1, buf + curr_size, size - curr_size, 0);
-		}
-	}
+storage_write_begin(open_file* of, size_t size, off_t offset, file_run* runs, int max)
+{
+    if (!pages_mapped()) {
+        return -EOPNOTSUPP;
+    }
+    inode_lock_wr(of->inum);
+    inode* node = get_inode(of->inum);
+    of->write_from = node->size;
+    if ((offset + size) > node->size) {
+        int rv = grow_inode(node, offset + size);
+        if (rv < 0) {
+            inode_unlock(of->inum);
+            return rv;
+        }
+    }
+
+    size_t done;
+    return map_runs(of, node, size, offset, runs, max, &done);
+}
 
+// marks the pages under [offset, offset + size) of the file dirty, for
+// writes that went around copy_pages
+static void
+mark_written(open_file* of, inode* node, off_t offset, size_t size)
+{
+    int last = (offset + size - 1) / 4096;
+    for (int fpn = offset / 4096; fpn <= last; ) {
+        int run;
+        int pnum = file_map(of, node, fpn, &run);
+        if (pnum < 0) {
+            break;
+        }
+        if (run > last - fpn + 1) {
+            run = last - fpn + 1;
+        }
+        pages_dirty_range(pnum, run);
+        fpn += run;
+    }
 }
 
+int
+storage_write_end(open_file* of, size_t size, off_t offset, ssize_t written)
+{
+    inode* node = get_inode(of->inum);
+    if (written < (ssize_t) size) {
+        // don't leave the file grown past what actually arrived
+        int64_t keep = offset + ((written > 0) ? written : 0);
+        if (keep < of->write_from) {
+            keep = of->write_from;
+        }
+        if (keep < node->size) {
+            shrink_inode(node, keep);
+        }
+    }
+    if (written > 0) {
+        stats_add(STAT_BYTES_WRITTEN, written);
+        mark_written(of, node, offset, written);
+    }
+    inode_unlock(of->inum);
+    return written;
+}
 
 int
-iptr_read(int iptr, char* buf, size_t size, off_t offset){
-	inode* node = get_inode(iptr);
-   	uint8_t* data = pages_get_page(iptr);
+storage_read(const char* path, char* buf, size_t size, off_t offset)
+{
+    pages_put_all();
+    int inum = lookup_locked(path, 0);
+    if (inum < 0) {
+        return inum;
+    }
 
-   	int start_idx = offset /4096;
-    off_t real_off = offset - (start_idx * 4096);    
+    open_file of;
+    file_init(&of, inum, 0);
+    int rv = file_read(&of, buf, size, offset);
+    inode_unlock(inum);
+    return rv;
+}
 
-    if(start_idx >= 2){
-		return iptr_read(node->iptr, buf, size, offset - 8192);
-   	}else{
-		return ptr_read(node, start_idx, buf, size, real_off);
+int
+storage_write(const char* path, const char* buf, size_t size, off_t offset)
+{
+    pages_put_all();
+    int inum = lookup_locked(path, 1);
+    if (inum < 0) {
+        return inum;
     }
 
+    open_file of;
+    file_init(&of, inum, 0);
+    int rv = file_write(&of, buf, size, offset);
+    inode_unlock(inum);
+    return rv;
 }
 
 int
 storage_truncate(const char *path, off_t size)
-{	
-	int rv = -1;
-    	int inum = tree_lookup(path);
-	inode* inode = get_inode(inum);
-    	if (inode->size > size) {
-      		rv = shrink_inode(inode, size);
-   	}
-    	else {
-        	rv = grow_inode(inode, size);
-    	}
-	return rv;
+{
+    pages_put_all();
+    int inum = lookup_locked(path, 1);
+    if (inum < 0) {
+        return inum;
+    }
+    int rv = truncate_inode(get_inode(inum), size);
+    inode_unlock(inum);
+    return rv;
 }
 
+// file page -> disk page through the handle's cached run, so sequential
+// I/O only walks the mapping once per run. Threads reading through the
+// same handle don't wait on each other for the cursor: whoever loses
+// the trylock maps the page directly.
+static int
+file_map(open_file* of, inode* node, int fpn, int* run)
+{
+    if (pthread_mutex_trylock(&(of->cur_lock)) != 0) {
+        return inode_map(node, fpn, run);
+    }
 
-int
-storage_mknod(const char* path, int mode, int is_dir)
-{  
-    char* name = get_name(path);
+    unsigned epoch = inode_map_epoch();
+    if (of->map_epoch == epoch && of->cur_len > 0
+        && fpn >= of->cur_fpn && fpn < of->cur_fpn + of->cur_len) {
+        int skip = fpn - of->cur_fpn;
+        int pnum = of->cur_pnum + skip;
+        *run = of->cur_len - skip;
+        pthread_mutex_unlock(&(of->cur_lock));
+        return pnum;
+    }
 
-    int    inum = alloc_inode(mode);
-    inode* node = get_inode(inum);
-    node->mode = mode;
-    node->size = 0;
+    int pnum = inode_map(node, fpn, run);
+    if (pnum >= 0) {
+        of->cur_fpn = fpn;
+        of->cur_pnum = pnum;
+        of->cur_len = *run;
+        of->map_epoch = epoch;
+    }
+    pthread_mutex_unlock(&(of->cur_lock));
+    return pnum;
+}
 
+// copies between buf and the file's pages, one memcpy per run of
+// pages that are contiguous on disk (and so in the mapping; a cached
+// page is a run of its own)
+static size_t
+copy_pages(open_file* of, inode* node, char* buf, size_t size, off_t offset, int to_file)
+{
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        int run;
+        int pnum = file_map(of, node, pos / 4096, &run);
+        if (pnum < 0) {
+            break;
+        }
 
+        if (!pages_mapped()) {
+            run = 1;
+        }
+        off_t in_page = pos % 4096;
+        size_t span = (size_t) run * 4096 - in_page;
+        size_t nn = (size - done < span) ? size - done : span;
+        uint8_t* data = (uint8_t*) pages_get_page(pnum) + in_page;
+
+        if (to_file) {
+            memcpy(data, buf + done, nn);
+            pages_dirty_range(pnum, (in_page + nn + 4095) / 4096);
+        }
+        else {
+            memcpy(buf + done, data, nn);
+        }
+        pages_put_page(pnum);
+        done += nn;
+    }
+    return done;
+}
 
-    printf("+ mknod did here\n");
-    if (directory_lookup(node, name) != -ENOENT) {
-        printf("mknod fail: already exist\n");
-        return -EEXIST;
+// resolves the directory holding path's last component and copies that
+// component into name, which must hold DIR_NAME bytes
+static int
+lookup_parent(const char* path, char* name)
+{
+    int parent_len;
+    int leaf_len;
+    const char* leaf;
+
+    path_split(path, &parent_len, &leaf, &leaf_len);
+    int rv = path_copy_name(name, leaf, leaf_len);
+    if (rv < 0) {
+        return rv;
     }
+    return tree_lookup_len(path, parent_len);
+}
+
+static int
+mknod_locked(const char* path, int mode, int is_dir)
+{
+    char name[DIR_NAME];
+    int parent_inum = lookup_parent(path, name);
+    if (parent_inum < 0) {
+        return parent_inum;
+    }
+
+    // let inodes unlinked since the last collection be reused
+    epoch_collect();
 
-    char* parent = get_parent(path);
-    int parent_inum = tree_lookup(parent);
     inode* parentdir = get_inode(parent_inum);
+    if (directory_lookup(parentdir, name) != -ENOENT) {
+        return -EEXIST;
+    }
+
+    int inum = alloc_inode(mode);
+    if (inum < 0) {
+        return -ENOSPC;
+    }
+
+    log_trace("+ mknod create %s [%04o] - #%d\n", path, mode, inum);
 
-    printf("+ mknod create %s [%04o] - #%d\n", path, mode, inum);
+    int rv = directory_put(parentdir, name, inum, is_dir);
+    if (rv < 0) {
+        free_inode(inum);
+    }
+    return rv;
+}
 
-    return directory_put(parentdir, name, inum, is_dir);
+int
+storage_mknod(const char* path, int mode, int is_dir)
+{
+    pages_put_all();
+    ns_lock_wr();
+    int rv = mknod_locked(path, mode, is_dir);
+    ns_unlock();
+    return rv;
 }
 
 int
 storage_chmod(const char* path, mode_t mode){ 
     
-    int inum = tree_lookup(path);
+    pages_put_all();
+    int inum = lookup_locked(path, 1);
     if (inum >= 0) {
         inode* node = get_inode(inum);
 	node->mode = mode;
+	pages_dirty_ptr(node, sizeof(inode));
+	inode_unlock(inum);
 	return 0;
     }else 
 	return -1;
@@ -256,65 +545,196 @@ storage_chmod(const char* path, mode_t mode){
 slist*
 storage_list(const char* path)
 {
-    return list_all(path);
+    pages_put_all();
+    ns_lock_rd();
+    slist* list = list_all(path);
+    ns_unlock();
+    return list;
 }
 
 int
 storage_unlink(const char* path)
 {
-    char* parent = get_parent(path);
-    int inum = tree_lookup(parent);
+    pages_put_all();
+    char name[DIR_NAME];
+    ns_lock_wr();
+    int inum = lookup_parent(path, name);
+    int rv = (inum < 0) ? inum : directory_delete(get_inode(inum), name);
+    ns_unlock();
+    return rv;
+}
+
+static int
+link_locked(const char* from, const char* to)
+{
+    int inum = tree_lookup(from);
+    if (inum < 0) {
+        return inum;
+    }
+
+    char name[DIR_NAME];
+    int parent_inum = lookup_parent(to, name);
+    if (parent_inum < 0) {
+        return parent_inum;
+    }
+
+    inode* parentnode = get_inode(parent_inum);
+    if (directory_lookup(parentnode, name) != -ENOENT) {
+        return -EEXIST;
+    }
+
     inode* node = get_inode(inum);
-  
-    const char* name = path + 1;
-    return directory_delete(node, name);
+    int rv = directory_put(parentnode, name, inum, S_ISDIR(node->mode));
+    if (rv == 0) {
+        node->refs += 1;
+        pages_dirty_ptr(node, sizeof(inode));
+    }
+    return rv;
 }
 
 int
 storage_link(const char* from, const char* to)
-{   int rv = -1;
-    struct stat from_st;
-    struct stat to_st;
+{
+    pages_put_all();
+    ns_lock_wr();
+    int rv = link_locked(from, to);
+    ns_unlock();
+    return rv;
+}
+
+static int
+rename_locked(const char* from, const char* to)
+{
+    char old_name[DIR_NAME];
+    char new_name[DIR_NAME];
 
-    int from_rv = storage_stat(from, &from_st);
-    if (from_rv == -ENOENT) {
-        return from_rv;
+    int from_parent = lookup_parent(from, old_name);
+    if (from_parent < 0) {
+        return from_parent;
+    }
+    int to_parent = lookup_parent(to, new_name);
+    if (to_parent < 0) {
+        return to_parent;
     }
 
-    int to_rv = storage_stat(to, &to_st);
-    assert(to_rv == -ENOENT);
-    if (to_rv != -ENOENT) {
-        return to_rv;
+    // what rename(2) refuses: a directory into itself, and replacing
+    // across types or over a directory that still has entries
+    int src = tree_lookup(from);
+    if (src < 0) {
+        return src;
     }
-    char* parent = get_parent(from);
-    int parentinum = tree_lookup(parent);
-    int inum = tree_lookup(from);
-    inode* parentnode = get_inode(parentinum);
-    
-    
-    inode* node = get_inode(inum);
-    node->refs += 1;
-    int is_dir = 0;
-    if(node->mode >= 040000){
-        int is_dir = 1;
+    int src_dir = S_ISDIR(get_inode(src)->mode);
+    int from_len = strlen(from);
+    if (src_dir && strncmp(to, from, from_len) == 0 && to[from_len] == '/') {
+        return -EINVAL;
     }
-    
-    return directory_put(parentnode, to, inum, is_dir);
+    int dst = directory_lookup(get_inode(to_parent), new_name);
+    if (dst >= 0 && dst != src) {
+        inode* target = get_inode(dst);
+        if (src_dir && !S_ISDIR(target->mode)) {
+            return -ENOTDIR;
+        }
+        if (!src_dir && S_ISDIR(target->mode)) {
+            return -EISDIR;
+        }
+        int pos = 0;
+        if (S_ISDIR(target->mode) && directory_next(target, &pos)) {
+            return -ENOTEMPTY;
+        }
+    }
+
+    return directory_move(get_inode(from_parent), old_name, get_inode(to_parent), new_name);
 }
 
 int
 storage_rename(const char* from, const char* to)
-{   
-//    if (inum < 0) {
-//        printf("mknod fail");
-//        return inum;
-//    }
-    char* parent = get_parent(from);
-    int parent_num = tree_lookup(parent);
-    inode* parent_node = get_inode(parent_num);
-    const char* old_name = get_name(from);
-    const char* new_name = get_name(to);
-    return change_directory_name(parent_node, old_name, new_name);
+{
+    pages_put_all();
+    ns_lock_wr();
+    int rv = rename_locked(from, to);
+    ns_unlock();
+    return rv;
+}
+
+// Syncs what's changed of one file: its data, the pages mapping it,
+// its inode, and the superblock and bitmaps its allocations went into.
+// The pages are collected under the inode lock, which the caller holds
+// and this drops, and written after it. Pages of other files are left
+// dirty, so this costs what the file changed, not what the image holds.
+static int
+fsync_locked(int inum)
+{
+    page_ranges rr = {0};
+    inode_take_dirty(get_inode(inum), &rr);
+    inode_unlock(inum);
+    pages_put_all();
+
+    pages_take_dirty(&rr, 0, get_super()->itable_start);
+    int rv = pages_sync_ranges(&rr, 1);
+    pages_ranges_free(&rr);
+    stats_add(STAT_FSYNCS, 1);
+    return rv;
+}
+
+int
+storage_fsync_fh(open_file* of)
+{
+    pages_put_all();
+    inode_lock_rd(of->inum);
+    return fsync_locked(of->inum);
+}
+
+int
+storage_fsync(const char* path)
+{
+    pages_put_all();
+    int inum = lookup_locked(path, 0);
+    if (inum < 0) {
+        return inum;
+    }
+    return fsync_locked(inum);
+}
+
+// close(2) promises nothing about durability, and under mmap the image
+// file already has every write; the cache backends hand the file's
+// cached pages to the kernel so other readers of the image see them,
+// without waiting on the disk
+int
+storage_flush(open_file* of)
+{
+    if (pages_mapped()) {
+        return 0;
+    }
+    pages_put_all();
+    page_ranges rr = {0};
+    inode_lock_rd(of->inum);
+    inode* node = get_inode(of->inum);
+    int pages = bytes_to_pages(node->size);
+    for (int fpn = 0; fpn < pages; ) {
+        int run;
+        int pnum = inode_map(node, fpn, &run);
+        if (pnum < 0) {
+            break;
+        }
+        if (run > pages - fpn) {
+            run = pages - fpn;
+        }
+        pages_add_range(&rr, pnum, run);
+        fpn += run;
+    }
+    inode_unlock(of->inum);
+    pages_put_all();
+
+    int rv = pages_sync_ranges(&rr, 0);
+    pages_ranges_free(&rr);
+    return rv;
+}
+
+int
+storage_sync()
+{
+    pages_put_all();
+    return pages_flush();
 }
 
 int
@@ -5,20 +5,77 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #include "slist.h"
 
+// state for one open(2) of a file, kept in fuse_file_info->fh so reads
+// and writes on it skip path resolution
+typedef struct open_file {
+    int inum;
+    int flags;
+    // last mapped run: file pages [cur_fpn, cur_fpn + cur_len) sit at
+    // disk pages from cur_pnum; only trusted while map_epoch matches
+    int cur_fpn;
+    int cur_pnum;
+    int cur_len;
+    unsigned map_epoch;
+    pthread_mutex_t cur_lock; // guards the cursor
+    int64_t write_from; // file size when storage_write_begin ran
+} open_file;
+
+// len bytes of a file that sit contiguously in the image file, from
+// byte pos of it
+typedef struct file_run {
+    int64_t pos;
+    size_t  len;
+} file_run;
+
+// opens the image at path; with create, a missing one is formatted
 void   storage_init(const char* path, int create);
+// formats a new image at path, which must not exist; 0 or -errno
+int    storage_new(const char* path, int64_t nbytes, int inodes, int flags);
+void   storage_free();
 int    storage_stat(const char* path, struct stat* st);
 int    storage_read(const char* path, char* buf, size_t size, off_t offset);
 int    storage_write(const char* path, const char* buf, size_t size, off_t offset);
 int    storage_truncate(const char *path, off_t size);
+int    storage_open(const char* path, int flags, open_file** out);
+void   storage_release(open_file* of);
+int    storage_read_fh(open_file* of, char* buf, size_t size, off_t offset);
+// where [offset, offset + size) of the file, clamped to EOF, lives in
+// the image, as up to max runs; returns how many and sets *total to the
+// bytes they cover. Nothing pins the pages, so a racing write or
+// truncate can change what's there. The image file only has the newest
+// data under the mmap backend; elsewhere this is -EOPNOTSUPP.
+int    storage_read_runs(open_file* of, size_t size, off_t offset,
+                         file_run* runs, int max, size_t* total);
+// a write whose data the caller moves itself, e.g. by splicing it into
+// the image file: begin locks the file, grows it to cover [offset,
+// offset + size) and maps that like storage_read_runs; end gets the
+// bytes that landed (or an error), trims the file back if that's short
+// of size, and unlocks. Returns written; -EOPNOTSUPP from begin unless
+// pages_mapped().
+int    storage_write_begin(open_file* of, size_t size, off_t offset,
+                           file_run* runs, int max);
+int    storage_write_end(open_file* of, size_t size, off_t offset, ssize_t written);
+int    storage_write_fh(open_file* of, const char* buf, size_t size, off_t offset);
+int    storage_truncate_fh(open_file* of, off_t size);
 int    storage_mknod(const char* path, int mode, int is_dir); 
 int    storage_unlink(const char* path);
 int    storage_link(const char *from, const char *to);
 int    storage_rename(const char *from, const char *to);
 int    storage_chmod(const char *path, mode_t mode);
 int    storage_set_time(const char* path, const struct timespec ts[2]);
+// makes the file's changes durable; see fsync_locked. 0 or -errno
+int    storage_fsync_fh(open_file* of);
+int    storage_fsync(const char* path);
+// at close: nothing under mmap, else the file's cached pages go to the
+// kernel but not necessarily the disk
+int    storage_flush(open_file* of);
+// every change to the image, durably
+int    storage_sync();
 slist* storage_list(const char* path);
 
 #endif
@@ -2,11 +2,15 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 56;
 use IO::Handle;
 
 sub mount {
-    system("(make mount 2>&1) >> test.log &");
+    my ($image, $backend, $target) = @_;
+    $image ||= "data.nufs";
+    $backend ||= "mmap";
+    $target ||= "mount";
+    system("(make $target IMAGE=$image BACKEND=$backend 2>&1) >> test.log &");
     sleep 1;
 }
 
@@ -31,6 +35,30 @@ sub read_text {
     return $data;
 }
 
+sub write_raw {
+    my ($name, $data) = @_;
+    open my $fh, ">", "mnt/$name" or return;
+    print $fh $data;
+    close $fh;
+}
+
+sub write_slice {
+    my ($name, $data, $offset) = @_;
+    open my $fh, "+<", "mnt/$name" or return;
+    seek $fh, $offset, 0;
+    print $fh $data;
+    close $fh;
+}
+
+sub read_raw {
+    my ($name) = @_;
+    open my $fh, "<", "mnt/$name" or return "";
+    local $/ = undef;
+    my $data = <$fh> || "";
+    close $fh;
+    return $data;
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -160,6 +188,10 @@ my $huge2 = read_text_slice("40k.txt", 10, 8050);
 $right = "ng is four";
 ok($huge2 eq $right, "Read with offset & length");
 
+my $huge3 = read_text_slice("40k.txt", 100, 39990);
+ok($huge3 eq "ers long.=" && -s "mnt/40k.txt" == 40000,
+   "Short read at EOF leaves size alone");
+
 system("mkdir -p mnt/dir1/dir2/dir3/dir4/dir5");
 my $hi0 = "hello there";
 write_text("dir1/dir2/dir3/dir4/dir5/hello.txt", $hi0);
@@ -201,3 +233,132 @@ ok($size =~ /^(\d+)/ && +$1 == 1048576, "correct size disk image");
 
 my $list = `timeout -k 5 2 ./nufstool ls data.nufs`;
 ok($list =~ /25\.num/, "nufstool ls shows nesting");
+
+say "#           == Bigger Images ==";
+
+# 8MB: past the 4 in-inode extents, and past the blockmap's single
+# indirect page into its double indirect one
+my $big0 = join("", map { sprintf("%07d\n", $_) } 0..(1024 * 1024 - 1));
+my @backends = ("mmap", "pread", "uring");
+
+for my $map ("extent", "indirect") {
+    my $image = "test-$map.nufs";
+    system("rm -f $image");
+    system("(./nufstool new $image 64M 0 $map 2>&1) >> test.log");
+    mount($image);
+
+    write_raw("big.bin", $big0);
+    ok(-s "mnt/big.bin" == length($big0) && read_raw("big.bin") eq $big0,
+       "$map: read back 8M file");
+
+    my $off = 4096 * 1000 - 5;
+    ok(read_text_slice("big.bin", 16, $off) eq substr($big0, $off, 16),
+       "$map: read 8M file across a page boundary");
+
+    system("mkdir mnt/many");
+    for my $ii (1..1000) {
+        write_text("many/$ii.num", "$ii");
+    }
+
+    my $count = `ls mnt/many | wc -l`;
+    ok($count == 1000, "$map: created 1000 files in one directory");
+
+    my $bad = grep { (read_text("many/$_.num") || -1) != $_ }
+              map { $_ * 37 } 1..27;
+    ok($bad == 0, "$map: read back files from a big directory");
+
+    write_text("old.txt", "old contents");
+    write_text("new.txt", "new contents");
+    ok(rename("mnt/new.txt", "mnt/old.txt") && !-e "mnt/new.txt"
+       && read_text("old.txt") eq "new contents",
+       "$map: rename over an existing file");
+
+    system("mkdir -p mnt/full/sub mnt/empty");
+    ok(!rename("mnt/empty", "mnt/full") && ($!{ENOTEMPTY} || $!{EEXIST})
+       && -d "mnt/full/sub",
+       "$map: rename over a non-empty directory fails");
+
+    ok(!rename("mnt/old.txt", "mnt/full") && $!{EISDIR},
+       "$map: rename a file over a directory fails");
+
+    ok(rename("mnt/empty", "mnt/full/sub") && !-e "mnt/empty"
+       && -d "mnt/full/sub",
+       "$map: rename over an empty directory");
+
+    unmount();
+
+    # each backend reads back what the ones before it wrote, then
+    # changes a page of big.bin and adds a file of its own
+    my $want = $big0;
+    for my $ii (0..$#backends) {
+        my $backend = $backends[$ii];
+        mount($image, $backend);
+
+        my $same = read_raw("big.bin") eq $want
+            && `ls mnt/many | wc -l` == 1000
+            && read_text("old.txt") eq "new contents";
+
+        my $patch = "patched under $backend";
+        my $at = 4096 * (500 + 300 * $ii) + 100;
+        write_slice("big.bin", $patch, $at);
+        substr($want, $at, length($patch)) = $patch;
+        write_text("$backend.txt", "written under $backend");
+
+        unmount();
+        ok($same, "$map: remounted existing image under $backend");
+    }
+
+    mount($image);
+    my $kept = grep { read_text("$_.txt") eq "written under $_" } @backends;
+    ok($kept == 3 && read_raw("big.bin") eq $want,
+       "$map: writes under every backend persisted");
+    unmount();
+
+    system("rm -f $image");
+}
+
+say "#           == Multithreaded Mount ==";
+
+system("rm -f test-mt.nufs");
+system("(./nufstool new test-mt.nufs 16M 2>&1) >> test.log");
+mount("test-mt.nufs", "mmap", "mount-mt");
+
+# 4 processes create and unlink files in churn/ while ls lists it, so
+# readdir keeps racing entries going away
+system("mkdir mnt/churn");
+my @kids;
+for my $kk (1..4) {
+    my $pid = fork();
+    die "fork: $!" unless defined $pid;
+    if ($pid == 0) {
+        for my $ii (1..300) {
+            my $name = "mnt/churn/k$kk-" . ($ii % 20);
+            if (open my $fh, ">", $name) {
+                print $fh "$kk $ii\n";
+                close $fh;
+            }
+            unlink($name) if $ii % 3;
+        }
+        exit(0);
+    }
+    push @kids, $pid;
+}
+
+my $lists = 0;
+for my $ii (1..200) {
+    system("ls mnt/churn > /dev/null 2>> test.log");
+    ++$lists if $? == 0;
+}
+waitpid($_, 0) for @kids;
+ok($lists == 200, "ls while other processes create and unlink");
+
+write_text("churn/after.txt", "still here");
+ok(read_text("churn/after.txt") eq "still here",
+   "mount-mt still serves requests after the churn");
+
+my $left = `ls mnt/churn | wc -l`;
+my $want_left = grep { -e $_ } glob("mnt/churn/*");
+ok($left > 1 && $left == $want_left, "listing matches what survived the churn");
+
+unmount();
+system("rm -f test-mt.nufs");
@@ -0,0 +1,346 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <bsd/string.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "trace.h"
+#include "log.h"
+
+// a ring's owner exits: RING_RETIRED until the next dump has written its
+// records, then RING_FREE for a new thread to take over
+enum { RING_LIVE, RING_RETIRED, RING_FREE };
+
+typedef struct trace_ring {
+    uint64_t head;   // records ever written; the newest is at head - 1
+    uint32_t thread;
+    int      state;
+    trace_rec recs[TRACE_RING];
+} trace_ring;
+
+int trace_on = 0;
+
+static trace_ring* rings[TRACE_THREADS];
+static int ring_count = 0;
+static int rings_freed = 0; // times a dump has freed rings
+static int ring_full_logged = 0;
+static __thread trace_ring* my_ring = 0;
+static __thread int my_ring_tried = -1; // rings_freed when this thread last found none
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static char trace_path[256];
+static uint64_t base_ticks; // trace_clock() and monotonic ns at
+static int64_t  base_ns;    // trace_init, to work out the tick rate
+
+static const char* op_names[TOP_COUNT] = {
+    "getattr", "readdir", "mknod", "mkdir", "unlink", "link", "rmdir",
+    "rename", "chmod", "truncate", "open", "create", "release", "read",
+    "write", "utimens", "ioctl", "access", "fsync", "flush",
+};
+
+const char*
+trace_op_name(int op)
+{
+    return (op >= 0 && op < TOP_COUNT) ? op_names[op] : "?";
+}
+
+static int64_t
+mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t
+trace_clock()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    return mono_ns();
+#endif
+}
+
+static void
+on_dump_signal(int sig)
+{
+    trace_dump();
+}
+
+void
+trace_init(const char* path)
+{
+    // fuse may chdir("/") when it daemonizes
+    trace_path[0] = 0;
+    if (path[0] != '/' && getcwd(trace_path, sizeof(trace_path) - 1)) {
+        strlcat(trace_path, "/", sizeof(trace_path));
+    }
+    strlcat(trace_path, path, sizeof(trace_path));
+    base_ticks = trace_clock();
+    base_ns = mono_ns();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_dump_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, 0);
+
+    trace_on = 1;
+}
+
+// thread exit: the ring keeps its records for the next dump
+static void
+ring_release(void* arg)
+{
+    trace_ring* ring = arg;
+    __atomic_store_n(&(ring->state), RING_RETIRED, __ATOMIC_RELEASE);
+}
+
+static void
+ring_key_init()
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+// a ring a dump has freed, or a new one while there are slots left
+static trace_ring*
+ring_claim()
+{
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for (int ii = 0; ii < count && ii < TRACE_THREADS; ++ii) {
+        trace_ring* ring = __atomic_load_n(&(rings[ii]), __ATOMIC_ACQUIRE);
+        int state = RING_FREE;
+        if (ring && __atomic_compare_exchange_n(&(ring->state), &state, RING_LIVE, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&(ring->head), 0, __ATOMIC_RELEASE);
+            return ring;
+        }
+    }
+
+    int slot = __atomic_fetch_add(&ring_count, 1, __ATOMIC_RELAXED);
+    trace_ring* ring = (slot < TRACE_THREADS) ? calloc(1, sizeof(trace_ring)) : 0;
+    if (!ring) {
+        return 0;
+    }
+    ring->thread = slot;
+    __atomic_store_n(&(rings[slot]), ring, __ATOMIC_RELEASE);
+    return ring;
+}
+
+static trace_ring*
+ring_get()
+{
+    if (my_ring) {
+        return my_ring;
+    }
+    // with every ring taken, only look again once a dump has freed some
+    int freed = __atomic_load_n(&rings_freed, __ATOMIC_ACQUIRE);
+    if (freed == my_ring_tried) {
+        return 0;
+    }
+
+    pthread_once(&ring_once, ring_key_init);
+    trace_ring* ring = ring_claim();
+    if (!ring) {
+        my_ring_tried = freed;
+        if (!__atomic_exchange_n(&ring_full_logged, 1, __ATOMIC_RELAXED)) {
+            log_warn("trace: all %d rings in use; threads past that aren't traced"
+                     " until a dump frees the rings of exited ones\n", TRACE_THREADS);
+        }
+        return 0;
+    }
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+void
+trace_record(int op, int inum, int64_t offset, uint32_t size,
+             uint64_t start, uint64_t end, int result)
+{
+    if (!trace_on) {
+        return;
+    }
+    trace_ring* ring = ring_get();
+    if (!ring) {
+        return;
+    }
+
+    uint64_t head = ring->head;
+    trace_rec* rec = &(ring->recs[head & (TRACE_RING - 1)]);
+    rec->start = start;
+    rec->end = end;
+    rec->offset = offset;
+    rec->size = size;
+    rec->inum = inum;
+    rec->result = result;
+    rec->op = op;
+    rec->thread = ring->thread;
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+write_all(int fd, const void* buf, size_t size)
+{
+    const char* data = buf;
+    while (size > 0) {
+        ssize_t nn = write(fd, data, size);
+        if (nn <= 0) {
+            return;
+        }
+        data += nn;
+        size -= nn;
+    }
+}
+
+// Only async-signal-safe calls from here down, since SIGUSR1 lands
+// here. Records being written meanwhile may come out torn.
+void
+trace_dump()
+{
+    if (!trace_on) {
+        return;
+    }
+    int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return;
+    }
+
+    int count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    if (count > TRACE_THREADS) {
+        count = TRACE_THREADS;
+    }
+    int freed = 0;
+
+    trace_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.rec_size = sizeof(trace_rec);
+    for (int ii = 0; ii < count; ++ii) {
+        hdr.threads += __atomic_load_n(&(rings[ii]), __ATOMIC_ACQUIRE) != 0;
+    }
+    int64_t ns = mono_ns() - base_ns;
+    hdr.ticks_per_sec = (ns > 0) ? (uint64_t)((double)(trace_clock() - base_ticks) * 1e9 / ns) : 0;
+    write_all(fd, &hdr, sizeof(hdr));
+
+    for (int ii = 0; ii < count; ++ii) {
+        trace_ring* ring = __atomic_load_n(&(rings[ii]), __ATOMIC_ACQUIRE);
+        if (!ring) {
+            continue;
+        }
+        uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        uint64_t first = (head > TRACE_RING) ? head - TRACE_RING : 0;
+
+        trace_chunk chunk = { ring->thread, (uint32_t)(head - first) };
+        write_all(fd, &chunk, sizeof(chunk));
+
+        // oldest first: from first's slot to the end of the ring, then
+        // wrapped around to the start
+        uint32_t at = first & (TRACE_RING - 1);
+        uint32_t tail = (chunk.count < TRACE_RING - at) ? chunk.count : TRACE_RING - at;
+        write_all(fd, &(ring->recs[at]), tail * sizeof(trace_rec));
+        write_all(fd, &(ring->recs[0]), (chunk.count - tail) * sizeof(trace_rec));
+
+        // its thread is gone and its records are out; hand it on
+        int state = RING_RETIRED;
+        if (__atomic_compare_exchange_n(&(ring->state), &state, RING_FREE, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            freed = 1;
+        }
+    }
+    close(fd);
+    if (freed) {
+        __atomic_add_fetch(&rings_freed, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static int
+rec_by_start(const void* aa, const void* bb)
+{
+    const trace_rec* xx = aa;
+    const trace_rec* yy = bb;
+    return (xx->start > yy->start) - (xx->start < yy->start);
+}
+
+int
+trace_print(const char* path)
+{
+    FILE* fh = fopen(path, "r");
+    if (!fh) {
+        fprintf(stderr, "nufs: can't open trace %s\n", path);
+        return -1;
+    }
+
+    trace_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fh) != 1 || hdr.magic != TRACE_MAGIC
+        || hdr.version != TRACE_VERSION || hdr.rec_size != sizeof(trace_rec)) {
+        fprintf(stderr, "nufs: %s is not a trace\n", path);
+        fclose(fh);
+        return -1;
+    }
+
+    trace_rec* recs = 0;
+    size_t count = 0;
+    for (uint32_t ii = 0; ii < hdr.threads; ++ii) {
+        trace_chunk chunk;
+        if (fread(&chunk, sizeof(chunk), 1, fh) != 1) {
+            break;
+        }
+        recs = realloc(recs, (count + chunk.count) * sizeof(trace_rec));
+        count += fread(recs + count, sizeof(trace_rec), chunk.count, fh);
+    }
+    fclose(fh);
+    if (count == 0) {
+        printf("empty trace\n");
+        free(recs);
+        return 0;
+    }
+
+    qsort(recs, count, sizeof(trace_rec), rec_by_start);
+    double usec = hdr.ticks_per_sec ? 1e6 / hdr.ticks_per_sec : 1e-3;
+    uint64_t t0 = recs[0].start;
+
+    for (int op = 0; op < TOP_COUNT; ++op) {
+        size_t nn = 0;
+        double total = 0;
+        double worst = 0;
+        for (size_t ii = 0; ii < count; ++ii) {
+            if (recs[ii].op == op) {
+                double took = (recs[ii].end - recs[ii].start) * usec;
+                nn += 1;
+                total += took;
+                worst = (took > worst) ? took : worst;
+            }
+        }
+        if (nn == 0) {
+            continue;
+        }
+
+        printf("== %s: %zu ops, mean %.2f us, max %.2f us\n",
+               trace_op_name(op), nn, total / nn, worst);
+        for (size_t ii = 0; ii < count; ++ii) {
+            trace_rec* rec = &(recs[ii]);
+            if (rec->op != op) {
+                continue;
+            }
+            printf("  %12.3f ms  t%-3u %10.2f us  inum %-6d off %-10ld size %-8u -> %d\n",
+                   (rec->start - t0) * usec / 1000, rec->thread,
+                   (rec->end - rec->start) * usec, rec->inum,
+                   (long) rec->offset, rec->size, rec->result);
+        }
+    }
+    free(recs);
+    return 0;
+}
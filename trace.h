@@ -0,0 +1,85 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// Binary per-op tracing. Each thread appends fixed-size records to its
+// own ring, so recording takes no locks and no formatting; the rings
+// are written to a file on SIGUSR1 and at unmount, and
+// "nufstool trace FILE" decodes them. A thread's ring outlives it until
+// the next dump has written it out, then goes to the next new thread.
+
+#define TRACE_RING    4096 // records per thread, power of two
+#define TRACE_THREADS 256  // rings at once
+
+#define TRACE_MAGIC   0x4352544e // "NTRC"
+#define TRACE_VERSION 1
+
+enum trace_op {
+    TOP_GETATTR,
+    TOP_READDIR,
+    TOP_MKNOD,
+    TOP_MKDIR,
+    TOP_UNLINK,
+    TOP_LINK,
+    TOP_RMDIR,
+    TOP_RENAME,
+    TOP_CHMOD,
+    TOP_TRUNCATE,
+    TOP_OPEN,
+    TOP_CREATE,
+    TOP_RELEASE,
+    TOP_READ,
+    TOP_WRITE,
+    TOP_UTIMENS,
+    TOP_IOCTL,
+    TOP_ACCESS,
+    TOP_FSYNC,
+    TOP_FLUSH,
+    TOP_COUNT
+};
+
+typedef struct trace_rec {
+    uint64_t start;  // timestamp counter at entry
+    uint64_t end;    // and at return
+    int64_t  offset;
+    uint32_t size;
+    int32_t  inum;   // -1 when the op only had a path
+    int32_t  result;
+    uint16_t op;
+    uint16_t thread;
+} trace_rec;
+
+// file layout: trace_header, then per thread a trace_chunk followed by
+// its records, oldest first
+typedef struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t threads;
+    uint64_t ticks_per_sec;
+} trace_header;
+
+typedef struct trace_chunk {
+    uint32_t thread;
+    uint32_t count;
+} trace_chunk;
+
+extern int trace_on;
+
+// starts recording; the rings go to path on SIGUSR1 and trace_dump
+void trace_init(const char* path);
+void trace_dump();
+
+uint64_t trace_clock();
+
+// start and end are trace_clock() readings; a no-op while tracing is off
+void trace_record(int op, int inum, int64_t offset, uint32_t size,
+                  uint64_t start, uint64_t end, int result);
+
+// per-op timelines and a summary of trace file path, to stdout
+int trace_print(const char* path);
+
+const char* trace_op_name(int op);
+
+#endif
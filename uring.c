@@ -0,0 +1,298 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "uring.h"
+#include "log.h"
+
+#define URING_ENTRIES 64
+
+typedef struct ring {
+    int fd;
+    unsigned  entries;
+    unsigned* sq_tail;
+    unsigned  sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned  cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*  sq_ring;
+    size_t sq_len;
+    void*  cq_ring;
+    size_t cq_len;
+    size_t sqe_len;
+} ring;
+
+static __thread ring* my_ring = 0;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+static void
+ring_free(void* arg)
+{
+    ring* rr = arg;
+    if (rr->sqes) {
+        munmap(rr->sqes, rr->sqe_len);
+    }
+    if (rr->cq_ring && rr->cq_ring != rr->sq_ring) {
+        munmap(rr->cq_ring, rr->cq_len);
+    }
+    if (rr->sq_ring) {
+        munmap(rr->sq_ring, rr->sq_len);
+    }
+    close(rr->fd);
+    free(rr);
+}
+
+static void
+ring_key_init()
+{
+    pthread_key_create(&ring_key, ring_free);
+}
+
+static void*
+ring_map(int fd, size_t len, off_t what)
+{
+    void* pp = mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, what);
+    return (pp == MAP_FAILED) ? 0 : pp;
+}
+
+// a fresh ring; 0 with errno set if the kernel won't give us one
+static ring*
+ring_new()
+{
+    struct io_uring_params pp;
+    memset(&pp, 0, sizeof(pp));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &pp);
+    if (fd < 0) {
+        return 0;
+    }
+
+    ring* rr = calloc(1, sizeof(ring));
+    if (!rr) {
+        close(fd);
+        errno = ENOMEM;
+        return 0;
+    }
+    rr->fd = fd;
+    rr->entries = pp.sq_entries;
+    rr->sq_len = pp.sq_off.array + pp.sq_entries * sizeof(unsigned);
+    rr->cq_len = pp.cq_off.cqes + pp.cq_entries * sizeof(struct io_uring_cqe);
+    rr->sqe_len = pp.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels put both rings in one mapping
+    if (pp.features & IORING_FEAT_SINGLE_MMAP) {
+        if (rr->cq_len > rr->sq_len) {
+            rr->sq_len = rr->cq_len;
+        }
+        rr->cq_len = rr->sq_len;
+    }
+    rr->sq_ring = ring_map(fd, rr->sq_len, IORING_OFF_SQ_RING);
+    rr->cq_ring = (pp.features & IORING_FEAT_SINGLE_MMAP) ? rr->sq_ring
+                : ring_map(fd, rr->cq_len, IORING_OFF_CQ_RING);
+    rr->sqes = ring_map(fd, rr->sqe_len, IORING_OFF_SQES);
+    if (!rr->sq_ring || !rr->cq_ring || !rr->sqes) {
+        int err = errno;
+        ring_free(rr);
+        errno = err;
+        return 0;
+    }
+
+    char* sq = rr->sq_ring;
+    char* cq = rr->cq_ring;
+    rr->sq_tail = (unsigned*)(sq + pp.sq_off.tail);
+    rr->sq_mask = *(unsigned*)(sq + pp.sq_off.ring_mask);
+    rr->sq_array = (unsigned*)(sq + pp.sq_off.array);
+    rr->cq_head = (unsigned*)(cq + pp.cq_off.head);
+    rr->cq_tail = (unsigned*)(cq + pp.cq_off.tail);
+    rr->cq_mask = *(unsigned*)(cq + pp.cq_off.ring_mask);
+    rr->cqes = (struct io_uring_cqe*)(cq + pp.cq_off.cqes);
+    return rr;
+}
+
+// the calling thread's ring, set up on first use
+static ring*
+ring_get()
+{
+    if (!my_ring) {
+        my_ring = ring_new();
+        if (my_ring) {
+            pthread_once(&ring_once, ring_key_init);
+            pthread_setspecific(ring_key, my_ring);
+        }
+    }
+    return my_ring;
+}
+
+// 0 if rr's kernel has IORING_OP_READ and IORING_OP_WRITE. 5.1 to 5.5
+// set up rings without them, and without IORING_REGISTER_PROBE, so a
+// failed probe counts as a no too.
+static int
+ring_has_rw(ring* rr)
+{
+    int nops = 256;
+    struct io_uring_probe* probe = calloc(1, sizeof(struct io_uring_probe)
+                                          + nops * sizeof(struct io_uring_probe_op));
+    if (!probe) {
+        return -ENOMEM;
+    }
+    int rv = syscall(__NR_io_uring_register, rr->fd, IORING_REGISTER_PROBE, probe, nops);
+    if (rv < 0) {
+        rv = -errno;
+    }
+    else {
+        int want[] = { IORING_OP_READ, IORING_OP_WRITE };
+        for (int ii = 0; ii < 2; ++ii) {
+            if (want[ii] > probe->last_op || !(probe->ops[want[ii]].flags & IO_URING_OP_SUPPORTED)) {
+                rv = -EOPNOTSUPP;
+            }
+        }
+    }
+    free(probe);
+    return rv;
+}
+
+// tries a ring and throws it away, so nothing is left behind if the
+// caller is about to fork (as fuse_main does when it daemonizes)
+int
+uring_probe()
+{
+    ring* rr = ring_new();
+    if (!rr) {
+        return -errno;
+    }
+    int rv = ring_has_rw(rr);
+    ring_free(rr);
+    return rv;
+}
+
+// finishes one request from done bytes in with plain syscalls
+static int
+sync_one(int fd, io_req* req, uint32_t done)
+{
+    while (done < req->len) {
+        char* buf = (char*) req->buf + done;
+        ssize_t nn = req->write ? pwrite(fd, buf, req->len - done, req->off + done)
+                                : pread(fd, buf, req->len - done, req->off + done);
+        if (nn < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nn <= 0) {
+            return (nn < 0) ? -errno : -EIO;
+        }
+        done += nn;
+    }
+    return 0;
+}
+
+int
+sync_rw(int fd, io_req* reqs, int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        int rv = sync_one(fd, reqs + ii, 0);
+        if (rv < 0) {
+            return rv;
+        }
+    }
+    return 0;
+}
+
+int
+uring_rw(int fd, io_req* reqs, int count)
+{
+    ring* rr = ring_get();
+    if (!rr) {
+        return sync_rw(fd, reqs, count);
+    }
+
+    int err = 0;
+    for (int base = 0; base < count; ) {
+        int nn = count - base;
+        if (nn > (int) rr->entries) {
+            nn = rr->entries;
+        }
+
+        // only this thread touches its ring, so the tail can't move
+        // under us; the kernel just has to see the entries before it
+        unsigned tail = *(rr->sq_tail);
+        for (int ii = 0; ii < nn; ++ii) {
+            io_req* req = reqs + base + ii;
+            unsigned idx = tail & rr->sq_mask;
+            struct io_uring_sqe* sqe = rr->sqes + idx;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->addr = (uint64_t)(uintptr_t) req->buf;
+            sqe->len = req->len;
+            sqe->off = req->off;
+            sqe->user_data = base + ii;
+            rr->sq_array[idx] = idx;
+            tail += 1;
+        }
+        __atomic_store_n(rr->sq_tail, tail, __ATOMIC_RELEASE);
+
+        int to_submit = nn;
+        int in_ring = nn; // submitted or still to be, not yet reaped
+        int reaped = 0;
+        while (reaped < in_ring) {
+            int rv = syscall(__NR_io_uring_enter, rr->fd, to_submit, 1,
+                             IORING_ENTER_GETEVENTS, 0, 0);
+            if (rv < 0 && errno == EINTR) {
+                continue;
+            }
+            if (rv < 0 && to_submit > 0) {
+                // the kernel only reads the queue inside io_uring_enter,
+                // so the entries it hasn't taken can be taken back and
+                // done with pread / pwrite; then wait out the rest
+                log_warn("nufs: io_uring_enter: %s\n", strerror(errno));
+                tail -= to_submit;
+                __atomic_store_n(rr->sq_tail, tail, __ATOMIC_RELEASE);
+                for (int ii = nn - to_submit; ii < nn; ++ii) {
+                    int res = sync_one(fd, reqs + base + ii, 0);
+                    if (res < 0 && !err) {
+                        err = res;
+                    }
+                }
+                in_ring -= to_submit;
+                to_submit = 0;
+                continue;
+            }
+            if (rv < 0) {
+                // can't wait for what's in flight, which may still land
+                // in its buffers; the ring can't be unmapped under it,
+                // so leave it be and make a fresh one next call
+                err = -errno;
+                log_warn("nufs: io_uring_enter: %s; abandoning the ring\n", strerror(errno));
+                pthread_setspecific(ring_key, 0);
+                my_ring = 0;
+                return err;
+            }
+            to_submit -= rv;
+
+            unsigned head = *(rr->cq_head);
+            unsigned end = __atomic_load_n(rr->cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != end; ++head) {
+                struct io_uring_cqe* cqe = rr->cqes + (head & rr->cq_mask);
+                io_req* req = reqs + cqe->user_data;
+                int res = cqe->res;
+                if (res >= 0 && (uint32_t) res < req->len) {
+                    res = sync_one(fd, req, res);
+                }
+                if (res < 0 && !err) {
+                    err = res;
+                }
+                reaped += 1;
+            }
+            __atomic_store_n(rr->cq_head, head, __ATOMIC_RELEASE);
+        }
+        base += nn;
+    }
+    return err;
+}
@@ -0,0 +1,27 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+
+// Minimal io_uring, straight on the syscalls (no liburing): each thread
+// gets its own small ring the first time it does I/O, so submitting
+// never takes a lock. The cache hands it a batch of page reads and
+// writes and gets control back once all of them have completed.
+
+typedef struct io_req {
+    int64_t  off;
+    void*    buf;
+    uint32_t len;
+    int      write;
+} io_req;
+
+// 0 if the kernel lets the calling thread set up a ring and has its
+// read and write ops (5.6 on), else -errno
+int uring_probe();
+// does every request in reqs against fd, up to a ring's worth at a time;
+// 0 once all are done, or the first failure's -errno
+int uring_rw(int fd, io_req* reqs, int count);
+// the same with pread / pwrite, one request at a time
+int sync_rw(int fd, io_req* reqs, int count);
+
+#endif
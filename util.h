@@ -3,6 +3,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "slist.h"
 static int
@@ -30,7 +31,7 @@ clamp(int x, int v0, int v1)
 }
 
 static int
-bytes_to_pages(int bytes)
+bytes_to_pages(int64_t bytes)
 {
     int quo = bytes / 4096;
     int rem = bytes % 4096;
@@ -62,6 +63,22 @@ path_join(const char* aa, const char* bb)
     return cc;
 }
 
+// parses "4096", "64M", "2G", ...
+static int64_t
+parse_size(const char* text)
+{
+    char* end;
+    int64_t nn = strtoll(text, &end, 10);
+    switch (*end) {
+    case 'k': case 'K': nn <<= 10; break;
+    case 'm': case 'M': nn <<= 20; break;
+    case 'g': case 'G': nn <<= 30; break;
+    case 0: break;
+    default: return -1;
+    }
+    return nn;
+}
+
 static void
 assert_ok_real(long rv, const char* file, const int line)
 {
@@ -74,37 +91,6 @@ assert_ok_real(long rv, const char* file, const int line)
 }
 
 
-static char*
-get_parent(const char* path)
-{
-    int i = 0;
-    int n = 0;
-    char* hi = malloc(48 * sizeof(char));
-    char ch;
-    int slash = 0;
-    int length = strlen(path);
-   while (i < length){
-
-       ch = path[i];
-       if(ch == '/'){
-           slash = i;
-           n++;
-       }
-      i++;
-   }
-   if(n == 1){
-       return "/";
-   }else{
-       memset(hi, '\0', 48);
-       strncpy(hi, path, slash);
-       hi[slash] = '\0';
-       return hi;
-   }
-}
-
-
-
-
 #define assert_ok(rv) assert_ok_real(rv, __FILE__, __LINE__)
 
 #endif